@@ -0,0 +1,245 @@
+#include "AsyncReader.hpp"
+#include "IOStats.hpp"
+#include <cstring>
+#include <cerrno>
+#include <deque>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+AsyncReader::~AsyncReader(){
+    {
+        std::lock_guard<std::mutex> lock(poolMutex);
+        stopping = true;
+    }
+    batchReady.notify_all();
+    for (auto& w : workers)
+        w.join();
+    closeRing();
+}
+
+bool AsyncReader::usesIOUring(){
+    std::lock_guard<std::mutex> lock(batchMutex);
+    setup();
+    return ringFd >= 0;
+}
+
+void AsyncReader::readAll(int fd, const std::vector<DirectRead>& reads){
+    if (reads.empty())
+        return;
+    //batch of another thread holds the ring, this one reads on its own instead of waiting
+    std::unique_lock<std::mutex> lock(batchMutex, std::try_to_lock);
+    if (!lock.owns_lock()){
+        for (const auto& read : reads)
+            readRest(fd, read, 0);
+        return;
+    }
+    setup();
+    STAT_ADD(ReadBatches, 1);
+    if (ringFd >= 0)
+        ringReadAll(fd, reads);
+    else
+        poolReadAll(fd, reads);
+}
+
+void AsyncReader::setup(){
+    if (initialized)
+        return;
+    initialized = true;
+    //io_uring missing or forbidden (old kernel, seccomp)
+    if (!setupRing())
+        startPool();
+}
+
+void AsyncReader::startPool(){
+    for (size_t i = 0; i < ASYNC_READER_THREADS; i++)
+        workers.emplace_back(&AsyncReader::poolWorker, this);
+}
+
+bool AsyncReader::setupRing(){
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    int fd = syscall(__NR_io_uring_setup, ASYNC_READER_DEPTH, &params);
+    if (fd < 0)
+        return false;
+    ringFd = fd;
+    sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool singleMmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (singleMmap)
+        sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+    sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+    if (sqRing == MAP_FAILED){
+        sqRing = nullptr;
+        closeRing();
+        return false;
+    }
+    cqRing = singleMmap ? sqRing : mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+    sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    sqes = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+    if (cqRing == MAP_FAILED || sqes == MAP_FAILED){
+        if (cqRing == MAP_FAILED)
+            cqRing = nullptr;
+        if (sqes == MAP_FAILED)
+            sqes = nullptr;
+        closeRing();
+        return false;
+    }
+    u_int8_t* sq = (u_int8_t*)sqRing;
+    u_int8_t* cq = (u_int8_t*)cqRing;
+    sqHead = (unsigned*)(sq + params.sq_off.head);
+    sqTail = (unsigned*)(sq + params.sq_off.tail);
+    sqMask = (unsigned*)(sq + params.sq_off.ring_mask);
+    sqArray = (unsigned*)(sq + params.sq_off.array);
+    sqEntries = params.sq_entries;
+    cqHead = (unsigned*)(cq + params.cq_off.head);
+    cqTail = (unsigned*)(cq + params.cq_off.tail);
+    cqMask = (unsigned*)(cq + params.cq_off.ring_mask);
+    cqes = cq + params.cq_off.cqes;
+    return true;
+#else
+    return false;
+#endif
+}
+
+void AsyncReader::closeRing(){
+    if (sqes)
+        munmap(sqes, sqesSize);
+    if (cqRing && cqRing != sqRing)
+        munmap(cqRing, cqRingSize);
+    if (sqRing)
+        munmap(sqRing, sqRingSize);
+    sqes = cqRing = sqRing = nullptr;
+    if (ringFd >= 0)
+        ::close(ringFd);
+    ringFd = -1;
+}
+
+void AsyncReader::ringReadAll(int fd, const std::vector<DirectRead>& reads){
+    std::vector<size_t> done(reads.size(), 0);
+    std::deque<size_t> waiting; // reads (or their rest after a short read) not submitted yet
+    for (size_t i = 0; i < reads.size(); i++)
+        if (reads[i].bytesNum > 0)
+            waiting.push_back(i);
+    std::vector<size_t> failed; // finished again with pread, which reports the error
+    unsigned inFlight = 0;
+    unsigned tail = __atomic_load_n(sqTail, __ATOMIC_RELAXED);
+    while (!waiting.empty() || inFlight > 0){
+        while (!waiting.empty() && inFlight < sqEntries){
+            size_t i = waiting.front();
+            waiting.pop_front();
+            unsigned index = tail & *sqMask;
+            io_uring_sqe* sqe = (io_uring_sqe*)sqes + index;
+            std::memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_READ;
+            sqe->fd = fd;
+            sqe->addr = u_int64_t((u_int8_t*)reads[i].buffer + done[i]);
+            sqe->len = std::min(reads[i].bytesNum - done[i], size_t(1u << 30));
+            sqe->off = reads[i].addr + done[i];
+            sqe->user_data = i;
+            sqArray[index] = index;
+            tail++;
+            inFlight++;
+            STAT_ADD(Reads, 1);
+        }
+        __atomic_store_n(sqTail, tail, __ATOMIC_RELEASE);
+        unsigned toSubmit = tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+        int entered = syscall(__NR_io_uring_enter, ringFd, toSubmit, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+        if (entered < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY && toSubmit == inFlight){
+            //kernel refuses the reads and holds none of them, this and following batches use the pool
+            closeRing();
+            startPool();
+            for (size_t i = 0; i < reads.size(); i++)
+                readRest(fd, reads[i], done[i]);
+            return;
+        }
+        unsigned head = __atomic_load_n(cqHead, __ATOMIC_RELAXED);
+        unsigned completed = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+        for (; head != completed; head++){
+            const io_uring_cqe* cqe = (const io_uring_cqe*)cqes + (head & *cqMask);
+            size_t i = cqe->user_data;
+            inFlight--;
+            if (cqe->res == -EINTR || cqe->res == -EAGAIN)
+                waiting.push_back(i);
+            else if (cqe->res < 0)
+                failed.push_back(i);
+            else if (cqe->res == 0){
+                std::memset((u_int8_t*)reads[i].buffer + done[i], 0, reads[i].bytesNum - done[i]);
+                done[i] = reads[i].bytesNum;
+            }
+            else{
+                done[i] += cqe->res;
+                STAT_ADD(BytesRead, cqe->res);
+                if (done[i] < reads[i].bytesNum)
+                    waiting.push_back(i);
+            }
+        }
+        __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+    }
+    //all reads are finished, buffers are no longer used by the kernel
+    for (size_t i : failed)
+        readRest(fd, reads[i], done[i]);
+}
+
+void AsyncReader::poolReadAll(int fd, const std::vector<DirectRead>& reads){
+    std::unique_lock<std::mutex> lock(poolMutex);
+    batchFd = fd;
+    batchReads = &reads;
+    nextRead = 0;
+    readsLeft = reads.size();
+    batchError = nullptr;
+    batchReady.notify_all();
+    batchDone.wait(lock, [this](){
+        return readsLeft == 0;
+    });
+    batchReads = nullptr;
+    if (batchError)
+        throw batchError;
+}
+
+void AsyncReader::poolWorker(){
+    std::unique_lock<std::mutex> lock(poolMutex);
+    while (true){
+        batchReady.wait(lock, [this](){
+            return stopping || (batchReads && nextRead < batchReads->size());
+        });
+        if (stopping)
+            return;
+        DirectRead read = (*batchReads)[nextRead++];
+        int fd = batchFd;
+        lock.unlock();
+        const char* error = nullptr;
+        try{
+            readRest(fd, read, 0);
+        }
+        catch (const char* e){
+            error = e;
+        }
+        lock.lock();
+        if (error)
+            batchError = error;
+        if (--readsLeft == 0)
+            batchDone.notify_all();
+    }
+}
+
+void AsyncReader::readRest(int fd, const DirectRead& read, size_t done){
+    u_int8_t* buffer = (u_int8_t*)read.buffer;
+    while (done < read.bytesNum){
+        ssize_t n = ::pread(fd, buffer + done, read.bytesNum - done, read.addr + done);
+        STAT_ADD(Reads, 1);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            throw "Could not read from disk file";
+        if (n == 0){
+            std::memset(buffer + done, 0, read.bytesNum - done);
+            return;
+        }
+        STAT_ADD(BytesRead, n);
+        done += n;
+    }
+}
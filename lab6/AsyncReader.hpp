@@ -0,0 +1,76 @@
+#ifndef ASYNCREADER_HPP
+#define ASYNCREADER_HPP
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <sys/types.h>
+
+#define ASYNC_READER_DEPTH 32 // reads kept in flight at once
+#define ASYNC_READER_THREADS 4 // workers of the fallback when io_uring is not available
+
+struct DirectRead{
+    u_int64_t addr=0;
+    void* buffer=nullptr;
+    size_t bytesNum=0;
+};
+
+// Batches of reads from one descriptor kept in flight together, so the
+// device sees many requests at once instead of one after another. Uses
+// io_uring through raw syscalls when the kernel allows it, otherwise a
+// small pool of threads doing pread. Set up on the first batch, one batch
+// at a time (batches of other threads meanwhile read one by one), readAll
+// returns when every read of it is done. Reads beyond the end of the file
+// read as zeros, like BlockDevice transfers.
+class AsyncReader{
+    public:
+    AsyncReader() = default;
+    ~AsyncReader();
+    AsyncReader(const AsyncReader&) = delete;
+    AsyncReader& operator=(const AsyncReader&) = delete;
+    void readAll(int fd, const std::vector<DirectRead>& reads);
+    bool usesIOUring();
+    private:
+    void setup();
+    bool setupRing();
+    void startPool();
+    void closeRing();
+    void ringReadAll(int fd, const std::vector<DirectRead>& reads);
+    void poolReadAll(int fd, const std::vector<DirectRead>& reads);
+    void poolWorker();
+    static void readRest(int fd, const DirectRead& read, size_t done); // with pread, throws on error
+
+    private:
+    std::mutex batchMutex; // one batch at a time
+    bool initialized=false;
+    // io_uring, rings shared with the kernel
+    int ringFd=-1;
+    void* sqRing=nullptr;
+    size_t sqRingSize=0;
+    void* cqRing=nullptr; // same as sqRing with single mmap
+    size_t cqRingSize=0;
+    void* sqes=nullptr;
+    size_t sqesSize=0;
+    unsigned* sqHead=nullptr;
+    unsigned* sqTail=nullptr;
+    unsigned* sqMask=nullptr;
+    unsigned* sqArray=nullptr;
+    unsigned sqEntries=0;
+    unsigned* cqHead=nullptr;
+    unsigned* cqTail=nullptr;
+    unsigned* cqMask=nullptr;
+    void* cqes=nullptr;
+    // fallback pool, workers take reads of the current batch by index
+    std::vector<std::thread> workers;
+    std::mutex poolMutex;
+    std::condition_variable batchReady;
+    std::condition_variable batchDone;
+    int batchFd=-1;
+    const std::vector<DirectRead>* batchReads=nullptr;
+    size_t nextRead=0;
+    size_t readsLeft=0;
+    const char* batchError=nullptr;
+    bool stopping=false;
+};
+#endif
@@ -0,0 +1,152 @@
+#include "BitMap.hpp"
+#include <algorithm>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+BitMap::BitMap(size_t bitsNum){
+    resize(bitsNum);
+}
+
+void BitMap::resize(size_t bitsNum){
+    this->bitsNum = bitsNum;
+    words.assign((bitsNum + 63) / 64, 0);
+    setBitsNum = 0;
+    firstFreeWordHint = 0;
+    dirtyChunks.clear();
+}
+
+size_t BitMap::size() const{
+    return bitsNum;
+}
+
+size_t BitMap::bytesSize() const{
+    return (bitsNum + 7) / 8;
+}
+
+bool BitMap::operator[](size_t i) const{
+    return (words[i / 64] >> (i % 64)) & 1;
+}
+
+void BitMap::set(size_t i){
+    u_int64_t& word = words[i / 64];
+    u_int64_t mask = u_int64_t(1) << (i % 64);
+    if (word & mask)
+        return;
+    word |= mask;
+    setBitsNum++;
+    markDirty(i);
+    while (firstFreeWordHint < words.size() && words[firstFreeWordHint] == ~u_int64_t(0))
+        firstFreeWordHint++;
+}
+
+void BitMap::reset(size_t i){
+    u_int64_t& word = words[i / 64];
+    u_int64_t mask = u_int64_t(1) << (i % 64);
+    if (!(word & mask))
+        return;
+    word &= ~mask;
+    setBitsNum--;
+    markDirty(i);
+    firstFreeWordHint = std::min(firstFreeWordHint, i / 64);
+}
+
+size_t BitMap::count() const{
+    return setBitsNum;
+}
+
+size_t BitMap::freeNum() const{
+    return bitsNum - setBitsNum;
+}
+
+size_t BitMap::findFree(size_t from) const{
+    if (from >= bitsNum)
+        return npos;
+    size_t w = std::max(from / 64, firstFreeWordHint);
+    if (w == from / 64){
+        // bits before from in the first word do not count
+        u_int64_t freeBits = ~words[w] & (~u_int64_t(0) << (from % 64));
+        if (freeBits){
+            size_t i = w * 64 + __builtin_ctzll(freeBits);
+            return i < bitsNum ? i : npos;
+        }
+        w++;
+    }
+    w = findFreeWord(w);
+    if (w == npos)
+        return npos;
+    size_t i = w * 64 + __builtin_ctzll(~words[w]);
+    return i < bitsNum ? i : npos;
+}
+
+size_t BitMap::findUsed(size_t from) const{
+    if (from >= bitsNum)
+        return npos;
+    size_t w = from / 64;
+    u_int64_t usedBits = words[w] & (~u_int64_t(0) << (from % 64));
+    while (!usedBits){
+        if (++w >= words.size())
+            return npos;
+        usedBits = words[w];
+    }
+    return w * 64 + __builtin_ctzll(usedBits);
+}
+
+size_t BitMap::findFreeWord(size_t fromWord) const{
+    size_t w = fromWord;
+#ifdef __SSE2__
+    // skip two full words per compare
+    const __m128i full = _mm_set1_epi32(-1);
+    for (; w + 2 <= words.size(); w += 2){
+        __m128i pair = _mm_loadu_si128((const __m128i*)&words[w]);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(pair, full)) != 0xFFFF)
+            break;
+    }
+#endif
+    for (; w < words.size(); w++)
+        if (words[w] != ~u_int64_t(0))
+            return w;
+    return npos;
+}
+
+u_int8_t* BitMap::bytes(){
+    return (u_int8_t*)words.data();
+}
+
+const u_int8_t* BitMap::bytes() const{
+    return (const u_int8_t*)words.data();
+}
+
+void BitMap::bytesLoaded(){
+    // bits past the end of the map must stay clear
+    if (bitsNum % 64)
+        words.back() &= (u_int64_t(1) << (bitsNum % 64)) - 1;
+    setBitsNum = 0;
+    for (u_int64_t word : words)
+        setBitsNum += __builtin_popcountll(word);
+    firstFreeWordHint = 0;
+    dirtyChunks.clear();
+    while (firstFreeWordHint < words.size() && words[firstFreeWordHint] == ~u_int64_t(0))
+        firstFreeWordHint++;
+}
+
+std::vector<std::pair<size_t, size_t>> BitMap::dirtyRanges() const{
+    std::vector<std::pair<size_t, size_t>> ranges;
+    for (size_t chunk : dirtyChunks){
+        size_t offset = chunk * BITMAP_DIRTY_CHUNK_SIZE;
+        size_t size = std::min(size_t(BITMAP_DIRTY_CHUNK_SIZE), bytesSize() - offset);
+        if (!ranges.empty() && ranges.back().first + ranges.back().second == offset)
+            ranges.back().second += size;
+        else
+            ranges.push_back({offset, size});
+    }
+    return ranges;
+}
+
+void BitMap::clearDirty(){
+    dirtyChunks.clear();
+}
+
+void BitMap::markDirty(size_t i){
+    dirtyChunks.insert(i / 8 / BITMAP_DIRTY_CHUNK_SIZE);
+}
@@ -0,0 +1,49 @@
+#ifndef BITMAP_HPP
+#define BITMAP_HPP
+
+#include <vector>
+#include <set>
+#include <utility>
+#include <sys/types.h>
+
+#define BITMAP_DIRTY_CHUNK_SIZE 512 // bitmap bytes saved together when any of their bits changes
+
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "BitMap words are stored on disk as they are in memory");
+
+// Bits packed into 64-bit words. On little endian hosts the words are
+// byte for byte the on-disk bitmap (bit i in byte i/8 at position i%8),
+// so loading and saving is a plain copy of bytes().
+// Number of set bits is kept up to date by set()/reset().
+// Chunks modified since the last clearDirty() are remembered so that only
+// they have to be written back.
+class BitMap{
+    public:
+    static const size_t npos = size_t(-1);
+    BitMap(size_t bitsNum = 0);
+    void resize(size_t bitsNum);
+    size_t size() const;
+    size_t bytesSize() const;
+    bool operator[](size_t i) const;
+    void set(size_t i);
+    void reset(size_t i);
+    size_t count() const;
+    size_t freeNum() const;
+    size_t findFree(size_t from = 0) const; // first clear bit at or after from, npos if none
+    size_t findUsed(size_t from = 0) const; // first set bit at or after from, npos if none
+    u_int8_t* bytes();
+    const u_int8_t* bytes() const;
+    void bytesLoaded(); // call after bytes() were overwritten, recounts with popcount
+    std::vector<std::pair<size_t, size_t>> dirtyRanges() const; // {offset, size} in bytes, neighbouring chunks merged
+    void clearDirty();
+    private:
+    size_t findFreeWord(size_t fromWord) const;
+    void markDirty(size_t i);
+
+    private:
+    std::vector<u_int64_t> words;
+    size_t bitsNum=0;
+    size_t setBitsNum=0;
+    size_t firstFreeWordHint=0; // no clear bit in words before it
+    std::set<size_t> dirtyChunks;
+};
+#endif
@@ -0,0 +1,548 @@
+#include "BlockDevice.hpp"
+#include "IOStats.hpp"
+#include "FNV1a.hpp"
+#include <cstring>
+#include <iostream>
+#include <algorithm>
+#include <vector>
+#include <new>
+#include <iterator>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+BlockDevice::BlockDevice(size_t cachePagesNum) : cachePagesNum(cachePagesNum > 0 ? cachePagesNum : 1){}
+
+BlockDevice::~BlockDevice(){
+    try{
+        close();
+    }
+    catch (...){
+        // destructor must not throw, dirty pages are lost in that case
+    }
+}
+
+void BlockDevice::open(const std::string& diskName, bool mapped, bool readOnly){
+    close();
+    this->readOnly = readOnly;
+    fd = ::open(diskName.c_str(), readOnly ? O_RDONLY : O_RDWR);
+    if (fd < 0)
+        throw "Could not open disk file";
+    STAT_ADD(DiskOpens, 1);
+    if (!mapped)
+        return;
+    struct stat diskStat;
+    if (fstat(fd, &diskStat) != 0 || diskStat.st_size == 0){
+        close();
+        throw "Could not map disk file";
+    }
+    void* addr = mmap(nullptr, diskStat.st_size, readOnly ? PROT_READ : PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED){
+        close();
+        throw "Could not map disk file";
+    }
+    mapping = (u_int8_t*)addr;
+    mappingSize = diskStat.st_size;
+}
+
+void BlockDevice::close(){
+    if (fd < 0)
+        return;
+    //mapped data first, the journal commit in flush() may point at it
+    if (mapping)
+        syncDirect();
+    flush();
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    if (journalPagesNum > 0){
+        //read only use leaves the journal as it is, no writes or syncs
+        bool dirty = !journaledPages.empty() || std::any_of(pages.begin(), pages.end(), [](const Page& page){ return page.dirty; });
+        if (dirty)
+            checkpointJournal();
+        journalPagesNum = 0;
+        journaledPages.clear();
+    }
+    pages.clear();
+    pagesMap.clear();
+    dirtyPagesNum = 0;
+    replayedImages.clear();
+    if (mapping){
+        munmap(mapping, mappingSize);
+        mapping = nullptr;
+        mappingSize = 0;
+    }
+    ::close(fd);
+    fd = -1;
+}
+
+bool BlockDevice::isOpen() const{
+    return fd >= 0;
+}
+
+bool BlockDevice::isMapped() const{
+    return mapping != nullptr;
+}
+
+bool BlockDevice::isReadOnly() const{
+    return readOnly;
+}
+
+bool BlockDevice::metadataCached() const{
+    return !mapping || journalPagesNum > 0;
+}
+
+u_int8_t* BlockDevice::mappedData(u_int64_t addr, size_t bytesNum){
+    if (!mapping)
+        return nullptr;
+    if (addr + bytesNum > mappingSize)
+        throw "Access beyond end of mapped disk";
+    return mapping + addr;
+}
+
+void BlockDevice::read(u_int64_t addr, void* buffer, size_t bytesNum){
+    if (!metadataCached()){
+        std::memcpy(buffer, mappedData(addr, bytesNum), bytesNum);
+        STAT_ADD(MappedBytesRead, bytesNum);
+        return;
+    }
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    u_int8_t* out = (u_int8_t*)buffer;
+    while (bytesNum > 0){
+        u_int64_t pageIndex = addr / BLOCK_DEVICE_PAGE_SIZE;
+        size_t offset = addr % BLOCK_DEVICE_PAGE_SIZE;
+        size_t chunk = std::min(bytesNum, BLOCK_DEVICE_PAGE_SIZE - offset);
+        Page& page = getPage(pageIndex, false);
+        std::memcpy(out, page.data + offset, chunk);
+        out += chunk;
+        addr += chunk;
+        bytesNum -= chunk;
+    }
+}
+
+void BlockDevice::write(u_int64_t addr, const void* buffer, size_t bytesNum){
+    if (readOnly)
+        throw "Disk is opened read only";
+    if (!metadataCached()){
+        std::memcpy(mappedData(addr, bytesNum), buffer, bytesNum);
+        markMappedDirty(addr, bytesNum);
+        STAT_ADD(MappedBytesWritten, bytesNum);
+        return;
+    }
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    const u_int8_t* in = (const u_int8_t*)buffer;
+    while (bytesNum > 0){
+        u_int64_t pageIndex = addr / BLOCK_DEVICE_PAGE_SIZE;
+        size_t offset = addr % BLOCK_DEVICE_PAGE_SIZE;
+        size_t chunk = std::min(bytesNum, BLOCK_DEVICE_PAGE_SIZE - offset);
+        Page& page = getPage(pageIndex, chunk == BLOCK_DEVICE_PAGE_SIZE);
+        if (page.dirty && page.journaled)
+            committedImages[page.index].assign(page.data, page.data + BLOCK_DEVICE_PAGE_SIZE);
+        std::memcpy(page.data + offset, in, chunk);
+        if (!page.dirty)
+            dirtyPagesNum++;
+        page.dirty = true;
+        page.journaled = false;
+        in += chunk;
+        addr += chunk;
+        bytesNum -= chunk;
+    }
+}
+
+void BlockDevice::readDirect(u_int64_t addr, void* buffer, size_t bytesNum){
+    if (mapping){
+        std::memcpy(buffer, mappedData(addr, bytesNum), bytesNum);
+        STAT_ADD(MappedBytesRead, bytesNum);
+    }
+    else{
+        if (fd < 0)
+            throw "Disk is not opened";
+        transferAll(false, addr, (u_int8_t*)buffer, bytesNum);
+    }
+    //replayed images never change after openJournal
+    copyReplayedImages(addr, (u_int8_t*)buffer, bytesNum);
+    if (dirtyPagesNum == 0)
+        return;
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    copyDirtyPages(addr, (u_int8_t*)buffer, bytesNum);
+}
+
+void BlockDevice::readDirectAll(const std::vector<DirectRead>& reads){
+    if (mapping){
+        for (const auto& read : reads)
+            readDirect(read.addr, read.buffer, read.bytesNum);
+        return;
+    }
+    if (fd < 0)
+        throw "Disk is not opened";
+#ifndef FS_NO_STATS
+    for (const auto& read : reads)
+        STAT_ADD(Seeks, lastTransferEnd.exchange(read.addr + read.bytesNum, std::memory_order_relaxed) != read.addr);
+#endif
+    reader.readAll(fd, reads);
+    for (const auto& read : reads)
+        copyReplayedImages(read.addr, (u_int8_t*)read.buffer, read.bytesNum);
+    if (dirtyPagesNum == 0)
+        return;
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    for (const auto& read : reads)
+        copyDirtyPages(read.addr, (u_int8_t*)read.buffer, read.bytesNum);
+}
+
+void BlockDevice::copyDirtyPages(u_int64_t addr, u_int8_t* buffer, size_t bytesNum){
+    // cached dirty pages are newer than the disk file
+    for (u_int64_t i = addr / BLOCK_DEVICE_PAGE_SIZE; bytesNum > 0 && i <= (addr + bytesNum - 1) / BLOCK_DEVICE_PAGE_SIZE; i++){
+        auto found = pagesMap.find(i);
+        if (found == pagesMap.end() || !found->second->dirty)
+            continue;
+        u_int64_t pageAddr = i * BLOCK_DEVICE_PAGE_SIZE;
+        u_int64_t from = std::max(pageAddr, addr);
+        u_int64_t to = std::min(pageAddr + BLOCK_DEVICE_PAGE_SIZE, addr + bytesNum);
+        std::memcpy(buffer + (from - addr), found->second->data + (from - pageAddr), to - from);
+    }
+}
+
+void BlockDevice::copyReplayedImages(u_int64_t addr, u_int8_t* buffer, size_t bytesNum){
+    if (replayedImages.empty())
+        return;
+    for (u_int64_t i = addr / BLOCK_DEVICE_PAGE_SIZE; bytesNum > 0 && i <= (addr + bytesNum - 1) / BLOCK_DEVICE_PAGE_SIZE; i++){
+        auto found = replayedImages.find(i);
+        if (found == replayedImages.end())
+            continue;
+        u_int64_t pageAddr = i * BLOCK_DEVICE_PAGE_SIZE;
+        u_int64_t from = std::max(pageAddr, addr);
+        u_int64_t to = std::min(pageAddr + BLOCK_DEVICE_PAGE_SIZE, addr + bytesNum);
+        std::memcpy(buffer + (from - addr), found->second.data() + (from - pageAddr), to - from);
+    }
+}
+
+void BlockDevice::writeDirect(u_int64_t addr, const void* buffer, size_t bytesNum){
+    if (readOnly)
+        throw "Disk is opened read only";
+    if (fd < 0)
+        throw "Disk is not opened";
+    if (journalPagesNum > 0 && bytesNum > 0){
+        // replay would overwrite the data with older images of reused metadata pages
+        std::lock_guard<std::mutex> lock(cacheMutex);
+        auto logged = journaledPages.lower_bound(addr / BLOCK_DEVICE_PAGE_SIZE);
+        if (logged != journaledPages.end() && *logged <= (addr + bytesNum - 1) / BLOCK_DEVICE_PAGE_SIZE)
+            checkpointJournal();
+    }
+    if (mapping){
+        std::memcpy(mappedData(addr, bytesNum), buffer, bytesNum);
+        markMappedDirty(addr, bytesNum);
+        STAT_ADD(MappedBytesWritten, bytesNum);
+    }
+    else
+        transferAll(true, addr, (u_int8_t*)buffer, bytesNum);
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    updateCachedPages(addr, (const u_int8_t*)buffer, bytesNum);
+}
+
+void BlockDevice::updateCachedPages(u_int64_t addr, const u_int8_t* buffer, size_t bytesNum){
+    for (u_int64_t i = addr / BLOCK_DEVICE_PAGE_SIZE; bytesNum > 0 && i <= (addr + bytesNum - 1) / BLOCK_DEVICE_PAGE_SIZE; i++){
+        auto found = pagesMap.find(i);
+        if (found == pagesMap.end())
+            continue;
+        u_int64_t pageAddr = i * BLOCK_DEVICE_PAGE_SIZE;
+        u_int64_t from = std::max(pageAddr, addr);
+        u_int64_t to = std::min(pageAddr + BLOCK_DEVICE_PAGE_SIZE, addr + bytesNum);
+        std::memcpy(found->second->data + (from - pageAddr), buffer + (from - addr), to - from);
+    }
+}
+
+void BlockDevice::flush(){
+    if (fd < 0)
+        return;
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    if (journalPagesNum > 0){
+        commitJournal();
+        return;
+    }
+    if (mapping){
+        syncMappedPages();
+        return;
+    }
+    for (auto& page : pages)
+        if (page.dirty)
+            writeBackPage(page);
+}
+
+void BlockDevice::syncDirect(){
+    if (fd < 0)
+        return;
+    if (mapping){
+        std::lock_guard<std::mutex> lock(cacheMutex);
+        syncMappedPages();
+        return;
+    }
+    sync();
+}
+
+void BlockDevice::syncMappedPages(){
+    //sync neighbouring dirty pages with one msync
+    u_int64_t systemPageSize = sysconf(_SC_PAGESIZE);
+    auto page = mappedDirtyPages.begin();
+    while (page != mappedDirtyPages.end()){
+        u_int64_t first = *page, last = *page;
+        while (++page != mappedDirtyPages.end() && *page == last + 1)
+            last = *page;
+        u_int64_t from = first * BLOCK_DEVICE_PAGE_SIZE / systemPageSize * systemPageSize;
+        u_int64_t to = std::min((last + 1) * BLOCK_DEVICE_PAGE_SIZE, mappingSize);
+        if (msync(mapping + from, to - from, MS_SYNC) != 0)
+            throw "Could not sync mapped disk";
+        STAT_ADD(Syncs, 1);
+    }
+    mappedDirtyPages.clear();
+}
+
+BlockDevice::Page& BlockDevice::getPage(u_int64_t pageIndex, bool wholePageOverwritten){
+    if (fd < 0)
+        throw "Disk is not opened";
+    auto found = pagesMap.find(pageIndex);
+    if (found != pagesMap.end()){
+        pages.splice(pages.begin(), pages, found->second);
+        STAT_ADD(CacheHits, 1);
+        return pages.front();
+    }
+    STAT_ADD(CacheMisses, 1);
+    if (pages.size() >= cachePagesNum)
+        evictPage();
+    pages.emplace_front();
+    Page& page = pages.front();
+    page.index = pageIndex;
+    if (!wholePageOverwritten)
+        loadPage(page);
+    pagesMap[pageIndex] = pages.begin();
+    return page;
+}
+
+void BlockDevice::loadPage(Page& page){
+    try{
+        transferAll(false, page.index * BLOCK_DEVICE_PAGE_SIZE, page.data, BLOCK_DEVICE_PAGE_SIZE);
+        copyReplayedImages(page.index * BLOCK_DEVICE_PAGE_SIZE, page.data, BLOCK_DEVICE_PAGE_SIZE);
+    }
+    catch (const char*){
+        pagesMap.erase(page.index);
+        pages.pop_front();
+        throw;
+    }
+}
+
+void BlockDevice::writeBackPage(Page& page){
+    transferAll(true, page.index * BLOCK_DEVICE_PAGE_SIZE, page.data, BLOCK_DEVICE_PAGE_SIZE);
+    STAT_ADD(CacheWriteBacks, 1);
+    if (page.dirty)
+        dirtyPagesNum--;
+    page.dirty = false;
+    page.journaled = false;
+}
+
+void BlockDevice::transferAll(bool writing, u_int64_t addr, u_int8_t* buffer, size_t bytesNum){
+    STAT_ADD(Seeks, lastTransferEnd.exchange(addr + bytesNum, std::memory_order_relaxed) != addr);
+    size_t done = 0;
+    while (done < bytesNum){
+        ssize_t n = writing ? ::pwrite(fd, buffer + done, bytesNum - done, addr + done)
+                            : ::pread(fd, buffer + done, bytesNum - done, addr + done);
+        if (writing)
+            STAT_ADD(Writes, 1);
+        else
+            STAT_ADD(Reads, 1);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            throw writing ? "Could not write to disk file" : "Could not read from disk file";
+        if (n == 0){
+            if (writing)
+                throw "Could not write to disk file";
+            // beyond end of the disk file reads as zeros
+            std::memset(buffer + done, 0, bytesNum - done);
+            return;
+        }
+        if (writing)
+            STAT_ADD(BytesWritten, n);
+        else
+            STAT_ADD(BytesRead, n);
+        done += n;
+    }
+}
+
+void BlockDevice::evictPage(){
+    // pages of an uncommitted transaction stay, the cache grows instead until commitDue makes a batch commit
+    auto victim = std::prev(pages.end());
+    while (journalPagesNum > 0 && victim->dirty && !victim->journaled){
+        if (victim == pages.begin())
+            return;
+        victim--;
+    }
+    if (victim->dirty)
+        writeBackPage(*victim);
+    STAT_ADD(CacheEvictions, 1);
+    pagesMap.erase(victim->index);
+    pages.erase(victim);
+}
+
+bool BlockDevice::commitDue(){
+    //uncommitted pages are never evicted and only fit into the journal as one transaction
+    if (journalPagesNum == 0)
+        return false;
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    size_t uncommittedNum = std::count_if(pages.begin(), pages.end(), [](const Page& page){ return page.dirty && !page.journaled; });
+    return uncommittedNum >= std::min(cachePagesNum, size_t(journalPagesNum)) / 2;
+}
+
+void BlockDevice::markMappedDirty(u_int64_t addr, size_t bytesNum){
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    for (u_int64_t i = addr / BLOCK_DEVICE_PAGE_SIZE; bytesNum > 0 && i <= (addr + bytesNum - 1) / BLOCK_DEVICE_PAGE_SIZE; i++)
+        mappedDirtyPages.insert(i);
+}
+
+size_t BlockDevice::openJournal(u_int64_t addr, u_int32_t pagesNum){
+    if (fd < 0)
+        throw "Disk is not opened";
+    if (pagesNum < 2)
+        throw "Journal too small";
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    journalAddr = addr;
+    JournalHeader header;
+    transferAll(false, journalAddr, (u_int8_t*)&header, sizeof(header));
+    size_t replayedNum = 0;
+    if (header.magic != JOURNAL_MAGIC){
+        // never used
+        journalSequence = 1;
+        if (!readOnly){
+            writeJournalHeader();
+            sync();
+        }
+    }
+    else{
+        journalSequence = header.sequence;
+        u_int32_t position = 1;
+        std::vector<std::pair<u_int64_t, std::vector<u_int8_t>>> images; // of the transaction being read
+        while (position < pagesNum){
+            JournalDescriptor descriptor;
+            transferAll(false, journalAddr + u_int64_t(position) * BLOCK_DEVICE_PAGE_SIZE, (u_int8_t*)&descriptor, sizeof(descriptor));
+            if (descriptor.magic != JOURNAL_MAGIC || descriptor.sequence != journalSequence
+                || descriptor.pagesNum > JOURNAL_DESCRIPTOR_PAGES_NUM || position + 1 + descriptor.pagesNum > pagesNum)
+                break;
+            std::vector<u_int8_t> data(size_t(descriptor.pagesNum) * BLOCK_DEVICE_PAGE_SIZE);
+            transferAll(false, journalAddr + u_int64_t(position + 1) * BLOCK_DEVICE_PAGE_SIZE, data.data(), data.size());
+            u_int64_t checksum = descriptor.checksum;
+            descriptor.checksum = 0;
+            u_int64_t hash = fnv1a64(&descriptor, sizeof(descriptor));
+            if (fnv1a64(data.data(), data.size(), hash) != checksum)
+                break; // torn write of the last transaction
+            for (u_int32_t i = 0; i < descriptor.pagesNum; i++)
+                images.push_back({descriptor.pageIndexes[i], std::vector<u_int8_t>(data.begin() + size_t(i) * BLOCK_DEVICE_PAGE_SIZE, data.begin() + size_t(i + 1) * BLOCK_DEVICE_PAGE_SIZE)});
+            position += 1 + descriptor.pagesNum;
+            if (!descriptor.last)
+                continue;
+            for (auto& image : images){
+                if (!readOnly)
+                    transferAll(true, image.first * BLOCK_DEVICE_PAGE_SIZE, image.second.data(), BLOCK_DEVICE_PAGE_SIZE);
+                updateCachedPages(image.first * BLOCK_DEVICE_PAGE_SIZE, image.second.data(), BLOCK_DEVICE_PAGE_SIZE);
+                if (readOnly)
+                    replayedImages[image.first] = std::move(image.second);
+            }
+            images.clear();
+            journalSequence++;
+            replayedNum++;
+        }
+        if (replayedNum > 0 && !readOnly){
+            sync();
+            writeJournalHeader();
+            sync();
+        }
+    }
+    journalPosition = 1;
+    journaledPages.clear();
+    if (readOnly){
+        //mapping does not show the replayed pages, reads go through the cache instead
+        if (mapping && !replayedImages.empty()){
+            munmap(mapping, mappingSize);
+            mapping = nullptr;
+            mappingSize = 0;
+        }
+        return replayedNum;
+    }
+    journalPagesNum = pagesNum;
+    return replayedNum;
+}
+
+void BlockDevice::commitJournal(){
+    std::vector<Page*> transaction;
+    for (auto& page : pages)
+        if (page.dirty && !page.journaled)
+            transaction.push_back(&page);
+    if (transaction.empty())
+        return;
+    std::sort(transaction.begin(), transaction.end(), [](const Page* a, const Page* b){ return a->index < b->index; });
+    size_t descriptorsNum = (transaction.size() + JOURNAL_DESCRIPTOR_PAGES_NUM - 1) / JOURNAL_DESCRIPTOR_PAGES_NUM;
+    size_t transactionPagesNum = descriptorsNum + transaction.size();
+    if (transactionPagesNum > journalPagesNum - 1){
+        // does not fit into the journal at all, written in place without atomicity
+        std::cerr<<"Warning: "<<transactionPagesNum<<" pages do not fit into the journal of "<<journalPagesNum<<" pages, written without journaling\n";
+        checkpointJournal();
+        for (Page* page : transaction)
+            writeBackPage(*page);
+        sync();
+        return;
+    }
+    if (journalPosition + transactionPagesNum > journalPagesNum)
+        checkpointJournal();
+    //whole transaction is one sequential write followed by one barrier
+    std::vector<u_int8_t> buffer(transactionPagesNum * BLOCK_DEVICE_PAGE_SIZE);
+    u_int8_t* out = buffer.data();
+    for (size_t first = 0; first < transaction.size(); first += JOURNAL_DESCRIPTOR_PAGES_NUM){
+        JournalDescriptor& descriptor = *new (out) JournalDescriptor();
+        descriptor.sequence = journalSequence;
+        descriptor.pagesNum = std::min(transaction.size() - first, size_t(JOURNAL_DESCRIPTOR_PAGES_NUM));
+        descriptor.last = first + descriptor.pagesNum == transaction.size();
+        u_int8_t* images = out + BLOCK_DEVICE_PAGE_SIZE;
+        for (u_int32_t i = 0; i < descriptor.pagesNum; i++){
+            descriptor.pageIndexes[i] = transaction[first + i]->index;
+            std::memcpy(images + size_t(i) * BLOCK_DEVICE_PAGE_SIZE, transaction[first + i]->data, BLOCK_DEVICE_PAGE_SIZE);
+        }
+        u_int64_t hash = fnv1a64(out, BLOCK_DEVICE_PAGE_SIZE);
+        descriptor.checksum = fnv1a64(images, size_t(descriptor.pagesNum) * BLOCK_DEVICE_PAGE_SIZE, hash);
+        out = images + size_t(descriptor.pagesNum) * BLOCK_DEVICE_PAGE_SIZE;
+    }
+    transferAll(true, journalAddr + u_int64_t(journalPosition) * BLOCK_DEVICE_PAGE_SIZE, buffer.data(), buffer.size());
+    sync();
+    STAT_ADD(JournalCommits, 1);
+    journalPosition += transactionPagesNum;
+    journalSequence++;
+    for (Page* page : transaction){
+        page->journaled = true;
+        journaledPages.insert(page->index);
+        committedImages.erase(page->index);
+    }
+}
+
+void BlockDevice::checkpointJournal(){
+    //home locations of journaled pages must be durable before the journal is reused
+    STAT_ADD(JournalCheckpoints, 1);
+    for (auto& page : pages)
+        if (page.dirty && page.journaled)
+            writeBackPage(page);
+    for (auto& image : committedImages)
+        transferAll(true, image.first * BLOCK_DEVICE_PAGE_SIZE, image.second.data(), BLOCK_DEVICE_PAGE_SIZE);
+    committedImages.clear();
+    sync();
+    writeJournalHeader();
+    sync();
+    journalPosition = 1;
+    journaledPages.clear();
+}
+
+void BlockDevice::writeJournalHeader(){
+    JournalHeader header;
+    header.sequence = journalSequence;
+    transferAll(true, journalAddr, (u_int8_t*)&header, sizeof(header));
+}
+
+void BlockDevice::sync(){
+    if (fdatasync(fd) != 0)
+        throw "Could not sync disk file";
+    STAT_ADD(Syncs, 1);
+}
@@ -0,0 +1,132 @@
+#ifndef BLOCKDEVICE_HPP
+#define BLOCKDEVICE_HPP
+
+#include <string>
+#include <list>
+#include <unordered_map>
+#include <set>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <sys/types.h>
+#include "AsyncReader.hpp"
+
+#define BLOCK_DEVICE_PAGE_SIZE 4096
+#define BLOCK_DEVICE_CACHE_PAGES 256 // 1MiB of cached disk pages
+#define JOURNAL_MAGIC 0x4C4E524A // "JRNL"
+#define JOURNAL_DESCRIPTOR_PAGES_NUM 508 // page images described by one JournalDescriptor
+
+struct JournalHeader{ //4096B, first page of the journal
+    u_int32_t magic=JOURNAL_MAGIC;
+    u_int32_t reserved0=0;
+    u_int64_t sequence=1; // transactions with lower sequence are already checkpointed
+    u_int8_t reserved[BLOCK_DEVICE_PAGE_SIZE - 16]={0};
+};
+
+struct JournalDescriptor{ //4096B, followed by pagesNum page images of one transaction
+    u_int32_t magic=JOURNAL_MAGIC;
+    u_int32_t pagesNum=0;
+    u_int64_t sequence=0;
+    u_int32_t last=0; // last descriptor of the transaction, marks it committed
+    u_int32_t reserved0=0;
+    u_int64_t checksum=0; // of this descriptor (with checksum 0) and its page images
+    u_int64_t pageIndexes[JOURNAL_DESCRIPTOR_PAGES_NUM]={0};
+};
+
+static_assert(sizeof(JournalHeader) == BLOCK_DEVICE_PAGE_SIZE, "JournalHeader must fill one page");
+static_assert(sizeof(JournalDescriptor) == BLOCK_DEVICE_PAGE_SIZE, "JournalDescriptor must fill one page");
+
+// Single descriptor opened once per disk, accessed with pread/pwrite.
+// Every access goes through an LRU cache of 4KiB pages, modified pages
+// stay in memory (dirty) until they are evicted or flush() is called.
+// In mapped mode the whole disk is mmap'ed, direct transfers (data) go
+// through the mapping and syncDirect() msyncs the pages they wrote. With a
+// journal opened metadata still goes through the cache and the journal,
+// without one it is mapped too and flush() becomes the msync instead.
+// Cache is guarded by a mutex, direct transfers to disjoint ranges can run
+// from many threads at once.
+// With a journal opened, flush() appends all pages modified since the last
+// flush to the journal as one transaction followed by a single fdatasync.
+// Journaled pages reach their home location lazily (eviction, checkpoint
+// when the journal fills up, close), pages not journaled yet are never
+// written home, so after a crash replaying the journal restores the state
+// of the last flush. Direct transfers (data) are not journaled.
+// Opened read only, nothing is ever written: committed journal
+// transactions are replayed into memory and read on top of the disk file.
+class BlockDevice{
+    public:
+    BlockDevice(size_t cachePagesNum = BLOCK_DEVICE_CACHE_PAGES);
+    ~BlockDevice();
+    BlockDevice(const BlockDevice&) = delete;
+    BlockDevice& operator=(const BlockDevice&) = delete;
+    void open(const std::string& diskName, bool mapped = false, bool readOnly = false);
+    void close();
+    bool isOpen() const;
+    bool isMapped() const;
+    bool isReadOnly() const;
+    void read(u_int64_t addr, void* buffer, size_t bytesNum);
+    void write(u_int64_t addr, const void* buffer, size_t bytesNum);
+    // single pread/pwrite for the whole range, bypassing the cache
+    // (cached copies of the range are kept coherent), used for data
+    void readDirect(u_int64_t addr, void* buffer, size_t bytesNum);
+    void writeDirect(u_int64_t addr, const void* buffer, size_t bytesNum);
+    // direct reads of many ranges kept in flight together
+    void readDirectAll(const std::vector<DirectRead>& reads);
+    void flush();
+    // makes direct transfers durable, before metadata pointing at them is flushed
+    void syncDirect();
+    // replays committed transactions of the journal at addr, then journals
+    // every following flush (not in read only mode), returns replayed transactions
+    size_t openJournal(u_int64_t addr, u_int32_t pagesNum);
+    // uncommitted pages fill half of the cache or of the journal, deferred flushes should not wait longer
+    bool commitDue();
+    // typed view of metadata in the mapping, nullptr when metadata goes through the cache
+    template<typename T> T* view(u_int64_t addr){
+        return metadataCached() ? nullptr : (T*)mappedData(addr, sizeof(T));
+    }
+    u_int8_t* mappedData(u_int64_t addr, size_t bytesNum);
+    private:
+    bool metadataCached() const; // read and write use the cache, not the mapping
+    struct Page{
+        u_int64_t index=0;
+        bool dirty=false;
+        bool journaled=false; // dirty contents are committed in the journal
+        u_int8_t data[BLOCK_DEVICE_PAGE_SIZE];
+    };
+    Page& getPage(u_int64_t pageIndex, bool wholePageOverwritten);
+    void loadPage(Page& page);
+    void writeBackPage(Page& page);
+    void evictPage();
+    void transferAll(bool writing, u_int64_t addr, u_int8_t* buffer, size_t bytesNum);
+    void copyDirtyPages(u_int64_t addr, u_int8_t* buffer, size_t bytesNum);
+    void copyReplayedImages(u_int64_t addr, u_int8_t* buffer, size_t bytesNum);
+    void markMappedDirty(u_int64_t addr, size_t bytesNum);
+    void syncMappedPages(); // under cacheMutex
+    void updateCachedPages(u_int64_t addr, const u_int8_t* buffer, size_t bytesNum);
+    void commitJournal();
+    void checkpointJournal();
+    void writeJournalHeader();
+    void sync();
+
+    private:
+    int fd=-1;
+    bool readOnly=false;
+    u_int8_t* mapping=nullptr;
+    u_int64_t mappingSize=0;
+    size_t cachePagesNum;
+    std::list<Page> pages; // most recently used at front
+    std::unordered_map<u_int64_t, std::list<Page>::iterator> pagesMap;
+    std::set<u_int64_t> mappedDirtyPages; // written through the mapping, not synced yet
+    u_int64_t journalAddr=0;
+    u_int32_t journalPagesNum=0; // 0 when not journaling
+    u_int32_t journalPosition=1; // next free page of the journal
+    u_int64_t journalSequence=1;
+    std::set<u_int64_t> journaledPages; // logged since the last checkpoint
+    std::unordered_map<u_int64_t, std::vector<u_int8_t>> committedImages; // of journaled pages modified again before reaching home
+    std::atomic<size_t> dirtyPagesNum{0}; // direct reads skip cacheMutex while there are none
+    std::unordered_map<u_int64_t, std::vector<u_int8_t>> replayedImages; // committed in the journal, not written home on read only disks
+    std::mutex cacheMutex;
+    std::atomic<u_int64_t> lastTransferEnd{0}; // for counting seeks
+    AsyncReader reader;
+};
+#endif
@@ -0,0 +1,77 @@
+#include "CRC32C.hpp"
+#include <cstring>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+namespace{
+struct CRC32CTables{
+    u_int32_t table[8][256];
+    CRC32CTables(){
+        for (u_int32_t i = 0; i < 256; i++){
+            u_int32_t crc = i;
+            for (int bit = 0; bit < 8; bit++)
+                crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLYNOMIAL : 0);
+            table[0][i] = crc;
+        }
+        //table[k] advances a byte followed by k zero bytes
+        for (u_int32_t i = 0; i < 256; i++)
+            for (int k = 1; k < 8; k++)
+                table[k][i] = (table[k - 1][i] >> 8) ^ table[0][table[k - 1][i] & 0xFF];
+    }
+};
+
+const CRC32CTables& tables(){
+    static const CRC32CTables crcTables;
+    return crcTables;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+u_int32_t crc32cInstruction(const u_int8_t* p, size_t bytesNum, u_int32_t crc){
+    u_int64_t crc64 = crc;
+    for (; bytesNum >= 8; p += 8, bytesNum -= 8){
+        u_int64_t word;
+        std::memcpy(&word, p, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = crc64;
+    for (; bytesNum > 0; p++, bytesNum--)
+        crc = _mm_crc32_u8(crc, *p);
+    return crc;
+}
+
+const bool hardware = __builtin_cpu_supports("sse4.2");
+#else
+const bool hardware = false;
+#endif
+}
+
+u_int32_t crc32cSoftware(const void* data, size_t bytesNum, u_int32_t crc){
+    const u_int32_t (*table)[256] = tables().table;
+    const u_int8_t* p = (const u_int8_t*)data;
+    crc = ~crc;
+    for (; bytesNum >= 8; p += 8, bytesNum -= 8){
+        u_int32_t low, high;
+        std::memcpy(&low, p, sizeof(low));
+        std::memcpy(&high, p + 4, sizeof(high));
+        low ^= crc;
+        crc = table[7][low & 0xFF] ^ table[6][(low >> 8) & 0xFF] ^ table[5][(low >> 16) & 0xFF] ^ table[4][low >> 24]
+            ^ table[3][high & 0xFF] ^ table[2][(high >> 8) & 0xFF] ^ table[1][(high >> 16) & 0xFF] ^ table[0][high >> 24];
+    }
+    for (; bytesNum > 0; p++, bytesNum--)
+        crc = (crc >> 8) ^ table[0][(crc ^ *p) & 0xFF];
+    return ~crc;
+}
+
+u_int32_t crc32c(const void* data, size_t bytesNum, u_int32_t crc){
+#if defined(__x86_64__)
+    if (hardware)
+        return ~crc32cInstruction((const u_int8_t*)data, bytesNum, ~crc);
+#endif
+    return crc32cSoftware(data, bytesNum, crc);
+}
+
+bool crc32cHardware(){
+    return hardware;
+}
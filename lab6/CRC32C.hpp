@@ -0,0 +1,17 @@
+#ifndef CRC32C_HPP
+#define CRC32C_HPP
+
+#include <cstddef>
+#include <sys/types.h>
+
+#define CRC32C_POLYNOMIAL 0x82F63B78 // Castagnoli, reflected
+
+// CRC-32C of DataBlocks. On x86-64 CPUs with SSE4.2 (checked once at
+// runtime) the crc32 instruction processes 8 bytes at a time, elsewhere a
+// slicing-by-8 table does, both give the same checksums.
+
+// crc of a previous part continues the checksum over the next part
+u_int32_t crc32c(const void* data, size_t bytesNum, u_int32_t crc = 0);
+u_int32_t crc32cSoftware(const void* data, size_t bytesNum, u_int32_t crc = 0);
+bool crc32cHardware(); // crc32c uses the CPU instruction
+#endif
@@ -0,0 +1,111 @@
+#include "ExtentAllocator.hpp"
+#include <algorithm>
+
+void ExtentAllocator::build(const BitMap& bitMap){
+    runsByAddr.clear();
+    runsBySize.clear();
+    freeBlocksNum = 0;
+    nextFitCursor = 0;
+    size_t start = bitMap.findFree();
+    while (start != BitMap::npos){
+        size_t end = bitMap.findUsed(start);
+        if (end == BitMap::npos)
+            end = bitMap.size();
+        insertRun(start, end - start);
+        start = bitMap.findFree(end);
+    }
+}
+
+void ExtentAllocator::setPolicy(AllocationPolicy policy){
+    this->policy = policy;
+}
+
+std::vector<ExtentAllocator::Run> ExtentAllocator::allocate(size_t blocksNum){
+    if (blocksNum > freeBlocksNum)
+        throw "not enough free DataBlocks";
+    std::vector<Run> runs;
+    while (blocksNum > 0){
+        std::map<u_int32_t, u_int32_t>::iterator run = runsByAddr.end();
+        if (policy == AllocationPolicy::NextFit)
+            run = findNextFit(std::min(blocksNum, size_t(u_int32_t(-1))));
+        else{
+            auto fit = runsBySize.lower_bound({u_int32_t(std::min(blocksNum, size_t(u_int32_t(-1)))), 0});
+            if (fit != runsBySize.end())
+                run = runsByAddr.find(fit->second);
+        }
+        // nothing holds the rest of the request, take the largest run whole
+        if (run == runsByAddr.end())
+            run = runsByAddr.find(std::prev(runsBySize.end())->second);
+        u_int32_t length = std::min(size_t(run->second), blocksNum);
+        runs.push_back(takeFrom(run, length));
+        blocksNum -= length;
+    }
+    return runs;
+}
+
+ExtentAllocator::Run ExtentAllocator::allocateLowest(u_int32_t blocksNum, u_int32_t from, u_int32_t limit){
+    for (auto run = runsByAddr.lower_bound(from); run != runsByAddr.end() && run->first < limit; run++)
+        if (run->second >= blocksNum)
+            return takeFrom(run, blocksNum);
+    return Run();
+}
+
+void ExtentAllocator::release(u_int32_t start, u_int32_t length){
+    if (length == 0)
+        return;
+    auto next = runsByAddr.lower_bound(start);
+    if (next != runsByAddr.end() && next->first == start + length){
+        length += next->second;
+        eraseRun(next);
+    }
+    auto after = runsByAddr.lower_bound(start);
+    if (after != runsByAddr.begin()){
+        auto prev = std::prev(after);
+        if (prev->first + prev->second == start){
+            start = prev->first;
+            length += prev->second;
+            eraseRun(prev);
+        }
+    }
+    insertRun(start, length);
+}
+
+size_t ExtentAllocator::freeNum() const{
+    return freeBlocksNum;
+}
+
+size_t ExtentAllocator::runsNum() const{
+    return runsByAddr.size();
+}
+
+void ExtentAllocator::insertRun(u_int32_t start, u_int32_t length){
+    runsByAddr[start] = length;
+    runsBySize.insert({length, start});
+    freeBlocksNum += length;
+}
+
+void ExtentAllocator::eraseRun(std::map<u_int32_t, u_int32_t>::iterator run){
+    runsBySize.erase({run->second, run->first});
+    freeBlocksNum -= run->second;
+    runsByAddr.erase(run);
+}
+
+ExtentAllocator::Run ExtentAllocator::takeFrom(std::map<u_int32_t, u_int32_t>::iterator run, u_int32_t length){
+    Run taken = {run->first, length};
+    u_int32_t restLength = run->second - length;
+    eraseRun(run);
+    if (restLength > 0)
+        insertRun(taken.start + length, restLength);
+    nextFitCursor = taken.start + length;
+    return taken;
+}
+
+std::map<u_int32_t, u_int32_t>::iterator ExtentAllocator::findNextFit(u_int32_t length){
+    for (auto run = runsByAddr.lower_bound(nextFitCursor); run != runsByAddr.end(); run++)
+        if (run->second >= length)
+            return run;
+    for (auto run = runsByAddr.begin(); run != runsByAddr.end() && run->first < nextFitCursor; run++)
+        if (run->second >= length)
+            return run;
+    return runsByAddr.end();
+}
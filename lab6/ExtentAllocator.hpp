@@ -0,0 +1,45 @@
+#ifndef EXTENTALLOCATOR_HPP
+#define EXTENTALLOCATOR_HPP
+
+#include <map>
+#include <set>
+#include <vector>
+#include <utility>
+#include <sys/types.h>
+#include "BitMap.hpp"
+
+enum class AllocationPolicy{
+    BestFit, // smallest free run that holds the whole request
+    NextFit  // first free run after the previous allocation that holds the whole request
+};
+
+// In-memory index of free DataBlock runs, rebuilt from the bitmap at load.
+// Runs are kept ordered by address (for merging and next-fit) and by size
+// (for best-fit), requests are served with as few runs as possible.
+class ExtentAllocator{
+    public:
+    struct Run{
+        u_int32_t start=0;
+        u_int32_t length=0;
+    };
+    void build(const BitMap& bitMap);
+    void setPolicy(AllocationPolicy policy);
+    std::vector<Run> allocate(size_t blocksNum);
+    Run allocateLowest(u_int32_t blocksNum, u_int32_t from, u_int32_t limit); // whole request from the lowest run starting in [from, limit), length 0 if none
+    void release(u_int32_t start, u_int32_t length);
+    size_t freeNum() const;
+    size_t runsNum() const;
+    private:
+    void insertRun(u_int32_t start, u_int32_t length);
+    void eraseRun(std::map<u_int32_t, u_int32_t>::iterator run);
+    Run takeFrom(std::map<u_int32_t, u_int32_t>::iterator run, u_int32_t length);
+    std::map<u_int32_t, u_int32_t>::iterator findNextFit(u_int32_t length);
+
+    private:
+    AllocationPolicy policy=AllocationPolicy::BestFit;
+    std::map<u_int32_t, u_int32_t> runsByAddr; // start -> length
+    std::set<std::pair<u_int32_t, u_int32_t>> runsBySize; // (length, start)
+    u_int32_t nextFitCursor=0;
+    size_t freeBlocksNum=0;
+};
+#endif
@@ -0,0 +1,30 @@
+#ifndef FNV1A_HPP
+#define FNV1A_HPP
+
+#include <cstddef>
+#include <sys/types.h>
+
+#define FNV1A_32_SEED 2166136261u // offset basis
+#define FNV1A_64_SEED 0xCBF29CE484222325ULL
+
+// FNV-1a hashes of Directory names (32 bit), journal descriptors and
+// imported files (64 bit). Directory and journal keep them on disk, they
+// must not change.
+
+// hash of a previous part continues over the next part
+inline u_int32_t fnv1a32(const void* data, size_t bytesNum, u_int32_t hash = FNV1A_32_SEED){
+    for (size_t i = 0; i < bytesNum; i++){
+        hash ^= ((const u_int8_t*)data)[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+inline u_int64_t fnv1a64(const void* data, size_t bytesNum, u_int64_t hash = FNV1A_64_SEED){
+    for (size_t i = 0; i < bytesNum; i++){
+        hash ^= ((const u_int8_t*)data)[i];
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
+#endif
@@ -0,0 +1,394 @@
+#include "FileServer.hpp"
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <csignal>
+#include <sstream>
+#include <thread>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+namespace{
+volatile sig_atomic_t signalledListenFd = -1; // listening socket of the running server, for the signal handler
+
+void stopOnSignal(int){
+    //shutdown wakes up the blocked accept
+    if (signalledListenFd >= 0)
+        shutdown(signalledListenFd, SHUT_RDWR);
+}
+
+sockaddr_un socketAddress(const std::string& socketPath){
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (socketPath.size() >= sizeof(address.sun_path))
+        throw "Socket path is too long";
+    std::strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+    return address;
+}
+
+void respond(std::ostream& out, u_int32_t status, u_int64_t length){
+    ResponseHeader header;
+    header.status = status;
+    header.length = length;
+    out.write((const char*)&header, sizeof(header));
+}
+
+void respond(std::ostream& out, u_int32_t status, const std::string& text){
+    respond(out, status, text.size());
+    out.write(text.data(), text.size());
+}
+}
+
+SocketBuffer::SocketBuffer(int fd) : fd(fd){
+    setg(input, input, input);
+    setp(output, output + SOCKET_BUFFER_SIZE);
+}
+
+SocketBuffer::int_type SocketBuffer::underflow(){
+    while (true){
+        ssize_t n = ::recv(fd, input, SOCKET_BUFFER_SIZE, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return traits_type::eof();
+        setg(input, input, input + n);
+        return traits_type::to_int_type(input[0]);
+    }
+}
+
+SocketBuffer::int_type SocketBuffer::overflow(int_type c){
+    if (!sendOutput())
+        return traits_type::eof();
+    if (!traits_type::eq_int_type(c, traits_type::eof())){
+        *pptr() = traits_type::to_char_type(c);
+        pbump(1);
+    }
+    return traits_type::not_eof(c);
+}
+
+int SocketBuffer::sync(){
+    return sendOutput() ? 0 : -1;
+}
+
+bool SocketBuffer::sendOutput(){
+    const char* data = pbase();
+    size_t bytesNum = pptr() - pbase();
+    while (bytesNum > 0){
+        //peer that went away is an error of this stream, not SIGPIPE for the process
+        ssize_t n = ::send(fd, data, bytesNum, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        data += n;
+        bytesNum -= n;
+    }
+    setp(output, output + SOCKET_BUFFER_SIZE);
+    return true;
+}
+
+PayloadBuffer::PayloadBuffer(std::streambuf* source, u_int64_t limit) : source(source), left(limit){
+    setg(buffer, buffer, buffer);
+}
+
+PayloadBuffer::int_type PayloadBuffer::underflow(){
+    if (left == 0)
+        return traits_type::eof();
+    std::streamsize n = source->sgetn(buffer, std::min(left, u_int64_t(SOCKET_BUFFER_SIZE)));
+    if (n <= 0)
+        return traits_type::eof();
+    left -= n;
+    setg(buffer, buffer, buffer + n);
+    return traits_type::to_int_type(buffer[0]);
+}
+
+void PayloadBuffer::drain(){
+    setg(buffer, buffer, buffer);
+    while (underflow() != traits_type::eof())
+        setg(buffer, buffer, buffer);
+}
+
+FileServer::FileServer(FileSystem& f) : f(f){}
+
+void FileServer::serve(const std::string& socketPath){
+    sockaddr_un address = socketAddress(socketPath);
+    //socket left behind by a server that did not stop cleanly is replaced, any other file is not
+    struct stat socketStat;
+    if (lstat(socketPath.c_str(), &socketStat) == 0 && S_ISSOCK(socketStat.st_mode))
+        unlink(socketPath.c_str());
+    listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenFd < 0)
+        throw "Could not create socket";
+    if (bind(listenFd, (sockaddr*)&address, sizeof(address)) != 0 || listen(listenFd, SOMAXCONN) != 0){
+        ::close(listenFd);
+        listenFd = -1;
+        throw "Could not listen on socket";
+    }
+    signalledListenFd = listenFd;
+    struct sigaction action = {};
+    action.sa_handler = stopOnSignal;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+    std::cout<<"Serving "<<socketPath<<"\n"<<std::flush;
+    while (true){
+        int clientFd = accept(listenFd, nullptr, nullptr);
+        if (clientFd < 0){
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break; // listening socket shut down by stop() or a signal
+        }
+        std::lock_guard<std::mutex> lock(clientsMutex);
+        clients[clientFd] = false;
+        std::thread(&FileServer::serveClient, this, clientFd).detach();
+    }
+    signalledListenFd = -1;
+    ::close(listenFd);
+    listenFd = -1;
+    unlink(socketPath.c_str());
+    //requests in progress are finished, idle connections are shut down so their recv returns
+    std::unique_lock<std::mutex> lock(clientsMutex);
+    stopping = true;
+    for (const auto& client : clients)
+        if (client.second)
+            shutdown(client.first, SHUT_RD);
+    clientsDone.wait(lock, [this]{ return clients.empty(); });
+    std::cout<<"Server stopped\n";
+}
+
+void FileServer::stop(){
+    stopping = true;
+    shutdown(listenFd, SHUT_RDWR);
+}
+
+void FileServer::serveClient(int clientFd){
+    SocketBuffer socket(clientFd);
+    std::istream in(&socket);
+    std::ostream out(&socket);
+    RequestHeader header;
+    auto waiting = [&](bool idle){
+        std::lock_guard<std::mutex> lock(clientsMutex);
+        clients[clientFd] = idle;
+        return !stopping;
+    };
+    while (waiting(true) && in.read((char*)&header, sizeof(header)) && header.magic == SERVER_MAGIC && header.nameSize <= MAX_FILENAME_SIZE){
+        waiting(false);
+        std::string name(header.nameSize, '\0');
+        if (!in.read(&name[0], header.nameSize))
+            break;
+        Request request = Request(header.request);
+        bool hasData = request == Request::AddFile || request == Request::WriteFile || request == Request::AppendFile;
+        PayloadBuffer payload(&socket, hasData ? header.length : 0);
+        std::istream data(&payload);
+        bool responded = false;
+        std::string error;
+        try{
+            handleRequest(header, name, data, out, responded);
+        }
+        catch (const char* message){
+            error = message;
+        }
+        catch (const std::exception& exception){
+            error = exception.what();
+        }
+        //contents already being sent cannot be followed by an error, the connection is dropped instead
+        if (!error.empty() && responded)
+            break;
+        payload.drain();
+        if (!error.empty())
+            respond(out, 1, error);
+        if (!out.flush())
+            break;
+    }
+    //removed before close, so that stopping never shuts down a reused descriptor
+    {
+        std::lock_guard<std::mutex> lock(clientsMutex);
+        clients.erase(clientFd);
+        clientsDone.notify_all();
+    }
+    ::close(clientFd);
+}
+
+size_t FileServer::resolveFile(const std::string& name){
+    if (!name.empty() && std::all_of(name.begin(), name.end(), [](unsigned char c){ return std::isdigit(c); })){
+        size_t INodeIndex = std::stoul(name);
+        if (!f.INodeInUse(INodeIndex))
+            throw "File with this Index does not exist on disk";
+        return INodeIndex;
+    }
+    size_t INodeIndex = f.findFile(name);
+    if (INodeIndex == NO_INODE)
+        throw "No file with such name on disk";
+    return INodeIndex;
+}
+
+std::shared_mutex& FileServer::INodeLock(size_t INodeIndex){
+    std::lock_guard<std::mutex> lock(INodeLocksMutex);
+    auto& INodeLock = INodeLocks[INodeIndex];
+    if (!INodeLock)
+        INodeLock.reset(new std::shared_mutex());
+    return *INodeLock;
+}
+
+void FileServer::handleRequest(const RequestHeader& header, const std::string& name, std::istream& data, std::ostream& out, bool& responded){
+    //file may be deleted and its INode reused between lookup and lock,
+    //name (or that the INode is still in use) is checked again under the lock
+    auto lockedFile = [&](auto& lock){
+        size_t INodeIndex = resolveFile(name);
+        lock = std::decay_t<decltype(lock)>(INodeLock(INodeIndex));
+        if (resolveFile(name) != INodeIndex)
+            throw "File changed while opening";
+        return INodeIndex;
+    };
+    BytesVector window;
+    switch (Request(header.request)){
+    case Request::ListFiles:{
+        std::ostringstream listing;
+        f.listFiles(listing);
+        respond(out, 0, listing.str());
+        return;
+    }
+    case Request::Stats:{
+        std::ostringstream stats;
+        ioStats().print(stats);
+        respond(out, 0, stats.str());
+        return;
+    }
+    case Request::Stop:
+        respond(out, 0, 0);
+        stop();
+        return;
+    case Request::AddFile:
+        if (!f.addFile(name, data, header.length))
+            throw "Unable to add file";
+        respond(out, 0, 0);
+        return;
+    case Request::DeleteFile:{
+        std::unique_lock<std::shared_mutex> lock;
+        if (!f.deleteFile(lockedFile(lock)))
+            throw "File with this Index does not exist on disk";
+        respond(out, 0, 0);
+        return;
+    }
+    case Request::GetFile:
+    case Request::ReadFile:{
+        std::shared_lock<std::shared_mutex> lock;
+        FileHandle handle = f.openFile(lockedFile(lock));
+        u_int64_t offset = 0, length = handle._INode.fileSize_B;
+        if (Request(header.request) == Request::ReadFile){
+            offset = std::min(header.offset, length);
+            length = std::min(header.length, length - offset);
+        }
+        respond(out, 0, length);
+        responded = true;
+        window.resize(SERVER_WINDOW_SIZE);
+        while (length > 0){
+            size_t n = f.readFile(handle, offset, window.data(), std::min(u_int64_t(window.size()), length));
+            if (n == 0)
+                throw "File changed while reading";
+            if (!out.write((const char*)window.data(), n))
+                throw "Connection closed";
+            offset += n;
+            length -= n;
+        }
+        return;
+    }
+    case Request::WriteFile:
+    case Request::AppendFile:
+    case Request::TruncateFile:{
+        std::unique_lock<std::shared_mutex> lock;
+        FileHandle handle = f.openFile(lockedFile(lock));
+        if (Request(header.request) == Request::TruncateFile){
+            f.truncateFile(handle, header.length);
+            f.closeFile(handle);
+            respond(out, 0, 0);
+            return;
+        }
+        window.resize(SERVER_WINDOW_SIZE);
+        u_int64_t offset = header.offset, received = 0;
+        while (data.read((char*)window.data(), window.size()) || data.gcount() > 0){
+            size_t n = data.gcount();
+            if (Request(header.request) == Request::AppendFile)
+                f.appendFile(handle, window.data(), n);
+            else
+                f.writeFile(handle, offset, window.data(), n);
+            offset += n;
+            received += n;
+        }
+        f.closeFile(handle);
+        if (received != header.length)
+            throw "Connection closed while receiving data";
+        respond(out, 0, 0);
+        return;
+    }
+    }
+    throw "Unknown request";
+}
+
+FileClient::FileClient(const std::string& socketPath){
+    sockaddr_un address = socketAddress(socketPath);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        throw "Could not create socket";
+    if (connect(fd, (sockaddr*)&address, sizeof(address)) != 0){
+        ::close(fd);
+        fd = -1;
+        throw "Could not connect to server";
+    }
+    buffer.reset(new SocketBuffer(fd));
+}
+
+FileClient::~FileClient(){
+    buffer.reset();
+    if (fd >= 0)
+        ::close(fd);
+}
+
+const std::string& FileClient::error() const{
+    return lastError;
+}
+
+bool FileClient::request(Request request, const std::string& name, u_int64_t offset, u_int64_t length, std::istream* data, std::ostream* out){
+    std::iostream socket(buffer.get());
+    if (name.size() > MAX_FILENAME_SIZE)
+        throw "File Name is too long";
+    RequestHeader header;
+    header.request = u_int32_t(request);
+    header.offset = offset;
+    header.length = length;
+    header.nameSize = name.size();
+    socket.write((const char*)&header, sizeof(header));
+    socket.write(name.data(), name.size());
+    if (data){
+        BytesVector window(SERVER_WINDOW_SIZE);
+        for (u_int64_t sent = 0; sent < length;){
+            data->read((char*)window.data(), std::min(u_int64_t(window.size()), length - sent));
+            if (data->gcount() == 0)
+                throw "Source changed while reading";
+            socket.write((const char*)window.data(), data->gcount());
+            sent += data->gcount();
+        }
+    }
+    if (!socket.flush())
+        throw "Connection to server lost";
+    ResponseHeader response;
+    if (!socket.read((char*)&response, sizeof(response)) || response.magic != SERVER_MAGIC)
+        throw "Connection to server lost";
+    if (response.status != 0){
+        lastError.assign(response.length, '\0');
+        socket.read(&lastError[0], response.length);
+        return false;
+    }
+    BytesVector window(std::min(u_int64_t(SERVER_WINDOW_SIZE), response.length));
+    for (u_int64_t received = 0; received < response.length;){
+        size_t n = std::min(u_int64_t(window.size()), response.length - received);
+        if (!socket.read((char*)window.data(), n))
+            throw "Connection to server lost";
+        if (out)
+            out->write((const char*)window.data(), n);
+        received += n;
+    }
+    return true;
+}
@@ -0,0 +1,115 @@
+#ifndef FILESERVER_HPP
+#define FILESERVER_HPP
+
+#include "FileSystem.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <shared_mutex>
+#include <streambuf>
+#include <unordered_map>
+
+#define SERVER_MAGIC 0x5652534C // "LSRV"
+#define SOCKET_BUFFER_SIZE 65536
+#define SERVER_WINDOW_SIZE 1048576 // bytes of file contents moved at once between socket and disk
+
+enum class Request : u_int32_t{
+    ListFiles = 1,
+    AddFile,
+    GetFile,
+    DeleteFile,
+    ReadFile,
+    WriteFile,
+    AppendFile,
+    TruncateFile,
+    Stats,
+    Stop
+};
+
+struct RequestHeader{ // followed by the file name (or INode index in digits), then length bytes of data for AddFile, WriteFile and AppendFile
+    u_int32_t magic=SERVER_MAGIC;
+    u_int32_t request=0;
+    u_int64_t offset=0;
+    u_int64_t length=0; // of data, of the ReadFile range, new size for TruncateFile
+    u_int32_t nameSize=0;
+    u_int32_t reserved=0;
+};
+
+struct ResponseHeader{ // followed by length bytes of file contents, listing or error message
+    u_int32_t magic=SERVER_MAGIC;
+    u_int32_t status=0; // 0 when the request succeeded
+    u_int64_t length=0;
+};
+
+// Buffered stream over a connected socket, the socket is not closed by it.
+class SocketBuffer : public std::streambuf{
+    public:
+    SocketBuffer(int fd);
+    protected:
+    int_type underflow() override;
+    int_type overflow(int_type c) override;
+    int sync() override;
+    private:
+    bool sendOutput();
+    int fd;
+    char input[SOCKET_BUFFER_SIZE];
+    char output[SOCKET_BUFFER_SIZE];
+};
+
+// At most limit bytes read from source, data of one request.
+class PayloadBuffer : public std::streambuf{
+    public:
+    PayloadBuffer(std::streambuf* source, u_int64_t limit);
+    void drain(); // skips what was not read, so that the next request can be read
+    protected:
+    int_type underflow() override;
+    private:
+    std::streambuf* source;
+    u_int64_t left;
+    char buffer[SOCKET_BUFFER_SIZE];
+};
+
+// Serves one loaded FileSystem to local clients over a Unix domain socket,
+// one thread per connection. Every request on a file holds the lock of its
+// INode, shared for reads and exclusive for changes, so readers of any files
+// and writers of distinct files run in parallel. FileSystem guards its own
+// allocation and metadata, readers never wait for allocations. Contents
+// move between socket and disk in SERVER_WINDOW_SIZE windows.
+class FileServer{
+    public:
+    FileServer(FileSystem& f);
+    void serve(const std::string& socketPath); // until a Stop request, SIGINT or SIGTERM
+    private:
+    void serveClient(int clientFd);
+    void handleRequest(const RequestHeader& header, const std::string& name, std::istream& data, std::ostream& out, bool& responded);
+    size_t resolveFile(const std::string& name);
+    std::shared_mutex& INodeLock(size_t INodeIndex);
+    void stop();
+
+    FileSystem& f;
+    int listenFd=-1;
+    std::atomic<bool> stopping{false};
+    std::mutex INodeLocksMutex;
+    std::unordered_map<size_t, std::unique_ptr<std::shared_mutex>> INodeLocks; // created on first use
+    std::mutex clientsMutex;
+    std::condition_variable clientsDone;
+    std::unordered_map<int, bool> clients; // connected sockets, true while waiting for the next request
+};
+
+// Connection to a FileServer, requests are sent one at a time.
+class FileClient{
+    public:
+    FileClient(const std::string& socketPath);
+    ~FileClient();
+    FileClient(const FileClient&) = delete;
+    FileClient& operator=(const FileClient&) = delete;
+    // length bytes of data are sent with the request, response contents are written to out,
+    // returns false with the server message in error() when the request failed
+    bool request(Request request, const std::string& name, u_int64_t offset, u_int64_t length, std::istream* data, std::ostream* out);
+    const std::string& error() const;
+    private:
+    int fd=-1;
+    std::unique_ptr<SocketBuffer> buffer;
+    std::string lastError;
+};
+#endif
@@ -1,4 +1,5 @@
 #include "FileSystem.hpp"
+#include "FNV1a.hpp"
 #include <string>
 #include <iostream>
 #include <fstream>
@@ -6,379 +7,995 @@
 #include <bitset>
 #include <cstring>
 #include <utility>
+#include <algorithm>
+#include <future>
+#include <fcntl.h>
+#include <unistd.h>
 
-void FileSystem::createDisk(const std::string& diskName, u_int32_t size_MB){
+FileSystem::~FileSystem(){
+    try{
+        commitBatch();
+    }
+    catch (const char* error){
+        std::cerr<<"Error: "<<error<<"\n";
+    }
+}
+void FileSystem::createDisk(const std::string& diskName, u_int32_t size_MB, u_int32_t INodesNum, u_int32_t DataBlockSize, bool dedup){
+    commitPreviousDisk();
     this->diskName = diskName;
+    calculateTablesSizes(size_MB, INodesNum, DataBlockSize, dedup);
     allocateDiskSpace(size_MB);
+    disk.open(diskName);
+    DataBlocksTablesLoaded = false;
     createDiskInfo(size_MB);
     saveDiskInfo();
+    disk.flush();
 }
 void FileSystem::deleteDisk(const std::string& diskName){
+    if (diskName == this->diskName)
+        disk.close();
     std::remove(diskName.c_str());
 }
-void FileSystem::loadDisk(const std::string& diskName){
+void FileSystem::loadDisk(const std::string& diskName, bool mapped, bool readOnly){
+    commitPreviousDisk();
     this->diskName = diskName;
+    try{
+        disk.open(diskName, mapped, readOnly);
+    }
+    catch (const char*){
+        std::cerr<<"Error: No disk with such name\n";
+        throw;
+    }
     loadDiskInfo();
-    calculateTablesSizes(diskSuperBlockInfo.diskSize);
-    if ((sizeof(SuperBlock) + INodesBitMapBytesSize + DataBlocksBitMapBytesSize) != diskSuperBlockInfo.INodesSectionStartAddr)
-        throw "invalid INodes Section Start Address";
-    if ((sizeof(SuperBlock) + INodesBitMapBytesSize + DataBlocksBitMapBytesSize + INodesSectionBytesSize) != diskSuperBlockInfo.DataBlocksSectionStartAddr)
-        throw "invalid DataBlocks Section Start Address";
+    if (!legacy){
+        if (diskSuperBlockInfo.flags & ~u_int32_t(FS_DEDUP))
+            throw "unsupported disk flags";
+        calculateTablesSizes(diskSuperBlockInfo.diskSize, diskSuperBlockInfo.INodesNum, diskSuperBlockInfo.DataBlockSize, diskSuperBlockInfo.flags & FS_DEDUP);
+        SuperBlock expected;
+        createDiskInfo(diskSuperBlockInfo.diskSize, expected);
+        if (expected.INodesSectionStartAddr != diskSuperBlockInfo.INodesSectionStartAddr)
+            throw "invalid INodes Section Start Address";
+        if (expected.DirectoryStartAddr != diskSuperBlockInfo.DirectoryStartAddr || expected.DirectorySlotsNum != diskSuperBlockInfo.DirectorySlotsNum)
+            throw "invalid Directory Start Address";
+        if (expected.RefCountsStartAddr != diskSuperBlockInfo.RefCountsStartAddr || expected.FingerprintIndexStartAddr != diskSuperBlockInfo.FingerprintIndexStartAddr || expected.FingerprintSlotsNum != diskSuperBlockInfo.FingerprintSlotsNum)
+            throw "invalid Fingerprint Index Start Address";
+        if (expected.ChecksumsStartAddr != diskSuperBlockInfo.ChecksumsStartAddr)
+            throw "invalid Checksums Start Address";
+        if (expected.DataBlocksSectionStartAddr != diskSuperBlockInfo.DataBlocksSectionStartAddr)
+            throw "invalid DataBlocks Section Start Address";
+        if (expected.JournalStartAddr != diskSuperBlockInfo.JournalStartAddr || expected.JournalBlocksNum != diskSuperBlockInfo.JournalBlocksNum)
+            throw "invalid Journal Start Address";
+        //bring metadata to the state of the last commit before reading it
+        if (size_t replayedNum = disk.openJournal(diskSuperBlockInfo.JournalStartAddr, diskSuperBlockInfo.JournalBlocksNum))
+            std::cout<<"Replayed "<<replayedNum<<" journal transactions\n";
+    }
     loadINodesBitMap();
+    DataBlocksTablesLoaded = false;
+}
+
+void FileSystem::loadDataBlocksTables(){
+    std::lock_guard<std::recursive_mutex> lock(allocationMutex);
+    if (DataBlocksTablesLoaded)
+        return;
     loadDataBlocksBitMap();
+    if (!legacy)
+        DataBlocksAllocator.build(DataBlocksBitMap);
+    loadRefCounts();
+    DataBlocksTablesLoaded = true;
+}
+
+bool FileSystem::isLoaded(const std::string& diskName) const{
+    return disk.isOpen() && this->diskName == diskName;
 }
 
 void FileSystem::showDiskBitMaps(){
+    loadDataBlocksTables();
     std::cout<<"\tINodes BitMap\n------------------------------\n";
-    for (const auto& n : INodesBitMap)
-        std::cout<<n<<" ";
+    for (size_t i = 0; i < INodesBitMap.size(); i++)
+        std::cout<<INodesBitMap[i]<<" ";
     std::cout<<"\n------------------------------\n";
     std::cout<<"\tDataBlocks BitMap\n------------------------------\n";
-    for (const auto& db : DataBlocksBitMap)
-        std::cout<<db<<" ";
+    for (size_t i = 0; i < DataBlocksBitMap.size(); i++)
+        std::cout<<DataBlocksBitMap[i]<<" ";
     std::cout<<"\n------------------------------\n";
 }
 
-const bool FileSystem::addFile(const std::string& fileName){
-    if (fileName.size() > MAX_FILENAME_SIZE){
-        std::cout<<"Error: File Name is too long\n";
-        return false;
-    }
+bool FileSystem::addFile(const std::string& fileName){
     std::ifstream file(fileName, std::ios::binary | std::ios::in);
     if (!file){
         std::cerr<<"Error: Unable to get file";
         return false;
     }
-    std::cout<<"File Name: "<<fileName<<"\n";
     std::streampos fSize = 0;
     fSize = file.tellg();
     file.seekg(0, std::ios::end );
     fSize = file.tellg() - fSize;
-    file.close();
-    std::cout<<"File size [B]: "<<fSize<<"\n";
-    size_t neededDataBlocksNum = (u_int32_t(fSize) + DATABLOCK_DATA_SIZE - 1)/DATABLOCK_DATA_SIZE;
-    std::cout<<"Needed DataBlocks: "<<neededDataBlocksNum<<"\n";
-    const auto space = availableSpace();
-    if (!(space.first > 0) || !(space.second >= neededDataBlocksNum)){
-        std::cerr<<"Error: Disk is full, delete files first\n";
+    file.seekg(0, std::ios::beg);
+    return addFile(fileName, file, fSize);
+}
+bool FileSystem::addFile(const std::string& fileName, std::istream& file, u_int64_t fSize){
+    STAT_TIMER(timer, AddLookup);
+    if (legacy){
+        std::cerr<<"Error: Legacy disk format is read only.\n";
         return false;
     }
-    //files fit into disk
-    size_t INodeIndex = getFreeINodeIndex();
-    std::vector<size_t> DataBlocksIndexes = getFreeDataBlocksIndexes(neededDataBlocksNum);
-    //modify INodesBitMap
-    INodesBitMap[INodeIndex] = true;
-    //modify DataBlocksBitMap and make DataBlocks
-    
-    //open file again
-    file.open(fileName, std::ios::binary | std::ios::in);
-    if (!file){
-        std::cerr<<"Error: Unable to get file";
+    if (fileName.size() > MAX_FILENAME_SIZE){
+        std::cout<<"Error: File Name is too long\n";
         return false;
     }
-    std::vector<DataBlock> _DataBlocks;
-    for (size_t i = 0; i < DataBlocksIndexes.size(); i++){
-        u_int8_t buffer[DATABLOCK_DATA_SIZE] = {0};
-        size_t cdbi = DataBlocksIndexes[i];
-        DataBlocksBitMap[cdbi] = true;
-        file.read((char*)buffer, DATABLOCK_DATA_SIZE);
-        u_int32_t nextDataBlockAddr = 0;
-        if (i < DataBlocksIndexes.size() - 1)
-            nextDataBlockAddr = DataBlocksIndexes[i+1] * sizeof(DataBlock) + diskSuperBlockInfo.DataBlocksSectionStartAddr;
-        DataBlock _DataBlock;
-        _DataBlock.nextDataBlockAddr = nextDataBlockAddr;
-        // std::memcpy((char*)_DataBlock.data, (char*)buffer, file.gcount());
-        std::memcpy((char*)_DataBlock.data, (char*)buffer, DATABLOCK_DATA_SIZE);
-
-        _DataBlocks.push_back(_DataBlock);
+    if (findFile(fileName) != NO_INODE){
+        std::cerr<<"Error: File with this name already exists on disk.\n";
+        return false;
     }
-    u_int32_t firstDataBlockAddr = DataBlocksIndexes[0] * sizeof(DataBlock) + diskSuperBlockInfo.DataBlocksSectionStartAddr;
-    saveDataBlocks(_DataBlocks, firstDataBlockAddr);
-    
+    std::cout<<"File Name: "<<fileName<<"\n";
+    std::cout<<"File size [B]: "<<fSize<<"\n";
+    //small files are kept whole in their INode
+    bool inlined = fSize <= INODE_INLINE_DATA_SIZE;
+    u_int64_t neededDataBlocksNum = inlined ? 0 : dataBlocksNum(fSize);
+    std::cout<<"Needed DataBlocks: "<<neededDataBlocksNum<<"\n";
+    //on dedup disks and for compressed files DataBlocks are allocated while streaming, only as many as needed
+    bool allocatedWhileStreaming = dedup || (compression && !inlined);
+    std::vector<Extent> extents;
+    std::vector<size_t> ExtentBlocksIndexes;
+    auto release = [&](){
+        for (const auto& e : extents)
+            releaseDataBlocks(e.startDataBlock, e.length);
+        for (size_t i : ExtentBlocksIndexes)
+            freeDataBlocks(i, 1);
+    };
+    auto reserveExtentBlocks = [&](){
+        //files fit into disk, fragmented files need ExtentBlocks as well
+        std::lock_guard<std::recursive_mutex> lock(allocationMutex);
+        size_t neededExtentBlocksNum = extentBlocksNum(extents.size());
+        if (freeDataBlocksNum() < neededExtentBlocksNum){
+            release();
+            std::cerr<<"Error: Disk is full, delete files first\n";
+            return false;
+        }
+        ExtentBlocksIndexes = allocateDataBlocks(neededExtentBlocksNum);
+        return true;
+    };
+    STAT_NEXT(timer, AddAllocate);
+    {
+        std::lock_guard<std::recursive_mutex> lock(allocationMutex);
+        const auto space = availableSpace();
+        if (!(space.first > 0) || !(allocatedWhileStreaming || space.second >= neededDataBlocksNum)){
+            std::cerr<<"Error: Disk is full, delete files first\n";
+            return false;
+        }
+        if (!allocatedWhileStreaming){
+            extents = allocateFileExtents(neededDataBlocksNum);
+            if (!reserveExtentBlocks())
+                return false;
+        }
+    }
+    STAT_NEXT(timer, AddWrite);
+    size_t sharedNum = 0;
+    bool compressed = false;
+    u_int8_t data[INODE_INLINE_DATA_SIZE];
+    try{
+        if (inlined){
+            file.read((char*)data, fSize);
+            if (u_int64_t(file.gcount()) != fSize)
+                throw "File changed while reading";
+        }
+        else if (compression){
+            u_int64_t bytesRead = 0;
+            compressed = storeCompressedFile(file, fSize, extents, [&](const u_int8_t*, size_t bytesNum){
+                bytesRead += bytesNum;
+            });
+            if (bytesRead != fSize)
+                throw "File changed while reading";
+        }
+        else
+            sharedNum = withDataBlockSize(DataBlockSize, [&](auto BlockSize){
+                return streamFileToDisk<BlockSize>(file, fSize, extents);
+            });
+    }
+    catch (const char*){
+        release();
+        throw;
+    }
+    if (allocatedWhileStreaming && !reserveExtentBlocks())
+        return false;
+    if (compressed)
+        std::cout<<"Compressed to DataBlocks: "<<(extents.empty() ? 0 : extents.back().fileBlock + extents.back().length)<<"\n";
+    else if (dedup)
+        std::cout<<"Shared DataBlocks: "<<sharedNum<<"\n";
     //make INode
-    INode _INode = {firstDataBlockAddr, u_int32_t(fSize), ""};  
+    STAT_NEXT(timer, AddCommit);
+    INode _INode;
+    _INode.fileSize_B = fSize;
     std::strncpy(_INode.fileName, fileName.c_str(), fileName.size());
-    u_int32_t _INodeAddr = INodeIndex * sizeof(INode) + diskSuperBlockInfo.INodesSectionStartAddr;
-    saveINode(_INode, _INodeAddr);
-    saveINodesBitMap();
-    saveDataBlocksBitMap();
+    if (inlined)
+        saveInlineData(_INode, data, fSize);
+    else
+        saveExtents(_INode, extents, ExtentBlocksIndexes);
+    if (compressed)
+        _INode.flags |= INODE_COMPRESSED;
+    //INode is taken only now, a concurrent addFile of the same name may have finished meanwhile
+    std::lock_guard<std::mutex> metadataLock(metadataMutex);
+    std::unique_lock<std::shared_mutex> directoryLock(directoryMutex);
+    size_t INodeIndex = NO_INODE;
+    {
+        std::lock_guard<std::recursive_mutex> lock(allocationMutex);
+        if (lookupFile(fileName) != NO_INODE || freeINodesNum() == 0){
+            release();
+            std::cerr<<"Error: File with this name already exists on disk or no free INode left.\n";
+            return false;
+        }
+        //modify INodesBitMap
+        INodeIndex = getFreeINodeIndex();
+        markINode(INodeIndex, true);
+    }
+    saveINode(_INode, INodeIndex);
+    addDirectoryEntry(fileName, INodeIndex);
+    directoryLock.unlock();
+    commitMetadata();
     std::cout<<"File added successfully.\n";
     return true;
 }
-void FileSystem::listFiles(){
-    for(size_t i=0; i <INodesBitMap.size(); i++){
-        if (!INodesBitMap[i])
-            continue;
-        INode _INode = loadINode(i*sizeof(INode) + diskSuperBlockInfo.INodesSectionStartAddr);
-        std::cout<<"\nFile INode Index: "<<i<<"\n----------------------------------\n";
-        std::cout<<"Name: "<<_INode.fileName<<"\nSize [B]: "<<_INode.fileSize_B<<"\nFirst DataBlock Address: "<<_INode.firstDataBlockAddr;
-        std::cout<<"\n----------------------------------\n";
+void FileSystem::listFiles(std::ostream& out){
+    if (legacy){
+        listLegacyFiles(out);
+        return;
+    }
+    std::shared_lock<std::shared_mutex> directoryLock(directoryMutex);
+    std::vector<size_t> used;
+    {
+        std::lock_guard<std::recursive_mutex> lock(allocationMutex);
+        for(size_t i = INodesBitMap.findUsed(); i != BitMap::npos; i = INodesBitMap.findUsed(i + 1))
+            used.push_back(i);
+    }
+    for (size_t i : used){
+        INode buffer;
+        const INode& _INode = loadINode(i, buffer);
+        if (_INode.flags & INODE_SNAPSHOT)
+            continue; // listed by listSnapshots
+        out<<"\nFile INode Index: "<<i<<"\n----------------------------------\n";
+        out<<"Name: "<<INodeFileName(_INode)<<"\nSize [B]: "<<_INode.fileSize_B<<"\nExtents: ";
+        if (_INode.flags & INODE_INLINE)
+            out<<"inline";
+        else
+            out<<_INode.extentsNum;
+        if (_INode.flags & INODE_COMPRESSED)
+            out<<" (compressed)";
+        out<<"\n----------------------------------\n";
 
     }
 }
-const bool FileSystem::deleteFile(size_t fileINodeIndex){
-    if (!INodesBitMap[fileINodeIndex]){
+DiskUsage FileSystem::diskUsage(){
+    std::lock_guard<std::recursive_mutex> lock(allocationMutex);
+    loadDataBlocksTables();
+    DiskUsage usage;
+    usage.DataBlockSize = DataBlockSize;
+    usage.DataBlocksNum = DataBlocksBitMap.size();
+    usage.freeDataBlocksNum = freeDataBlocksNum();
+    usage.freeRunsNum = legacy ? 0 : DataBlocksAllocator.runsNum();
+    for (size_t i = INodesBitMap.findUsed(); i != BitMap::npos; i = INodesBitMap.findUsed(i + 1)){
+        if (legacy){
+            usage.filesNum++;
+            continue;
+        }
+        INode buffer;
+        const INode& _INode = loadINode(i, buffer);
+        //snapshot tables take DataBlocks like files, defrag moves them as well
+        if (!(_INode.flags & INODE_SNAPSHOT))
+            usage.filesNum++;
+        if (_INode.flags & INODE_INLINE)
+            continue;
+        usage.extentsNum += _INode.extentsNum;
+        if (_INode.extentsNum > 1)
+            usage.fragmentedFilesNum++;
+    }
+    return usage;
+}
+bool FileSystem::deleteFile(size_t fileINodeIndex){
+    if (legacy){
+        std::cerr<<"Error: Legacy disk format is read only.\n";
+        return false;
+    }
+    std::lock_guard<std::mutex> metadataLock(metadataMutex);
+    if (!INodeInUse(fileINodeIndex)){
         std::cerr<<"Error: File with this Index does not exist on disk.\n";
         return false;
     }
-    u_int32_t _INodeAddres = fileINodeIndex * sizeof(INode) + diskSuperBlockInfo.INodesSectionStartAddr;
-    INode _INode = loadINode(_INodeAddres);
-    std::vector<DataBlock> _DataBlocks = loadDataBlocks(_INode.firstDataBlockAddr);
+    INode _INode = loadINode(fileINodeIndex);
+    if (_INode.flags & INODE_SNAPSHOT){
+        std::cerr<<"Error: INode holds a snapshot, delete it with dsnap.\n";
+        return false;
+    }
     //clear the DataBlocks? - not needed however could be good
-
-    //get indexes of DataBlocks
-    u_int32_t nextDataBlockAddr = _INode.firstDataBlockAddr; 
-    for (const auto& db : _DataBlocks){
-        size_t DataBlockIndex = (nextDataBlockAddr - diskSuperBlockInfo.DataBlocksSectionStartAddr) / sizeof(DataBlock);
-        nextDataBlockAddr = db.nextDataBlockAddr; 
-        //could clear DataBlock
-        DataBlocksBitMap[DataBlockIndex] = 0;
-    }
-    size_t INodeIndex = (_INodeAddres - diskSuperBlockInfo.INodesSectionStartAddr) / sizeof(INode);
-    INodesBitMap[INodeIndex] = 0;
-    saveINodesBitMap();
-    saveDataBlocksBitMap();
+    //DataBlocks shared with other files only lose one reference
+    for (const auto& e : loadExtents(_INode))
+        releaseDataBlocks(e.startDataBlock, e.length);
+    for (u_int32_t i : loadExtentBlocksIndexes(_INode))
+        freeDataBlocks(i, 1);
+    {
+        std::unique_lock<std::shared_mutex> directoryLock(directoryMutex);
+        removeDirectoryEntry(INodeFileName(_INode));
+        std::lock_guard<std::recursive_mutex> lock(allocationMutex);
+        markINode(fileINodeIndex, false);
+    }
+    commitMetadata();
     return true;
 }
 void FileSystem::getFile(size_t fileINodeIndex, const std::string& targetFileName){
-    if (!INodesBitMap[fileINodeIndex]){
+    if (legacy){
+        getLegacyFile(fileINodeIndex, targetFileName);
+        return;
+    }
+    if (!INodeInUse(fileINodeIndex)){
         std::cerr<<"Error: File with this Index does not exist on disk.\n";
         return;
     }
-    u_int32_t _INodeAddres = fileINodeIndex * sizeof(INode) + diskSuperBlockInfo.INodesSectionStartAddr;
-    INode _INode = loadINode(_INodeAddres);
-    std::vector<DataBlock> _DataBlocks = loadDataBlocks(_INode.firstDataBlockAddr);
+    STAT_TIMER(timer, GetLookup);
+    INode _INode = loadINode(fileINodeIndex);
+    if (_INode.flags & INODE_SNAPSHOT){
+        std::cerr<<"Error: INode holds a snapshot, not a file.\n";
+        return;
+    }
+    std::vector<Extent> extents = loadExtents(_INode);
+    STAT_NEXT(timer, GetRead);
+    getFile(_INode, extents, targetFileName);
+}
+void FileSystem::getFile(const INode& _INode, const std::vector<Extent>& extents, const std::string& targetFileName){
     //save to outputfile
     std::ofstream file;
     if (targetFileName.empty())
-         file.open(_INode.fileName, std::ios::binary | std::ios::out);
+         file.open(INodeFileName(_INode), std::ios::binary | std::ios::out);
     else
         file.open(targetFileName, std::ios::binary | std::ios::out);
-    u_int32_t bytesToWrite = _INode.fileSize_B;
-    for (const auto & db : _DataBlocks){
-        if (!(bytesToWrite > 0)){
-            std::cerr<<"Error: File size smaller than DataBlocks saved info.\n";
+    if (_INode.flags & INODE_INLINE){
+        if (_INode.fileSize_B > INODE_INLINE_DATA_SIZE){
+            std::cerr<<"Error: Inline file bigger than INode.\n";
             throw "corrupted disk";
         }
-        if (bytesToWrite >= DATABLOCK_DATA_SIZE){
-            file.write((char*)db.data, DATABLOCK_DATA_SIZE);
-            bytesToWrite-=DATABLOCK_DATA_SIZE;
-        }
-        else{
-            file.write((char*)db.data, bytesToWrite);
-            bytesToWrite-=bytesToWrite; // bytesToWrite = 0;
-        }
+        file.write((const char*)_INode.inlineData, _INode.fileSize_B);
+        return;
     }
+    if (_INode.flags & INODE_COMPRESSED){
+        getCompressedFile(file, extents, _INode.fileSize_B);
+        return;
+    }
+    withDataBlockSize(DataBlockSize, [&](auto BlockSize){
+        streamFileFromDisk<BlockSize>(file, extents, _INode.fileSize_B);
+    });
     file.close();
 }
 
-void FileSystem::calculateTablesSizes(u_int32_t size_MB){
-    u_int32_t size_B = size_MB * 1048576;
-    INodesBitMapBytesSize = (INODES_NUM + 7) / 8;
-    INodesSectionBytesSize = INODES_NUM * sizeof(INode);
-    DataBlocksNum = (8 * (size_B - (sizeof(SuperBlock) + INodesBitMapBytesSize + INodesSectionBytesSize)) - 7) / (sizeof(DataBlock) * 8 + 1);
-    DataBlocksBitMapBytesSize = (DataBlocksNum + 7) / 8;
+size_t FileSystem::findFile(const std::string& fileName){
+    if (legacy)
+        return findLegacyFile(fileName);
+    std::shared_lock<std::shared_mutex> directoryLock(directoryMutex);
+    return lookupFile(fileName);
+}
+
+size_t FileSystem::lookupFile(const std::string& fileName){
+    if (fileName.size() > MAX_FILENAME_SIZE)
+        return NO_INODE;
+    //linear probing from the home slot, entries with matching hash are verified against the INode
+    u_int32_t nameHash = directoryHash(fileName);
+    u_int32_t slot = nameHash & (DirectorySlotsNum - 1);
+    for (u_int32_t probes = 0; probes < DirectorySlotsNum; probes++){
+        DirectoryEntry entry = loadDirectoryEntry(slot);
+        if (entry.INodeNumber == 0)
+            return NO_INODE;
+        size_t INodeIndex = entry.INodeNumber - 1;
+        if (entry.nameHash == nameHash && INodeIndex < INodesNum && INodeInUse(INodeIndex)){
+            INode buffer;
+            if (INodeFileName(loadINode(INodeIndex, buffer)) == fileName)
+                return INodeIndex;
+        }
+        slot = (slot + 1) & (DirectorySlotsNum - 1);
+    }
+    return NO_INODE;
+}
+
+bool FileSystem::INodeInUse(size_t INodeIndex) const{
+    std::shared_lock<std::shared_mutex> lock(INodesMutex);
+    return INodeIndex < INodesBitMap.size() && INodesBitMap[INodeIndex];
+}
+
+void FileSystem::markINode(size_t INodeIndex, bool used){
+    std::unique_lock<std::shared_mutex> lock(INodesMutex);
+    if (used)
+        INodesBitMap.set(INodeIndex);
+    else
+        INodesBitMap.reset(INodeIndex);
+}
+
+void FileSystem::setAllocationPolicy(AllocationPolicy policy){
+    DataBlocksAllocator.setPolicy(policy);
+}
+
+void FileSystem::calculateTablesSizes(u_int32_t size_MB, u_int32_t INodesNum, u_int32_t DataBlockSize, bool dedup){
+    if (INodesNum == 0 || INodesNum > MAX_INODES_NUM)
+        throw "invalid number of INodes";
+    if (DataBlockSize < MIN_DATABLOCK_SIZE || DataBlockSize > MAX_DATABLOCK_SIZE || (DataBlockSize & (DataBlockSize - 1)))
+        throw "invalid DataBlock size";
+    this->DataBlockSize = DataBlockSize;
+    this->dedup = dedup;
+    ExtentBlockExtentsNum = withDataBlockSize(DataBlockSize, [](auto BlockSize){
+        return ExtentBlock<BlockSize>::extentsCapacity;
+    });
+    u_int64_t size_B = u_int64_t(size_MB) * 1048576;
+    this->INodesNum = INodesNum;
+    INodesBitMapBytesSize = (u_int64_t(INodesNum) + 7) / 8;
+    INodesSectionBytesSize = u_int64_t(INodesNum) * sizeof(INode);
+    DirectorySlotsNum = 1;
+    while (DirectorySlotsNum < 2 * INodesNum)
+        DirectorySlotsNum *= 2;
+    JournalBlocksNum = std::min(u_int64_t(JOURNAL_MAX_BLOCKS), std::max(u_int64_t(JOURNAL_MIN_BLOCKS), size_B / 64 / DATABLOCK_SIZE));
+    u_int64_t fixedBytesSize = sizeof(SuperBlock) + INodesBitMapBytesSize + sizeof(INode) + INodesSectionBytesSize + u_int64_t(DirectorySlotsNum) * sizeof(DirectoryEntry) + u_int64_t(JournalBlocksNum) * DATABLOCK_SIZE;
+    if (size_B <= fixedBytesSize + DATABLOCK_SIZE + DataBlockSize)
+        throw "disk too small";
+    //every DataBlock costs a bit of the bitmap, a checksum and a RefCount, on dedup disks also a fingerprint index slot
+    u_int64_t perDataBlockBitsSize = u_int64_t(DataBlockSize) * 8 + 1 + 8 * 2 * sizeof(u_int32_t) + (dedup ? 8 * sizeof(FingerprintEntry) : 0);
+    u_int64_t maxDataBlocksNum = (8 * (size_B - fixedBytesSize)) / perDataBlockBitsSize;
+    if (maxDataBlocksNum > MAX_DATABLOCKS_NUM)
+        throw "disk too big";
+    DataBlocksNum = maxDataBlocksNum;
+    //DataBlocks section is aligned, shrink until the alignment padding fits as well
+    SuperBlock layout;
+    while (true){
+        DataBlocksBitMapBytesSize = (u_int64_t(DataBlocksNum) + 7) / 8;
+        RefCountsBytesSize = u_int64_t(DataBlocksNum) * sizeof(u_int32_t);
+        FingerprintSlotsNum = dedup ? DataBlocksNum : 0;
+        ChecksumsBytesSize = u_int64_t(DataBlocksNum) * sizeof(u_int32_t);
+        createDiskInfo(size_MB, layout);
+        if (layout.DataBlocksSectionStartAddr + u_int64_t(DataBlocksNum) * DataBlockSize <= size_B)
+            break;
+        DataBlocksNum--;
+    }
 }
 void FileSystem::createDiskInfo(u_int32_t size_MB){
-    calculateTablesSizes(size_MB);
-    u_int32_t _INodesSectionStartAddr = sizeof(SuperBlock) + INodesBitMapBytesSize + DataBlocksBitMapBytesSize;
-    u_int32_t _DataBlocksSectionStartAddr = _INodesSectionStartAddr + INodesSectionBytesSize;
-    diskSuperBlockInfo = {size_MB, _INodesSectionStartAddr, _DataBlocksSectionStartAddr};
+    createDiskInfo(size_MB, diskSuperBlockInfo);
+}
+void FileSystem::createDiskInfo(u_int32_t size_MB, SuperBlock& superBlock) const{
+    auto alignUp = [](u_int64_t addr, u_int64_t alignment){
+        return (addr + alignment - 1) / alignment * alignment;
+    };
+    superBlock.diskSize = size_MB;
+    superBlock.INodesNum = INodesNum;
+    superBlock.DataBlocksNum = DataBlocksNum;
+    superBlock.DirectorySlotsNum = DirectorySlotsNum;
+    superBlock.INodesBitMapStartAddr = sizeof(SuperBlock);
+    superBlock.DataBlocksBitMapStartAddr = superBlock.INodesBitMapStartAddr + INodesBitMapBytesSize;
+    superBlock.INodesSectionStartAddr = alignUp(superBlock.DataBlocksBitMapStartAddr + DataBlocksBitMapBytesSize, sizeof(INode));
+    superBlock.DirectoryStartAddr = superBlock.INodesSectionStartAddr + INodesSectionBytesSize;
+    superBlock.RefCountsStartAddr = superBlock.DirectoryStartAddr + u_int64_t(DirectorySlotsNum) * sizeof(DirectoryEntry);
+    superBlock.FingerprintIndexStartAddr = alignUp(superBlock.RefCountsStartAddr + RefCountsBytesSize, sizeof(FingerprintEntry));
+    superBlock.FingerprintSlotsNum = FingerprintSlotsNum;
+    superBlock.ChecksumsStartAddr = superBlock.FingerprintIndexStartAddr + u_int64_t(FingerprintSlotsNum) * sizeof(FingerprintEntry);
+    superBlock.JournalStartAddr = alignUp(superBlock.ChecksumsStartAddr + ChecksumsBytesSize, DATABLOCK_SIZE);
+    superBlock.JournalBlocksNum = JournalBlocksNum;
+    superBlock.DataBlocksSectionStartAddr = superBlock.JournalStartAddr + u_int64_t(JournalBlocksNum) * DATABLOCK_SIZE;
+    superBlock.DataBlockSize = DataBlockSize;
+    superBlock.flags = dedup ? FS_DEDUP : 0;
 }
 void FileSystem::saveDiskInfo(){
     saveSuperBlock();
 }
-void FileSystem::allocateDiskSpace(int size_MB){
-    std::ofstream disk(diskName, std::ios::binary | std::ios::out);
-    std::vector<char> empty(1024, 0); // 1kib of 0's
-    for(int i = 0; i < 1024*size_MB; i++)
-    {
-        if (!disk.write(&empty[0], empty.size()))
-        {
-            std::cerr << "Error: Problem with writing empty disk.\n" << std::endl;
-            throw;
-        }
+void FileSystem::allocateDiskSpace(u_int32_t size_MB){
+    //sparse file, blocks are allocated by the OS when first written
+    int fd = ::open(diskName.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0){
+        std::cerr << "Error: Problem with creating disk.\n";
+        throw "could not create disk";
+    }
+    if (ftruncate(fd, off_t(size_MB) * 1048576) != 0){
+        ::close(fd);
+        std::cerr << "Error: Problem with writing empty disk.\n";
+        throw "could not create disk";
     }
-    disk.close();
+    ::close(fd);
 }
 void FileSystem::loadDiskInfo(){
-    std::ifstream disk(diskName, std::ios::binary | std::ios::in);
-    if(!disk){
-        std::cerr<<"Error: No disk with such name\n";
-        throw;
+    u_int32_t magic = 0;
+    disk.read(0, &magic, sizeof(magic));
+    if (magic != FS_MAGIC){
+        loadLegacyDiskInfo();
+        return;
+    }
+    legacy = false;
+    disk.read(0, &diskSuperBlockInfo, sizeof(SuperBlock));
+    if (diskSuperBlockInfo.version != FS_VERSION){
+        std::cerr<<"Error: Unsupported disk format version "<<diskSuperBlockInfo.version<<"\n";
+        throw "unsupported disk format version";
     }
-    disk.read((char*)&diskSuperBlockInfo, sizeof(SuperBlock));
     std::cout<<"\tLoaded Disk Info\n----------------------------------\nDisk Name: "<<diskName;
+    std::cout<<"\nFormat Version: "<<diskSuperBlockInfo.version;
+    std::cout<<"\nINodes: "<<diskSuperBlockInfo.INodesNum;
     std::cout<<"\nDisk Size [MB]: "<<diskSuperBlockInfo.diskSize << "\nINodes Section Addres: "<< diskSuperBlockInfo.INodesSectionStartAddr;
+    std::cout<<"\nDataBlock Size [B]: "<<diskSuperBlockInfo.DataBlockSize;
+    std::cout<<"\nDeduplication: "<<(diskSuperBlockInfo.flags & FS_DEDUP ? "on" : "off");
+    std::cout<<"\nJournal Blocks: "<<diskSuperBlockInfo.JournalBlocksNum;
     std::cout<<"\nDataBlocks Section Address: "<<diskSuperBlockInfo.DataBlocksSectionStartAddr<< "\n----------------------------------\n";
 }
-BytesVector FileSystem::convertBitsToBytes(const BitsVector& bitsVector) const{
-    BytesVector bytesVector;
-    size_t bitsNum = bitsVector.size();
-    size_t bytesCount = (bitsNum + 7) / 8;
-    bytesVector.resize(bytesCount, 0);
-
-    for (size_t i = 0; i < bitsNum; ++i) {
-        size_t byteIndex = i / 8; 
-        size_t bitPosition = i % 8;
-        if (bitsVector[i]) {
-            bytesVector[byteIndex] |= (1 << bitPosition);
-        }
-    }
-    return bytesVector;
-}
-BitsVector FileSystem::convertBytesToBits(const BytesVector& bytesVector, size_t bitsNum) const{
-    BitsVector bitsVector;
-    int bitsCount = 0;
-    for (u_int8_t byte : bytesVector) {
-        for (int i = 0; i < 8; ++i) {
-            if (bitsCount++ >bitsNum)
-                return bitsVector;
-            bool bit = (byte >> i) & 1; // Extract the i-th bit
-            bitsVector.push_back(bit);
-        }
-    }
-    return bitsVector;
+void FileSystem::loadBitMap(BitMap& bitMap, size_t bitsNum, u_int64_t bitMapAddr){
+    bitMap.resize(bitsNum);
+    //one transfer, big tables would only push metadata out of the cache
+    disk.readDirect(bitMapAddr, bitMap.bytes(), bitMap.bytesSize());
+    bitMap.bytesLoaded();
 }
-void FileSystem::saveBitsVector(const BitsVector& bitsVector, u_int32_t bytesVectorAddr) const{
-    std::ofstream disk(diskName, std::ios::binary | std::ios::in | std::ios::out);
-    if (!disk) {
-        std::cerr << "Error: Could not open disk file.\n";
-        throw;
-    }
-    BytesVector bytesVector = convertBitsToBytes(bitsVector);
-    disk.seekp(bytesVectorAddr);
-    disk.write((char*)bytesVector.data(), bytesVector.size());
-    disk.close();
-}
-BytesVector FileSystem::loadBytesVector(size_t bytesNum, u_int32_t bytesVectorAddr){
-    BytesVector bytesVector(bytesNum, 0);
-    std::ifstream disk(diskName, std::ios::binary | std::ios::in);
-    if (!disk) {
-        std::cerr << "Error: Could not open disk file.\n";
-        throw;
-    }
-    disk.seekg(bytesVectorAddr);
-    disk.read((char*)bytesVector.data(), bytesNum);
-    return bytesVector;
+void FileSystem::saveBitMap(BitMap& bitMap, u_int64_t bitMapAddr){
+    //only chunks changed since the last save
+    for (const auto& range : bitMap.dirtyRanges())
+        disk.write(bitMapAddr + range.first, bitMap.bytes() + range.first, range.second);
+    bitMap.clearDirty();
 }
 
 void FileSystem::loadINodesBitMap(){
-    u_int32_t INodesBitMapAddr = sizeof(SuperBlock);
-    BytesVector INodesBytesMap = loadBytesVector(INodesBitMapBytesSize, INodesBitMapAddr);
-    INodesBitMap = convertBytesToBits(INodesBytesMap, INODES_NUM);
+    std::unique_lock<std::shared_mutex> lock(INodesMutex);
+    loadBitMap(INodesBitMap, diskSuperBlockInfo.INodesNum, diskSuperBlockInfo.INodesBitMapStartAddr);
 }
 
 void FileSystem::loadDataBlocksBitMap(){
-    u_int32_t DataBlocksBitMapAddr = sizeof(SuperBlock) + INodesBitMapBytesSize;
-    BytesVector DataBlocksBytesMap = loadBytesVector(DataBlocksBitMapBytesSize, DataBlocksBitMapAddr);
-    DataBlocksBitMap = convertBytesToBits(DataBlocksBytesMap, DataBlocksNum);
+    loadBitMap(DataBlocksBitMap, DataBlocksNum, diskSuperBlockInfo.DataBlocksBitMapStartAddr);
 }
 void FileSystem::saveINodesBitMap(){
-    u_int32_t INodesBitMapAddr = sizeof(SuperBlock);
-    saveBitsVector(INodesBitMap, INodesBitMapAddr);
+    saveBitMap(INodesBitMap, diskSuperBlockInfo.INodesBitMapStartAddr);
 }
 
 void FileSystem::saveDataBlocksBitMap(){
-    u_int32_t DataBlocksBitMapAddr = sizeof(SuperBlock) + INodesBitMapBytesSize;
-    saveBitsVector(DataBlocksBitMap, DataBlocksBitMapAddr);
+    saveBitMap(DataBlocksBitMap, diskSuperBlockInfo.DataBlocksBitMapStartAddr);
+}
+void FileSystem::loadRefCounts(){
+    if (legacy){
+        DataBlocksRefCounts.resize(0);
+        return;
+    }
+    DataBlocksRefCounts.resize(DataBlocksNum);
+    disk.readDirect(diskSuperBlockInfo.RefCountsStartAddr, DataBlocksRefCounts.bytes(), DataBlocksRefCounts.bytesSize());
+    DataBlocksRefCounts.bytesLoaded();
 }
-void FileSystem::saveSuperBlock() const {
-    std::ofstream disk(diskName, std::ios::binary | std::ios::out | std::ios::in);
-    disk.write((char*)&diskSuperBlockInfo, sizeof(SuperBlock));
-    disk.close();
+void FileSystem::saveRefCounts(){
+    for (const auto& range : DataBlocksRefCounts.dirtyRanges())
+        disk.write(diskSuperBlockInfo.RefCountsStartAddr + range.first, DataBlocksRefCounts.bytes() + range.first, range.second);
+    DataBlocksRefCounts.clearDirty();
 }
-const u_int FileSystem::freeINodesNum() const{
-    u_int freeINodes = 0;
-    for (const auto& n: INodesBitMap){
-        if(!n)
-            freeINodes++;
+void FileSystem::commitMetadata(){
+    if (batch){
+        //long batches are committed part way, before their pages outgrow the cache and the journal
+        if (disk.commitDue()){
+            commitBatch();
+            beginBatch();
+        }
+        return;
+    }
+    //journal must not reach the disk before the file data committed INodes point at,
+    //concurrent commits may both sync but none skips a write that returned before it
+    u_int64_t writes = DataBlocksWrites.load(std::memory_order_acquire);
+    if (writes != DataBlocksSyncedWrites.load(std::memory_order_acquire)){
+        disk.syncDirect();
+        DataBlocksSyncedWrites.store(writes, std::memory_order_release);
     }
-    return freeINodes;
+    {
+        std::lock_guard<std::recursive_mutex> lock(allocationMutex);
+        saveINodesBitMap();
+        saveDataBlocksBitMap();
+        saveRefCounts();
+    }
+    disk.flush();
+}
+void FileSystem::beginBatch(){
+    batch = true;
+}
+void FileSystem::commitBatch(){
+    if (!batch)
+        return;
+    batch = false;
+    for (const auto& run : batchFreedDataBlocks)
+        freeDataBlocks(run.first, run.second);
+    batchFreedDataBlocks.clear();
+    if (disk.isOpen() && !legacy)
+        commitMetadata();
+}
+void FileSystem::commitPreviousDisk(){
+    //batch stays open for the next disk
+    bool batched = batch;
+    commitBatch();
+    batch = batched;
+}
+void FileSystem::saveSuperBlock(){
+    disk.write(0, &diskSuperBlockInfo, sizeof(SuperBlock));
+}
+u_int FileSystem::freeINodesNum() const{
+    std::lock_guard<std::recursive_mutex> lock(allocationMutex);
+    return INodesBitMap.freeNum();
 }
 
-const u_int FileSystem::freeDataBlocksNum() const{
-    u_int freeDataBlocks = 0;
-    for (const auto& n: DataBlocksBitMap){
-        if(!n)
-            freeDataBlocks++;
-    }
-    return freeDataBlocks;
+u_int FileSystem::freeDataBlocksNum(){
+    std::lock_guard<std::recursive_mutex> lock(allocationMutex);
+    loadDataBlocksTables();
+    return DataBlocksBitMap.freeNum();
 }
 
-const std::pair<size_t, size_t> FileSystem::availableSpace() const{
+const std::pair<size_t, size_t> FileSystem::availableSpace(){
     return {freeINodesNum(), freeDataBlocksNum()};
 }
 
-const size_t FileSystem::getFreeINodeIndex() const {
-    for (size_t i=0; i < INodesBitMap.size(); i++)
-        if (!INodesBitMap[i])
-            return i;
+size_t FileSystem::getFreeINodeIndex() const {
+    size_t i = INodesBitMap.findFree();
+    if (i != BitMap::npos)
+        return i;
     std::cerr<<"Error: No free INode found";
-    throw;
+    throw "no free INode";
 }
 
-const std::vector<size_t> FileSystem::getFreeDataBlocksIndexes(size_t DataBlocksNum) const{
-    std::vector<size_t> indexes;
-    for (size_t i=0; i < DataBlocksBitMap.size(); i++)
-        if (!DataBlocksBitMap[i] && indexes.size() != DataBlocksNum)
-            indexes.push_back(i);
-    if (indexes.size() < DataBlocksNum){
-        std::cerr<<"Error: Not enough free DataBlocks found";
-        throw;
+std::vector<Extent> FileSystem::allocateExtents(size_t DataBlocksNum){
+    std::lock_guard<std::recursive_mutex> lock(allocationMutex);
+    loadDataBlocksTables();
+    std::vector<Extent> extents;
+    u_int32_t fileBlock = 0;
+    for (const auto& run : DataBlocksAllocator.allocate(DataBlocksNum)){
+        for (u_int32_t i = 0; i < run.length; i++)
+            DataBlocksBitMap.set(run.start + i);
+        extents.push_back({fileBlock, run.start, run.length});
+        fileBlock += run.length;
     }
-    return indexes; 
+    STAT_ADD(DataBlocksAllocated, fileBlock);
+    return extents;
 }
-void FileSystem::saveINode(const INode& _INode, u_int32_t INodeAddr){
-    std::ofstream disk(diskName, std::ios::binary | std::ios::in | std::ios::out);
-    if (!disk) {
-        std::cerr << "Error: Could not open disk file.\n";
-        throw;
-    }
-    disk.seekp(INodeAddr);
-    disk.write((char*)&_INode, sizeof(INode));
-    disk.close();
+
+std::vector<size_t> FileSystem::allocateDataBlocks(size_t DataBlocksNum){
+    std::vector<size_t> indexes;
+    for (const auto& e : allocateExtents(DataBlocksNum))
+        for (u_int32_t i = 0; i < e.length; i++)
+            indexes.push_back(e.startDataBlock + i);
+    return indexes;
 }
-void FileSystem::saveDataBlocks(const std::vector<DataBlock>& _DataBlocks, u_int32_t firstDataBlockAddr){
-    std::ofstream disk(diskName, std::ios::binary | std::ios::in | std::ios::out);
-    if (!disk) {
-        std::cerr << "Error: Could not open disk file.\n";
-        throw;
+
+void FileSystem::freeDataBlocks(u_int32_t firstDataBlockIndex, u_int32_t DataBlocksNum){
+    std::lock_guard<std::recursive_mutex> lock(allocationMutex);
+    loadDataBlocksTables();
+    //committed metadata may still point at blocks freed in a batch, they must not be overwritten before it ends
+    if (batch){
+        batchFreedDataBlocks.push_back({firstDataBlockIndex, DataBlocksNum});
+        return;
     }
-    disk.seekp(firstDataBlockAddr);
-    disk.write((char*)&_DataBlocks[0], sizeof(DataBlock));
-    for (size_t i = 1; i < _DataBlocks.size(); i++){
-        disk.seekp(_DataBlocks[i-1].nextDataBlockAddr);
-        disk.write((char*)&_DataBlocks[i], sizeof(DataBlock));
+    for (u_int32_t i = 0; i < DataBlocksNum; i++)
+        DataBlocksBitMap.reset(firstDataBlockIndex + i);
+    DataBlocksAllocator.release(firstDataBlockIndex, DataBlocksNum);
+    STAT_ADD(DataBlocksFreed, DataBlocksNum);
+}
+
+std::vector<Extent> FileSystem::allocateFileExtents(size_t DataBlocksNum){
+    std::lock_guard<std::recursive_mutex> lock(allocationMutex);
+    std::vector<Extent> extents = allocateExtents(DataBlocksNum);
+    for (const auto& e : extents)
+        for (u_int32_t i = 0; i < e.length; i++)
+            DataBlocksRefCounts.acquire(e.startDataBlock + i);
+    return extents;
+}
+
+void FileSystem::appendFileBlocks(std::vector<Extent>& extents, size_t DataBlocksNum){
+    std::lock_guard<std::recursive_mutex> lock(allocationMutex);
+    if (freeDataBlocksNum() < DataBlocksNum)
+        throw "Disk is full";
+    u_int32_t fileBlocksNum = extents.empty() ? 0 : extents.back().fileBlock + extents.back().length;
+    for (Extent e : allocateFileExtents(DataBlocksNum)){
+        e.fileBlock += fileBlocksNum;
+        Extent* last = extents.empty() ? nullptr : &extents.back();
+        if (last && last->startDataBlock + last->length == e.startDataBlock)
+            last->length += e.length;
+        else
+            extents.push_back(e);
     }
-    disk.close();
 }
-INode FileSystem::loadINode(u_int32_t INodeAddr){
-    std::ifstream disk(diskName, std::ios::binary | std::ios::in);
-    if (!disk) {
-        std::cerr << "Error: Could not open disk file.\n";
-        throw;
+
+void FileSystem::releaseDataBlocks(u_int32_t firstDataBlockIndex, u_int32_t DataBlocksNum){
+    std::lock_guard<std::recursive_mutex> lock(allocationMutex);
+    loadDataBlocksTables();
+    //blocks losing their last reference are freed in runs
+    u_int32_t runStart = firstDataBlockIndex;
+    u_int32_t runLength = 0;
+    for (u_int32_t i = firstDataBlockIndex; i < firstDataBlockIndex + DataBlocksNum; i++){
+        if (DataBlocksRefCounts.release(i) > 0)
+            continue;
+        if (runLength > 0 && runStart + runLength == i){
+            runLength++;
+            continue;
+        }
+        if (runLength > 0)
+            freeDataBlocks(runStart, runLength);
+        runStart = i;
+        runLength = 1;
     }
-    disk.seekg(INodeAddr);
+    if (runLength > 0)
+        freeDataBlocks(runStart, runLength);
+}
+u_int64_t FileSystem::INodeAddr(size_t INodeIndex) const{
+    return diskSuperBlockInfo.INodesSectionStartAddr + INodeIndex * sizeof(INode);
+}
+u_int64_t FileSystem::DataBlockAddr(u_int32_t DataBlockIndex) const{
+    return diskSuperBlockInfo.DataBlocksSectionStartAddr + u_int64_t(DataBlockIndex) * DataBlockSize;
+}
+size_t FileSystem::dataBlocksNum(u_int64_t bytesNum) const{
+    return (bytesNum + DataBlockSize - 1) / DataBlockSize;
+}
+void FileSystem::saveINode(const INode& _INode, size_t INodeIndex){
+    disk.write(INodeAddr(INodeIndex), &_INode, sizeof(INode));
+}
+INode FileSystem::loadINode(size_t INodeIndex){
     INode _INode;
-    disk.read((char*)&_INode, sizeof(INode));
-    disk.close();
+    disk.read(INodeAddr(INodeIndex), &_INode, sizeof(INode));
     return _INode;
 }
-std::vector<DataBlock> FileSystem::loadDataBlocks(u_int32_t firstDataBlockAddr){
-    std::ifstream disk(diskName, std::ios::binary | std::ios::in);
-    if (!disk) {
-        std::cerr << "Error: Could not open disk file.\n";
-        throw;
+const INode& FileSystem::loadINode(size_t INodeIndex, INode& buffer){
+    if (const INode* view = disk.view<INode>(INodeAddr(INodeIndex)))
+        return *view;
+    disk.read(INodeAddr(INodeIndex), &buffer, sizeof(INode));
+    return buffer;
+}
+size_t FileSystem::extentBlocksNum(size_t extentsNum) const{
+    if (extentsNum <= INODE_EXTENTS_NUM)
+        return 0;
+    return (extentsNum - INODE_EXTENTS_NUM + ExtentBlockExtentsNum - 1) / ExtentBlockExtentsNum;
+}
+std::vector<Extent> FileSystem::loadExtents(const INode& _INode){
+    if (_INode.flags & INODE_INLINE)
+        return {};
+    return withDataBlockSize(DataBlockSize, [&](auto BlockSize){
+        return loadExtents<BlockSize>(_INode);
+    });
+}
+template<u_int32_t BlockSize>
+std::vector<Extent> FileSystem::loadExtents(const INode& _INode){
+    std::vector<Extent> extents(_INode.extents, _INode.extents + std::min(_INode.extentsNum, u_int32_t(INODE_EXTENTS_NUM)));
+    u_int32_t ExtentBlockIndex = _INode.extentBlockIndex;
+    //corrupt chain must not loop: no more ExtentBlocks than extents need, each one visited once and not empty
+    std::vector<u_int32_t> visited;
+    while (extents.size() < _INode.extentsNum){
+        if (ExtentBlockIndex >= DataBlocksNum || visited.size() >= extentBlocksNum(_INode.extentsNum) || std::find(visited.begin(), visited.end(), ExtentBlockIndex) != visited.end()){
+            std::cerr<<"Error: Invalid ExtentBlock index in INode.\n";
+            throw "corrupted disk";
+        }
+        visited.push_back(ExtentBlockIndex);
+        ExtentBlock<BlockSize> _ExtentBlock;
+        disk.read(DataBlockAddr<BlockSize>(ExtentBlockIndex), &_ExtentBlock, sizeof(_ExtentBlock));
+        STAT_ADD(ExtentBlocksRead, 1);
+        if (_ExtentBlock.extentsNum == 0){
+            std::cerr<<"Error: Empty ExtentBlock in chain of INode.\n";
+            throw "corrupted disk";
+        }
+        u_int32_t count = std::min(_ExtentBlock.extentsNum, _ExtentBlock.extentsCapacity);
+        extents.insert(extents.end(), _ExtentBlock.extents, _ExtentBlock.extents + count);
+        ExtentBlockIndex = _ExtentBlock.nextExtentBlockIndex;
+    }
+    extents.resize(_INode.extentsNum);
+    for (const auto& e : extents){
+        if (u_int64_t(e.startDataBlock) + e.length > DataBlocksNum){
+            std::cerr<<"Error: Extent outside of DataBlocks section.\n";
+            throw "corrupted disk";
+        }
+    }
+    return extents;
+}
+std::vector<u_int32_t> FileSystem::loadExtentBlocksIndexes(const INode& _INode){
+    std::vector<u_int32_t> indexes;
+    u_int32_t ExtentBlockIndex = _INode.extentBlockIndex;
+    while (ExtentBlockIndex != NO_DATABLOCK && indexes.size() < extentBlocksNum(_INode.extentsNum)){
+        if (ExtentBlockIndex >= DataBlocksNum || std::find(indexes.begin(), indexes.end(), ExtentBlockIndex) != indexes.end()){
+            std::cerr<<"Error: Invalid ExtentBlock index in INode.\n";
+            throw "corrupted disk";
+        }
+        indexes.push_back(ExtentBlockIndex);
+        u_int32_t next = NO_DATABLOCK;
+        disk.read(DataBlockAddr(ExtentBlockIndex), &next, sizeof(next));
+        ExtentBlockIndex = next;
+    }
+    return indexes;
+}
+void FileSystem::saveExtents(INode& _INode, const std::vector<Extent>& extents, const std::vector<size_t>& ExtentBlocksIndexes){
+    withDataBlockSize(DataBlockSize, [&](auto BlockSize){
+        saveExtents<BlockSize>(_INode, extents, ExtentBlocksIndexes);
+    });
+}
+template<u_int32_t BlockSize>
+void FileSystem::saveExtents(INode& _INode, const std::vector<Extent>& extents, const std::vector<size_t>& ExtentBlocksIndexes){
+    _INode.flags &= ~INODE_INLINE;
+    _INode.extentsNum = extents.size();
+    _INode.extentBlockIndex = NO_DATABLOCK;
+    size_t directNum = std::min(extents.size(), size_t(INODE_EXTENTS_NUM));
+    std::fill(_INode.inlineData, _INode.inlineData + INODE_INLINE_DATA_SIZE, 0);
+    std::fill(_INode.extents, _INode.extents + INODE_EXTENTS_NUM, Extent());
+    std::copy(extents.begin(), extents.begin() + directNum, _INode.extents);
+    if (ExtentBlocksIndexes.size() < extentBlocksNum(extents.size()))
+        throw "not enough ExtentBlocks";
+    if (!ExtentBlocksIndexes.empty() && directNum < extents.size())
+        _INode.extentBlockIndex = ExtentBlocksIndexes[0];
+    size_t saved = directNum;
+    for (size_t i = 0; saved < extents.size(); i++){
+        ExtentBlock<BlockSize> _ExtentBlock;
+        _ExtentBlock.extentsNum = std::min(extents.size() - saved, size_t(_ExtentBlock.extentsCapacity));
+        std::copy(extents.begin() + saved, extents.begin() + saved + _ExtentBlock.extentsNum, _ExtentBlock.extents);
+        saved += _ExtentBlock.extentsNum;
+        if (saved < extents.size())
+            _ExtentBlock.nextExtentBlockIndex = ExtentBlocksIndexes[i + 1];
+        disk.write(DataBlockAddr<BlockSize>(ExtentBlocksIndexes[i]), &_ExtentBlock, sizeof(_ExtentBlock));
+    }
+}
+void FileSystem::saveInlineData(INode& _INode, const u_int8_t* data, size_t bytesNum){
+    if (bytesNum > INODE_INLINE_DATA_SIZE)
+        throw "file too big to be inlined";
+    _INode.flags |= INODE_INLINE;
+    _INode.extentsNum = 0;
+    _INode.extentBlockIndex = NO_DATABLOCK;
+    std::fill(_INode.inlineData, _INode.inlineData + INODE_INLINE_DATA_SIZE, 0);
+    std::copy(data, data + bytesNum, _INode.inlineData);
+}
+std::string FileSystem::INodeFileName(const INode& _INode) const{
+    return std::string(_INode.fileName, strnlen(_INode.fileName, MAX_FILENAME_SIZE));
+}
+u_int32_t FileSystem::directoryHash(const std::string& fileName) const{
+    return fnv1a32(fileName.data(), fileName.size());
+}
+u_int64_t FileSystem::DirectoryEntryAddr(u_int32_t slot) const{
+    return diskSuperBlockInfo.DirectoryStartAddr + u_int64_t(slot) * sizeof(DirectoryEntry);
+}
+DirectoryEntry FileSystem::loadDirectoryEntry(u_int32_t slot){
+    DirectoryEntry entry;
+    disk.read(DirectoryEntryAddr(slot), &entry, sizeof(DirectoryEntry));
+    return entry;
+}
+void FileSystem::saveDirectoryEntry(const DirectoryEntry& entry, u_int32_t slot){
+    disk.write(DirectoryEntryAddr(slot), &entry, sizeof(DirectoryEntry));
+}
+void FileSystem::addDirectoryEntry(const std::string& fileName, size_t INodeIndex){
+    u_int32_t nameHash = directoryHash(fileName);
+    u_int32_t slot = nameHash & (DirectorySlotsNum - 1);
+    //table has at least twice as many slots as INodes, a free one is always found
+    while (loadDirectoryEntry(slot).INodeNumber != 0)
+        slot = (slot + 1) & (DirectorySlotsNum - 1);
+    saveDirectoryEntry({nameHash, u_int32_t(INodeIndex + 1)}, slot);
+}
+void FileSystem::removeDirectoryEntry(const std::string& fileName){
+    u_int32_t nameHash = directoryHash(fileName);
+    u_int32_t mask = DirectorySlotsNum - 1;
+    u_int32_t slot = nameHash & mask;
+    size_t INodeIndex = lookupFile(fileName);
+    if (INodeIndex == NO_INODE)
+        return;
+    while (loadDirectoryEntry(slot).INodeNumber != INodeIndex + 1)
+        slot = (slot + 1) & mask;
+    //backward shift deletion, entries after the hole move back if their home slot allows it
+    u_int32_t hole = slot;
+    u_int32_t next = (hole + 1) & mask;
+    while (true){
+        DirectoryEntry entry = loadDirectoryEntry(next);
+        if (entry.INodeNumber == 0)
+            break;
+        u_int32_t home = entry.nameHash & mask;
+        if (((next - home) & mask) >= ((next - hole) & mask)){
+            saveDirectoryEntry(entry, hole);
+            hole = next;
+        }
+        next = (next + 1) & mask;
     }
-    u_int32_t nextDataBlockAddr = firstDataBlockAddr;
-    std::vector<DataBlock> _DataBlocks;
-    while (nextDataBlockAddr != 0){
-    disk.seekg(nextDataBlockAddr);
-    DataBlock _DataBlock;
-    disk.read((char*)&_DataBlock, sizeof(DataBlock));
-    nextDataBlockAddr = _DataBlock.nextDataBlockAddr;
-    _DataBlocks.push_back(_DataBlock);
-    }
-    return _DataBlocks;
-}
\ No newline at end of file
+    saveDirectoryEntry(DirectoryEntry(), hole);
+}
+const Extent* FileSystem::findExtent(const std::vector<Extent>& extents, u_int32_t fileBlock) const{
+    //extents are sorted by fileBlock, binary search for the last one starting at or before fileBlock
+    auto next = std::upper_bound(extents.begin(), extents.end(), fileBlock, [](u_int32_t block, const Extent& e){
+        return block < e.fileBlock;
+    });
+    if (next == extents.begin())
+        return nullptr;
+    const Extent& e = *(next - 1);
+    if (fileBlock - e.fileBlock >= e.length)
+        return nullptr;
+    return &e;
+}
+
+template<u_int32_t BlockSize>
+size_t FileSystem::streamFileToDisk(std::istream& file, u_int64_t fileSize_B, std::vector<Extent>& extents){
+    //stream the file window by window, next window is read from the file while current one is written to disk
+    //extents are allocated beforehand, on dedup disks they are built here, returns number of shared DataBlocks
+    const u_int64_t DataBlocksNum = (fileSize_B + BlockSize - 1) / BlockSize;
+    const size_t windowBlocks = std::max(1u, STREAM_WINDOW_SIZE / BlockSize);
+    u_int64_t bytesRead = 0;
+    BytesVector windows[2];
+    windows[0].resize(windowBlocks * BlockSize);
+    windows[1].resize(windowBlocks * BlockSize);
+    auto readWindow = [&](BytesVector& window, size_t first){
+        size_t count = std::min(windowBlocks, DataBlocksNum - first);
+        std::memset(window.data(), 0, count * BlockSize);
+        //the last window is not read past fileSize_B, file may be a stream with more data after it
+        file.read((char*)window.data(), std::min(u_int64_t(count) * BlockSize, fileSize_B - u_int64_t(first) * BlockSize));
+        bytesRead += file.gcount();
+        return count;
+    };
+    size_t current = 0;
+    size_t savedDataBlocksNum = 0;
+    size_t sharedNum = 0;
+    std::future<size_t> pendingRead;
+    if (DataBlocksNum > 0)
+        pendingRead = std::async(std::launch::async, readWindow, std::ref(windows[current]), 0);
+    while (savedDataBlocksNum < DataBlocksNum){
+        size_t count = pendingRead.get();
+        if (savedDataBlocksNum + count < DataBlocksNum)
+            pendingRead = std::async(std::launch::async, readWindow, std::ref(windows[current ^ 1]), savedDataBlocksNum + count);
+        if (dedup)
+            sharedNum += dedupFileBlocks(extents, windows[current].data(), count);
+        else
+            writeFileBlocks<BlockSize>(extents, savedDataBlocksNum, count, windows[current].data());
+        savedDataBlocksNum += count;
+        current ^= 1;
+    }
+    if (bytesRead != fileSize_B)
+        throw "File changed while reading";
+    return sharedNum;
+}
+template<u_int32_t BlockSize>
+void FileSystem::streamFileFromDisk(std::ofstream& file, const std::vector<Extent>& extents, u_int64_t fileSize_B){
+    //each extent is read in runs of up to STREAM_WINDOW_SIZE bytes, STREAM_READAHEAD_WINDOWS runs are read at once
+    //with all of them in flight, previous batch is written to the file while next one is read from disk,
+    //on mapped disk runs are written straight from the mapping
+    const u_int32_t windowBlocks = std::max(1u, STREAM_WINDOW_SIZE / BlockSize);
+    const size_t batchBlocks = size_t(windowBlocks) * STREAM_READAHEAD_WINDOWS;
+    BytesVector buffers[2];
+    if (!disk.isMapped()){
+        buffers[0].resize(batchBlocks * BlockSize);
+        buffers[1].resize(batchBlocks * BlockSize);
+    }
+    std::vector<std::pair<const u_int8_t*, size_t>> pieces[2]; // {data, bytes} of a batch
+    auto writePieces = [&file](const std::vector<std::pair<const u_int8_t*, size_t>>& batchPieces){
+        for (const auto& piece : batchPieces)
+            file.write((const char*)piece.first, piece.second);
+    };
+    size_t current = 0;
+    std::future<void> pendingWrite;
+    std::vector<std::pair<u_int32_t, u_int32_t>> runs; // {first, number} of the batch
+    std::vector<size_t> runsBytes;
+    size_t runsBlocks = 0;
+    auto streamBatch = [&](){
+        u_int8_t* buffer = buffers[current].data();
+        if (!disk.isMapped())
+            readDataBlocksAll(runs, buffer);
+        pieces[current].clear();
+        for (size_t r = 0; r < runs.size(); r++){
+            const u_int8_t* data = disk.mappedData(DataBlockAddr<BlockSize>(runs[r].first), runs[r].second * BlockSize);
+            if (data)
+                verifyDataBlocks(runs[r].first, data, runs[r].second);
+            else{
+                data = buffer;
+                buffer += runs[r].second * BlockSize;
+            }
+            pieces[current].push_back({data, runsBytes[r]});
+        }
+        if (pendingWrite.valid())
+            pendingWrite.get();
+        pendingWrite = std::async(std::launch::async, writePieces, std::cref(pieces[current]));
+        current ^= 1;
+        runs.clear();
+        runsBytes.clear();
+        runsBlocks = 0;
+    };
+    u_int64_t bytesToWrite = fileSize_B;
+    for (const auto& e : extents){
+        for (u_int32_t offset = 0; offset < e.length; offset += windowBlocks){
+            if (!(bytesToWrite > 0)){
+                std::cerr<<"Error: File size smaller than DataBlocks saved info.\n";
+                throw "corrupted disk";
+            }
+            size_t runBlocks = std::min(windowBlocks, e.length - offset);
+            if (runsBlocks + runBlocks > batchBlocks)
+                streamBatch();
+            size_t runBytes = std::min(bytesToWrite, u_int64_t(runBlocks * BlockSize));
+            runs.push_back({e.startDataBlock + offset, runBlocks});
+            runsBytes.push_back(runBytes);
+            runsBlocks += runBlocks;
+            bytesToWrite -= runBytes;
+        }
+    }
+    if (!runs.empty())
+        streamBatch();
+    if (pendingWrite.valid())
+        pendingWrite.get();
+    if (bytesToWrite > 0){
+        std::cerr<<"Error: File size bigger than DataBlocks saved info.\n";
+        throw "corrupted disk";
+    }
+}
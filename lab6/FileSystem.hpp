@@ -8,76 +8,434 @@
 #include <bitset>
 #include <cstring>
 #include <utility>
+#include "BlockDevice.hpp"
+#include "BitMap.hpp"
+#include "ExtentAllocator.hpp"
+#include "RefCountTable.hpp"
+#include "IOStats.hpp"
+#include <mutex>
+#include <shared_mutex>
+#include <atomic>
+#include <algorithm>
+#include <type_traits>
+#include <functional>
 
 
-using BitsVector = std::vector<bool>;
 using BytesVector = std::vector<u_int8_t>;
 
-#define DATABLOCK_DATA_SIZE 4092
+#define FS_MAGIC 0x46494F53 // "SOIF", legacy disks start with their size [MB] instead
+#define FS_VERSION 11
+#define FS_DEDUP 0x1 // SuperBlock flag, DataBlocks with equal contents are shared between files
+#define DATABLOCK_SIZE 4096 // default DataBlock size, SuperBlock and journal blocks always use it
+#define MIN_DATABLOCK_SIZE 1024
+#define MAX_DATABLOCK_SIZE 1048576
+#define EXTENT_BLOCK_MAX_SIZE 4096 // ExtentBlocks use only the beginning of bigger DataBlocks
+#define DATABLOCK_DATA_SIZE 4092 // payload of legacy chained DataBlock
 #define MAX_FILENAME_SIZE 52
-#define INODES_NUM 64 // Number of files
+#define INODES_NUM 64 // Default number of files
+#define MAX_INODES_NUM (1u << 30)
+#define INODE_EXTENTS_NUM 15 // Extents stored directly in INode
+#define INODE_INLINE_DATA_SIZE 184 // files up to this size are stored in INode instead of DataBlocks
+#define INODE_INLINE 0x1 // INode flag, contents are in inlineData
+#define INODE_COMPRESSED 0x2 // INode flag, DataBlocks hold a chunk table and compressed chunks
+#define INODE_SNAPSHOT 0x4 // INode flag, not a file: DataBlocks hold a snapshot table, kept out of Directory
+#define SNAPSHOT_MAGIC 0x50414E53 // "SNAP", start of snapshot table
+#define NO_DATABLOCK 0xFFFFFFFF
+#define NO_INODE 0xFFFFFFFF
+#define MAX_DATABLOCKS_NUM 0xFFFFFFFE // DataBlocks are addressed by 32-bit index, up to 16TiB of data
+#define JOURNAL_MIN_BLOCKS 16
+#define JOURNAL_MAX_BLOCKS 4096 // 16MiB, journal takes 1/64 of the disk between these bounds
+#define STREAM_WINDOW_SIZE 65536 // bytes buffered at once by addFile and getFile, at least one DataBlock
+#define STREAM_READAHEAD_WINDOWS 16 // windows of getFile read at once, kept in flight together
+#define LEGACY_READAHEAD_MIN_BLOCKS 4 // chained DataBlocks read at once where a chain jumps
+#define LEGACY_READAHEAD_MAX_BLOCKS 256 // reached by doubling while a chain stays sequential
+#define COMPRESSION_CHUNK_SIZE 262144 // bytes of a compressed file compressed together
+#define COMPRESSION_CHUNK_MIN_BLOCKS 4 // chunks of big DataBlocks must be able to save some of them
+#define FINGERPRINT_PROBES_NUM 8 // slots of the fingerprint index searched from the home slot
+#define DEFRAG_WINDOW_SIZE 4194304 // bytes copied at once when defrag moves a file
+#define CHECK_WINDOW_SIZE 4194304 // bytes of DataBlocks verified at once by one fsck thread
 
-struct SuperBlock{  //12B
+struct SuperBlock{  //4096B, whole first block of the disk
+    u_int32_t magic=FS_MAGIC;
+    u_int32_t version=FS_VERSION;
+    u_int32_t diskSize=0;
+    u_int32_t INodesNum=0;
+    u_int32_t DataBlocksNum=0;
+    u_int32_t DirectorySlotsNum=0; // power of two, at least twice INodesNum
+    u_int64_t INodesBitMapStartAddr=0;
+    u_int64_t DataBlocksBitMapStartAddr=0;
+    u_int64_t INodesSectionStartAddr=0;
+    u_int64_t DirectoryStartAddr=0;
+    u_int64_t DataBlocksSectionStartAddr=0; // aligned to DATABLOCK_SIZE
+    u_int64_t JournalStartAddr=0; // aligned to DATABLOCK_SIZE, metadata write-ahead log
+    u_int32_t JournalBlocksNum=0;
+    u_int32_t DataBlockSize=DATABLOCK_SIZE; // power of two, MIN_DATABLOCK_SIZE to MAX_DATABLOCK_SIZE
+    u_int32_t flags=0;
+    u_int32_t FingerprintSlotsNum=0; // one per DataBlock on dedup disks
+    u_int64_t RefCountsStartAddr=0; // u_int32_t per DataBlock
+    u_int64_t FingerprintIndexStartAddr=0;
+    u_int64_t ChecksumsStartAddr=0; // CRC-32C as u_int32_t per DataBlock holding file data
+    u_int8_t reserved[DATABLOCK_SIZE - 112]={0};
+};
+
+struct Extent{  //12B, run of consecutive DataBlocks, trivial so it can share INode space with inline data
+    u_int32_t fileBlock; // index of the first DataBlock of the run within the file
+    u_int32_t startDataBlock; // index of the first DataBlock of the run within DataBlocks section
+    u_int32_t length;
+};
+
+struct INode{   //256B
+    u_int64_t fileSize_B=0;
+    char fileName[MAX_FILENAME_SIZE]={0};
+    u_int32_t extentsNum=0; // first INODE_EXTENTS_NUM in INode, rest in ExtentBlocks
+    u_int32_t extentBlockIndex=NO_DATABLOCK;
+    u_int32_t flags=0;
+    union{
+        Extent extents[INODE_EXTENTS_NUM];
+        u_int8_t inlineData[INODE_INLINE_DATA_SIZE]={0}; // whole file when INODE_INLINE is set
+    };
+};
+
+// Snapshot: INodes of all files as they were when it was taken, each one
+// followed by its extents past INODE_EXTENTS_NUM (extentBlockIndex is not
+// used). DataBlocks of the files get one more reference, so the files
+// copy them before they change them.
+struct SnapshotHeader{  //32B, start of snapshot table
+    u_int32_t magic=SNAPSHOT_MAGIC;
+    u_int32_t filesNum=0;
+    u_int64_t createdTime=0; // seconds since epoch
+    u_int64_t filesBytesSize=0; // sum of file sizes
+    u_int64_t reserved=0;
+};
+
+struct SnapshotFile{ // in memory only, file of a snapshot
+    INode _INode;
+    std::vector<Extent> extents;
+};
+
+struct DirectoryEntry{  //8B, slot of the on-disk hash table mapping file names to INodes
+    u_int32_t nameHash=0;
+    u_int32_t INodeNumber=0; // INode index + 1, 0 marks an empty slot
+};
+
+struct FingerprintEntry{  //16B, slot of the on-disk index of DataBlock contents, lossy: entries are overwritten, never removed
+    u_int64_t fingerprint=0;
+    u_int32_t DataBlockNumber=0; // DataBlock index + 1, 0 marks an empty slot
+    u_int32_t reserved=0;
+};
+
+template<u_int32_t BlockSize>
+struct DataBlock{   //BlockSize B
+    u_int8_t data[BlockSize]={0};
+};
+
+template<u_int32_t BlockSize>
+struct ExtentBlock{ //up to 4096B stored in one DataBlock, extents of fragmented files that do not fit into INode
+    static const u_int32_t size = BlockSize < EXTENT_BLOCK_MAX_SIZE ? BlockSize : EXTENT_BLOCK_MAX_SIZE;
+    static const u_int32_t extentsCapacity = (size - 8) / sizeof(Extent);
+    u_int32_t nextExtentBlockIndex=NO_DATABLOCK;
+    u_int32_t extentsNum=0;
+    Extent extents[extentsCapacity]={};
+};
+
+// Calls function with std::integral_constant of DataBlock size, so code
+// specialized for each supported size is compiled and picked at runtime.
+template<typename Function>
+auto withDataBlockSize(u_int32_t DataBlockSize, Function function){
+    switch (DataBlockSize){
+        case 1024: return function(std::integral_constant<u_int32_t, 1024>());
+        case 2048: return function(std::integral_constant<u_int32_t, 2048>());
+        case 4096: return function(std::integral_constant<u_int32_t, 4096>());
+        case 8192: return function(std::integral_constant<u_int32_t, 8192>());
+        case 16384: return function(std::integral_constant<u_int32_t, 16384>());
+        case 32768: return function(std::integral_constant<u_int32_t, 32768>());
+        case 65536: return function(std::integral_constant<u_int32_t, 65536>());
+        case 131072: return function(std::integral_constant<u_int32_t, 131072>());
+        case 262144: return function(std::integral_constant<u_int32_t, 262144>());
+        case 524288: return function(std::integral_constant<u_int32_t, 524288>());
+        case 1048576: return function(std::integral_constant<u_int32_t, 1048576>());
+    }
+    throw "unsupported DataBlock size";
+}
+
+// Legacy (version 1) format, DataBlocks of a file linked into a chain, read only
+struct LegacySuperBlock{  //12B
     u_int32_t diskSize=0;
     u_int32_t INodesSectionStartAddr=0;
     u_int32_t DataBlocksSectionStartAddr=0;
 };
 
-struct INode{   //60B
+struct LegacyINode{   //60B
     u_int32_t firstDataBlockAddr=0;
     u_int32_t fileSize_B=0;
     char fileName[MAX_FILENAME_SIZE]={0};
 };
 
-struct DataBlock{   //4096B
+struct LegacyDataBlock{   //4096B
     u_int32_t nextDataBlockAddr=0;
     u_int8_t data[DATABLOCK_DATA_SIZE]={0};
 };
 
+struct LegacyReadahead{ // in memory only, DataBlocks following the last one loaded from a chain
+    u_int32_t firstDataBlockAddr=0;
+    u_int32_t blocksNum=0; // read ahead, starting at firstDataBlockAddr
+    u_int32_t nextBlocksNum=LEGACY_READAHEAD_MIN_BLOCKS; // read when the chain leaves them
+    std::vector<LegacyDataBlock> blocks;
+};
+
+static_assert(sizeof(SuperBlock) == DATABLOCK_SIZE, "SuperBlock must fill one block");
+static_assert(sizeof(FingerprintEntry) == 16, "FingerprintEntry size is part of disk format");
+static_assert(sizeof(INode) == 256, "INode size is part of disk format");
+static_assert(sizeof(SnapshotHeader) == 32, "SnapshotHeader size is part of disk format");
+static_assert(sizeof(ExtentBlock<DATABLOCK_SIZE>) == DATABLOCK_SIZE - 8, "ExtentBlock size is part of disk format");
+static_assert(sizeof(ExtentBlock<MIN_DATABLOCK_SIZE>) <= MIN_DATABLOCK_SIZE, "ExtentBlock must fit into one DataBlock");
+static_assert(sizeof(LegacyDataBlock) == DATABLOCK_SIZE, "legacy DataBlock size is part of disk format");
+
+// Compressed file: DataBlocks of the file hold the chunks, each one starting
+// in a new DataBlock, followed by the chunk table, stored size [B] of every
+// chunk as u_int32_t. A chunk is stored raw (stored size equal to its size)
+// unless compression saves at least one DataBlock.
+struct CompressedChunk{ // in memory only
+    u_int32_t storedSize=0;
+    u_int32_t firstFileBlock=0; // where the stored chunk starts
+};
+
+struct DiskUsage{ // summary of a loaded disk for tools, sizes in DataBlocks
+    u_int32_t DataBlockSize=0;
+    u_int64_t DataBlocksNum=0;
+    u_int64_t freeDataBlocksNum=0;
+    u_int64_t freeRunsNum=0; // runs of consecutive free DataBlocks
+    u_int64_t filesNum=0;
+    u_int64_t extentsNum=0; // of all files
+    u_int64_t fragmentedFilesNum=0; // files stored in more than one extent
+};
+
+struct FileHandle{ // opened file, changes are saved to disk by closeFile
+    size_t INodeIndex=NO_INODE;
+    INode _INode;
+    std::vector<Extent> extents;
+    std::vector<CompressedChunk> chunks; // of a compressed file
+    BytesVector chunkData; // last chunk decompressed by readFile, empty if none
+    size_t chunkDataIndex=0;
+    std::vector<std::pair<u_int32_t, u_int32_t>> releasedDataBlocks; // {first, number} dropped by the file, committed INode uses them until closeFile
+    bool modified=false;
+};
+
 class FileSystem{
     public:
-    void createDisk(const std::string& diskName, u_int32_t size_MB);
+    ~FileSystem();
+    void createDisk(const std::string& diskName, u_int32_t size_MB, u_int32_t INodesNum = INODES_NUM, u_int32_t DataBlockSize = DATABLOCK_SIZE, bool dedup = false);
     void deleteDisk(const std::string& diskName);
-    void loadDisk(const std::string& diskName);
+    void loadDisk(const std::string& diskName, bool mapped = false, bool readOnly = false); // read only: nothing is written, not even journal replay
+    bool isLoaded(const std::string& diskName) const;
     void showDiskBitMaps();
-    const bool addFile(const std::string& fileName);
-    void listFiles();
-    const bool deleteFile(size_t fileINodeIndex);
+    bool addFile(const std::string& fileName);
+    bool addFile(const std::string& fileName, std::istream& file, u_int64_t fileSize_B); // fileSize_B bytes of file
+    size_t addFiles(const std::vector<std::string>& fileNames, size_t threadsNum);
+    void listFiles(std::ostream& out = std::cout);
+    DiskUsage diskUsage();
+    bool deleteFile(size_t fileINodeIndex);
     void getFile(size_t fileINodeIndex, const std::string& targetFileName);
+    size_t findFile(const std::string& fileName); // INode index or NO_INODE
+    bool INodeInUse(size_t INodeIndex) const;
+    FileHandle openFile(size_t fileINodeIndex);
+    FileHandle openFile(const std::string& fileName);
+    size_t readFile(FileHandle& handle, u_int64_t offset, void* buffer, size_t bytesNum);
+    void writeFile(FileHandle& handle, u_int64_t offset, const void* buffer, size_t bytesNum);
+    void appendFile(FileHandle& handle, const void* buffer, size_t bytesNum);
+    void truncateFile(FileHandle& handle, u_int64_t fileSize_B);
+    void closeFile(FileHandle& handle);
+    void setAllocationPolicy(AllocationPolicy policy);
+    void setCompression(bool compression); // files added from now on are compressed
+    void setImportVerification(bool verification); // addFiles reads stored files back and compares them with their sources
+    void beginBatch(); // following operations are committed together by commitBatch
+    void commitBatch();
+    // moves fragmented files into contiguous runs and other files towards the start of the disk,
+    // until done or a budget runs out (0 is no limit), returns number of moves
+    size_t defrag(double maxSeconds = 0, u_int64_t maxBytes = 0);
+    size_t checkDisk(size_t threadsNum); // fsck, verifies structure and checksums, returns number of problems
+    bool createSnapshot(const std::string& snapshotName);
+    bool deleteSnapshot(const std::string& snapshotName); // DataBlocks still used by files or other snapshots stay
+    void listSnapshots(std::ostream& out = std::cout);
+    void listSnapshotFiles(const std::string& snapshotName, std::ostream& out = std::cout);
+    void getSnapshotFile(const std::string& snapshotName, const std::string& fileName, const std::string& targetFileName);
     private:
-    void calculateTablesSizes(u_int32_t size_MB);
+    void calculateTablesSizes(u_int32_t size_MB, u_int32_t INodesNum, u_int32_t DataBlockSize, bool dedup);
     void createDiskInfo(u_int32_t size_MB);
+    void createDiskInfo(u_int32_t size_MB, SuperBlock& superBlock) const;
     void saveDiskInfo();
-    void allocateDiskSpace(int size_MB);
+    void allocateDiskSpace(u_int32_t size_MB);
     void loadDiskInfo();
-    BytesVector convertBitsToBytes(const BitsVector& bitsVector) const;
-    BitsVector convertBytesToBits(const BytesVector& bytesVector, size_t bitsNum) const;
-    void saveBitsVector(const BitsVector& bitsVector, u_int32_t bytesVectorAddr) const;
-    BytesVector loadBytesVector(size_t bytesNum, u_int32_t bytesVectorAddr);
+    void loadBitMap(BitMap& bitMap, size_t bitsNum, u_int64_t bitMapAddr);
+    void saveBitMap(BitMap& bitMap, u_int64_t bitMapAddr);
     void loadINodesBitMap();
     void loadDataBlocksBitMap();
     void saveINodesBitMap();
     void saveDataBlocksBitMap();
-    void saveSuperBlock() const;
-    const u_int freeINodesNum() const;
-    const u_int freeDataBlocksNum() const;
-    const std::pair<size_t, size_t> availableSpace() const;
-    const size_t getFreeINodeIndex() const;
-    const std::vector<size_t> getFreeDataBlocksIndexes(size_t DataBlocksNum) const;
-    void saveINode(const INode& _INode, u_int32_t INodeAddr);
-    void saveDataBlocks(const std::vector<DataBlock>& _DataBlocks, u_int32_t firstDataBlockAddr);
-    INode loadINode(u_int32_t INodeAddr);
-    std::vector<DataBlock> loadDataBlocks(u_int32_t firstDataBlockAddr);
+    void loadRefCounts();
+    void loadDataBlocksTables(); // bitmap, allocator and RefCounts, on first use after loadDisk
+    void saveRefCounts();
+    void saveSuperBlock();
+    void commitMetadata();
+    void commitPreviousDisk();
+    u_int freeINodesNum() const;
+    u_int freeDataBlocksNum();
+    const std::pair<size_t, size_t> availableSpace();
+    size_t getFreeINodeIndex() const;
+    std::vector<Extent> allocateExtents(size_t DataBlocksNum);
+    std::vector<size_t> allocateDataBlocks(size_t DataBlocksNum);
+    void freeDataBlocks(u_int32_t firstDataBlockIndex, u_int32_t DataBlocksNum);
+    std::vector<Extent> allocateFileExtents(size_t DataBlocksNum); // DataBlocks for file data, referenced once
+    void releaseDataBlocks(u_int32_t firstDataBlockIndex, u_int32_t DataBlocksNum); // file data, freed with the last reference
+    void appendFileBlocks(std::vector<Extent>& extents, size_t DataBlocksNum);
+    u_int64_t INodeAddr(size_t INodeIndex) const;
+    u_int64_t DataBlockAddr(u_int32_t DataBlockIndex) const;
+    template<u_int32_t BlockSize> u_int64_t DataBlockAddr(u_int32_t DataBlockIndex) const;
+    size_t dataBlocksNum(u_int64_t bytesNum) const; // DataBlocks needed for bytesNum
+    void saveINode(const INode& _INode, size_t INodeIndex);
+    INode loadINode(size_t INodeIndex);
+    const INode& loadINode(size_t INodeIndex, INode& buffer);
+    size_t extentBlocksNum(size_t extentsNum) const;
+    std::vector<Extent> loadExtents(const INode& _INode);
+    template<u_int32_t BlockSize> std::vector<Extent> loadExtents(const INode& _INode);
+    std::vector<u_int32_t> loadExtentBlocksIndexes(const INode& _INode);
+    void saveExtents(INode& _INode, const std::vector<Extent>& extents, const std::vector<size_t>& ExtentBlocksIndexes);
+    template<u_int32_t BlockSize> void saveExtents(INode& _INode, const std::vector<Extent>& extents, const std::vector<size_t>& ExtentBlocksIndexes);
+    void saveInlineData(INode& _INode, const u_int8_t* data, size_t bytesNum);
+    std::string INodeFileName(const INode& _INode) const;
+    u_int32_t directoryHash(const std::string& fileName) const;
+    u_int64_t DirectoryEntryAddr(u_int32_t slot) const;
+    DirectoryEntry loadDirectoryEntry(u_int32_t slot);
+    void saveDirectoryEntry(const DirectoryEntry& entry, u_int32_t slot);
+    void addDirectoryEntry(const std::string& fileName, size_t INodeIndex);
+    void removeDirectoryEntry(const std::string& fileName);
+    size_t lookupFile(const std::string& fileName); // findFile with directoryMutex already held
+    void getFile(const INode& _INode, const std::vector<Extent>& extents, const std::string& targetFileName);
+    size_t findSnapshot(const std::string& snapshotName); // INode index or NO_INODE
+    std::vector<SnapshotFile> loadSnapshot(const INode& _INode, SnapshotHeader& header);
+    void markINode(size_t INodeIndex, bool used); // under allocationMutex
+    const Extent* findExtent(const std::vector<Extent>& extents, u_int32_t fileBlock) const;
+    template<u_int32_t BlockSize> void writeFileBlocks(const std::vector<Extent>& extents, u_int32_t firstFileBlock, size_t blocksNum, const u_int8_t* buffer);
+    template<u_int32_t BlockSize> void readFileBlocks(const std::vector<Extent>& extents, u_int32_t firstFileBlock, size_t blocksNum, u_int8_t* buffer);
+    template<u_int32_t BlockSize> size_t streamFileToDisk(std::istream& file, u_int64_t fileSize_B, std::vector<Extent>& extents);
+    template<u_int32_t BlockSize> void streamFileFromDisk(std::ofstream& file, const std::vector<Extent>& extents, u_int64_t fileSize_B);
+    template<u_int32_t BlockSize> void readFileData(FileHandle& handle, u_int64_t offset, u_int8_t* buffer, size_t bytesNum);
+    template<u_int32_t BlockSize> void writeFileData(FileHandle& handle, u_int64_t offset, const u_int8_t* buffer, size_t bytesNum);
+    template<u_int32_t BlockSize> void truncateFileData(FileHandle& handle, u_int64_t fileSize_B);
+    u_int32_t fileBlocksNum(const FileHandle& handle) const;
+    void resizeFileBlocks(FileHandle& handle, u_int32_t blocksNum);
+    template<u_int32_t BlockSize> void moveInlineDataToBlocks(FileHandle& handle);
+    template<u_int32_t BlockSize> void unshareFileBlocks(FileHandle& handle, u_int32_t firstFileBlock, size_t blocksNum);
+    void remapFileBlock(std::vector<Extent>& extents, u_int32_t fileBlock, u_int32_t DataBlockIndex);
+    u_int64_t FingerprintEntryAddr(u_int32_t slot) const;
+    FingerprintEntry loadFingerprintEntry(u_int32_t slot);
+    void saveFingerprintEntry(const FingerprintEntry& entry, u_int32_t slot);
+    template<u_int32_t BlockSize> u_int32_t findDuplicateBlock(u_int64_t fingerprint, const u_int8_t* data, u_int8_t* buffer);
+    void addFingerprint(u_int64_t fingerprint, u_int32_t DataBlockIndex);
+    size_t dedupFileBlocks(std::vector<Extent>& extents, const u_int8_t* buffer, size_t blocksNum);
+    u_int32_t compressionChunkSize() const;
+    bool storeCompressedFile(std::istream& file, u_int64_t fileSize_B, std::vector<Extent>& extents, const std::function<void(const u_int8_t*, size_t)>& onRead = nullptr);
+    template<u_int32_t BlockSize> bool storeCompressedFile(std::istream& file, u_int64_t fileSize_B, std::vector<Extent>& extents, const std::function<void(const u_int8_t*, size_t)>& onRead);
+    void getCompressedFile(std::ostream& file, const std::vector<Extent>& extents, u_int64_t fileSize_B);
+    template<u_int32_t BlockSize> void getCompressedFile(std::ostream& file, const std::vector<Extent>& extents, u_int64_t fileSize_B);
+    void readCompressedChunks(const std::vector<Extent>& extents, u_int64_t fileSize_B, const std::function<void(const u_int8_t*, size_t)>& onChunk);
+    u_int64_t storedChecksum(const std::vector<Extent>& extents, u_int64_t fileSize_B, bool compressed, BytesVector& window); // FNV-1a 64 of contents read back from disk
+    std::vector<CompressedChunk> loadChunks(const std::vector<Extent>& extents, u_int64_t fileSize_B);
+    template<u_int32_t BlockSize> void loadChunk(const std::vector<Extent>& extents, const CompressedChunk& chunk, u_int32_t chunkBytes, u_int8_t* buffer, u_int8_t* storedBuffer);
+    void readCompressedFile(FileHandle& handle, u_int64_t offset, u_int8_t* buffer, size_t bytesNum);
+    void decompressFileToBlocks(FileHandle& handle);
+    template<u_int32_t BlockSize> void decompressFileToBlocks(FileHandle& handle);
+    template<u_int32_t BlockSize> size_t dedupFileBlocks(std::vector<Extent>& extents, const u_int8_t* buffer, size_t blocksNum);
+    u_int64_t ChecksumAddr(u_int32_t DataBlockIndex) const;
+    void writeDataBlocks(u_int32_t firstDataBlockIndex, const u_int8_t* buffer, size_t DataBlocksNum); // with their checksums
+    void readDataBlocks(u_int32_t firstDataBlockIndex, u_int8_t* buffer, size_t DataBlocksNum); // verified against their checksums
+    void readDataBlocksAll(const std::vector<std::pair<u_int32_t, u_int32_t>>& runs, u_int8_t* buffer); // {first, number} runs in flight together, one after another in buffer
+    void verifyDataBlocks(u_int32_t firstDataBlockIndex, const u_int8_t* data, size_t DataBlocksNum);
+    size_t checkLegacyDisk();
+    void indexDataBlocks(const u_int8_t* buffer, u_int32_t firstDataBlock, size_t blocksNum);
+    Extent allocateLowestExtent(u_int32_t DataBlocksNum, u_int32_t from, u_int32_t limit);
+    bool moveFile(size_t INodeIndex, const Extent& target, BytesVector& window); // into target allocated for it, released when the file cannot move
+    void loadLegacyDiskInfo();
+    void listLegacyFiles(std::ostream& out);
+    void getLegacyFile(size_t fileINodeIndex, const std::string& targetFileName);
+    size_t findLegacyFile(const std::string& fileName);
+    const LegacyDataBlock& loadLegacyDataBlock(u_int32_t DataBlockAddr, LegacyDataBlock& buffer, LegacyReadahead* readahead = nullptr);
 
     private:
     std::string diskName;
+    BlockDevice disk; // kept open for the whole FileSystem lifetime
     SuperBlock diskSuperBlockInfo;
-    BitsVector INodesBitMap;
-    BitsVector DataBlocksBitMap;
-    u_int32_t INodesBitMapBytesSize;
-    u_int32_t INodesSectionBytesSize;
+    bool legacy=false; // version 1 disk, read only
+    BitMap INodesBitMap;
+    // tables sized by the DataBlocks section are loaded by the first operation using them,
+    // commands only reading files (lf, gf, rd) do not pay for them on big disks
+    bool DataBlocksTablesLoaded=false;
+    BitMap DataBlocksBitMap;
+    ExtentAllocator DataBlocksAllocator; // free runs of DataBlocksBitMap
+    RefCountTable DataBlocksRefCounts; // references of files and snapshots to every DataBlock
+    // FileSystem operations may run from many threads (bulk import, server), locks are taken in this order
+    std::mutex metadataMutex; // INodes of changed files and their commit
+    std::shared_mutex directoryMutex; // Directory, shared by lookups
+    std::shared_mutex sharingMutex; // in place writes exclude snapshots and, on dedup disks, sharing of DataBlocks
+    mutable std::recursive_mutex allocationMutex; // bitmaps, allocator, RefCounts and fingerprint index
+    mutable std::shared_mutex INodesMutex; // INodesBitMap changes, lookups take it shared instead of allocationMutex
+    u_int32_t INodesNum;
+    u_int64_t INodesBitMapBytesSize;
+    u_int64_t INodesSectionBytesSize;
     u_int32_t DataBlocksNum;
-    u_int32_t DataBlocksBitMapBytesSize;
+    u_int64_t DataBlocksBitMapBytesSize;
+    u_int32_t DirectorySlotsNum;
+    u_int32_t JournalBlocksNum;
+    u_int32_t DataBlockSize=DATABLOCK_SIZE;
+    u_int32_t ExtentBlockExtentsNum; // Extents stored in one ExtentBlock
+    bool dedup=false; // FS_DEDUP disk
+    bool compression=false; // added files are compressed
+    bool importVerification=false; // imported files are read back, from the OS page cache, not the device
+    u_int64_t RefCountsBytesSize;
+    u_int32_t FingerprintSlotsNum;
+    u_int64_t ChecksumsBytesSize;
+    bool batch=false; // metadata commits are deferred until commitBatch, or until BlockDevice::commitDue
+    std::atomic<u_int64_t> DataBlocksWrites{0}; // writes of file data done, counted after they return
+    std::atomic<u_int64_t> DataBlocksSyncedWrites{0}; // DataBlocksWrites covered by the last syncDirect
+    std::vector<std::pair<u_int32_t, u_int32_t>> batchFreedDataBlocks; // {first, number} freed in the batch, reused after commitBatch
     // no need to keep INodes or DataBlocks in Memory, tables are sufficient
 };
+
+// DataBlock transfers specialized for one DataBlock size, used from all FileSystem sources
+
+template<u_int32_t BlockSize>
+u_int64_t FileSystem::DataBlockAddr(u_int32_t DataBlockIndex) const{
+    return diskSuperBlockInfo.DataBlocksSectionStartAddr + u_int64_t(DataBlockIndex) * BlockSize;
+}
+
+template<u_int32_t BlockSize>
+void FileSystem::writeFileBlocks(const std::vector<Extent>& extents, u_int32_t firstFileBlock, size_t blocksNum, const u_int8_t* buffer){
+    //consecutive DataBlocks of an extent are written with a single call
+    while (blocksNum > 0){
+        const Extent* e = findExtent(extents, firstFileBlock);
+        if (!e)
+            throw "file block outside of extents";
+        u_int32_t offset = firstFileBlock - e->fileBlock;
+        size_t runBlocks = std::min(blocksNum, size_t(e->length - offset));
+        writeDataBlocks(e->startDataBlock + offset, buffer, runBlocks);
+        buffer += runBlocks * BlockSize;
+        firstFileBlock += runBlocks;
+        blocksNum -= runBlocks;
+    }
+}
+
+template<u_int32_t BlockSize>
+void FileSystem::readFileBlocks(const std::vector<Extent>& extents, u_int32_t firstFileBlock, size_t blocksNum, u_int8_t* buffer){
+    while (blocksNum > 0){
+        const Extent* e = findExtent(extents, firstFileBlock);
+        if (!e)
+            throw "file block outside of extents";
+        u_int32_t offset = firstFileBlock - e->fileBlock;
+        size_t runBlocks = std::min(blocksNum, size_t(e->length - offset));
+        readDataBlocks(e->startDataBlock + offset, buffer, runBlocks);
+        buffer += runBlocks * BlockSize;
+        firstFileBlock += runBlocks;
+        blocksNum -= runBlocks;
+    }
+}
 #endif
@@ -0,0 +1,314 @@
+#include "FileSystem.hpp"
+#include <string>
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <memory>
+
+// Random access to stored files through FileHandle. Only DataBlocks of the
+// requested range are read or written, blocks are allocated only when the
+// file grows and released when it is truncated. INode, ExtentBlocks and
+// bitmaps are saved once by closeFile, DataBlocks the file no longer uses
+// are released only after that commit, until then the INode on disk still
+// points at them. Inline files stay in their INode
+// until they grow past INODE_INLINE_DATA_SIZE, compressed files are read
+// chunk by chunk and decompressed to plain DataBlocks by the first change.
+// DataBlocks shared with other files (dedup) or snapshots are copied before
+// they are modified.
+
+FileHandle FileSystem::openFile(size_t fileINodeIndex){
+    if (legacy)
+        throw "Random access is not supported on legacy disks";
+    if (!INodeInUse(fileINodeIndex))
+        throw "File with this Index does not exist on disk";
+    FileHandle handle;
+    handle.INodeIndex = fileINodeIndex;
+    handle._INode = loadINode(fileINodeIndex);
+    if (handle._INode.flags & INODE_SNAPSHOT)
+        throw "INode holds a snapshot, not a file";
+    handle.extents = loadExtents(handle._INode);
+    if (handle._INode.flags & INODE_COMPRESSED)
+        handle.chunks = loadChunks(handle.extents, handle._INode.fileSize_B);
+    STAT_ADD(FileOpens, 1);
+    return handle;
+}
+
+FileHandle FileSystem::openFile(const std::string& fileName){
+    size_t fileINodeIndex = findFile(fileName);
+    if (fileINodeIndex == NO_INODE)
+        throw "No file with such name on disk";
+    return openFile(fileINodeIndex);
+}
+
+size_t FileSystem::readFile(FileHandle& handle, u_int64_t offset, void* buffer, size_t bytesNum){
+    if (offset >= handle._INode.fileSize_B)
+        return 0;
+    bytesNum = std::min(u_int64_t(bytesNum), handle._INode.fileSize_B - offset);
+    if (handle._INode.flags & INODE_INLINE){
+        std::memcpy(buffer, handle._INode.inlineData + offset, bytesNum);
+        return bytesNum;
+    }
+    if (handle._INode.flags & INODE_COMPRESSED){
+        readCompressedFile(handle, offset, (u_int8_t*)buffer, bytesNum);
+        return bytesNum;
+    }
+    withDataBlockSize(DataBlockSize, [&](auto BlockSize){
+        readFileData<BlockSize>(handle, offset, (u_int8_t*)buffer, bytesNum);
+    });
+    return bytesNum;
+}
+
+void FileSystem::writeFile(FileHandle& handle, u_int64_t offset, const void* buffer, size_t bytesNum){
+    if (bytesNum == 0)
+        return;
+    u_int64_t end = offset + bytesNum;
+    if (handle._INode.flags & INODE_INLINE && end <= INODE_INLINE_DATA_SIZE){
+        //bytes past the end of an inline file are kept zeroed
+        std::memcpy(handle._INode.inlineData + offset, buffer, bytesNum);
+        handle._INode.fileSize_B = std::max(handle._INode.fileSize_B, end);
+        handle.modified = true;
+        return;
+    }
+    //blocks found unshared must stay so until written, dedup shares blocks of added files, snapshots of all files
+    std::unique_lock<std::shared_mutex> sharingLock(sharingMutex, std::defer_lock);
+    std::shared_lock<std::shared_mutex> snapshotLock(sharingMutex, std::defer_lock);
+    if (dedup)
+        sharingLock.lock();
+    else
+        snapshotLock.lock();
+    if (handle._INode.flags & INODE_COMPRESSED)
+        decompressFileToBlocks(handle);
+    withDataBlockSize(DataBlockSize, [&](auto BlockSize){
+        if (handle._INode.flags & INODE_INLINE)
+            moveInlineDataToBlocks<BlockSize>(handle);
+        writeFileData<BlockSize>(handle, offset, (const u_int8_t*)buffer, bytesNum);
+    });
+}
+
+void FileSystem::appendFile(FileHandle& handle, const void* buffer, size_t bytesNum){
+    writeFile(handle, handle._INode.fileSize_B, buffer, bytesNum);
+}
+
+void FileSystem::truncateFile(FileHandle& handle, u_int64_t fileSize_B){
+    if (fileSize_B == handle._INode.fileSize_B)
+        return;
+    if (handle._INode.flags & INODE_INLINE && fileSize_B <= INODE_INLINE_DATA_SIZE){
+        if (fileSize_B < handle._INode.fileSize_B)
+            std::memset(handle._INode.inlineData + fileSize_B, 0, handle._INode.fileSize_B - fileSize_B);
+        handle._INode.fileSize_B = fileSize_B;
+        handle.modified = true;
+        return;
+    }
+    std::unique_lock<std::shared_mutex> sharingLock(sharingMutex, std::defer_lock);
+    std::shared_lock<std::shared_mutex> snapshotLock(sharingMutex, std::defer_lock);
+    if (dedup)
+        sharingLock.lock();
+    else
+        snapshotLock.lock();
+    if (handle._INode.flags & INODE_COMPRESSED)
+        decompressFileToBlocks(handle);
+    withDataBlockSize(DataBlockSize, [&](auto BlockSize){
+        if (handle._INode.flags & INODE_INLINE)
+            moveInlineDataToBlocks<BlockSize>(handle);
+        truncateFileData<BlockSize>(handle, fileSize_B);
+    });
+}
+
+void FileSystem::closeFile(FileHandle& handle){
+    if (!handle.modified)
+        return;
+    std::lock_guard<std::mutex> metadataLock(metadataMutex);
+    std::vector<u_int32_t> oldExtentBlocksIndexes;
+    if (!(handle._INode.flags & INODE_INLINE)){
+        //ExtentBlocks are rewritten from scratch, number of extents may have changed,
+        //old ones are used by the committed INode until the new one is saved
+        oldExtentBlocksIndexes = loadExtentBlocksIndexes(handle._INode);
+        size_t neededExtentBlocksNum = extentBlocksNum(handle.extents.size());
+        std::vector<size_t> ExtentBlocksIndexes;
+        {
+            std::lock_guard<std::recursive_mutex> lock(allocationMutex);
+            if (freeDataBlocksNum() < neededExtentBlocksNum)
+                throw "Disk is full";
+            ExtentBlocksIndexes = allocateDataBlocks(neededExtentBlocksNum);
+        }
+        saveExtents(handle._INode, handle.extents, ExtentBlocksIndexes);
+    }
+    saveINode(handle._INode, handle.INodeIndex);
+    commitMetadata();
+    handle.modified = false;
+    //reused only once the new INode is committed, a crash in between leaks them at worst
+    if (oldExtentBlocksIndexes.empty() && handle.releasedDataBlocks.empty())
+        return;
+    for (u_int32_t i : oldExtentBlocksIndexes)
+        freeDataBlocks(i, 1);
+    for (const auto& run : handle.releasedDataBlocks)
+        releaseDataBlocks(run.first, run.second);
+    handle.releasedDataBlocks.clear();
+    commitMetadata();
+}
+
+u_int32_t FileSystem::fileBlocksNum(const FileHandle& handle) const{
+    if (handle.extents.empty())
+        return 0;
+    return handle.extents.back().fileBlock + handle.extents.back().length;
+}
+
+void FileSystem::resizeFileBlocks(FileHandle& handle, u_int32_t blocksNum){
+    u_int32_t currentBlocksNum = fileBlocksNum(handle);
+    if (blocksNum > currentBlocksNum)
+        appendFileBlocks(handle.extents, blocksNum - currentBlocksNum);
+    while (fileBlocksNum(handle) > blocksNum){
+        Extent& last = handle.extents.back();
+        u_int32_t excess = std::min(last.length, fileBlocksNum(handle) - blocksNum);
+        handle.releasedDataBlocks.push_back({last.startDataBlock + last.length - excess, excess});
+        last.length -= excess;
+        if (last.length == 0)
+            handle.extents.pop_back();
+    }
+    handle.modified = true;
+}
+
+template<u_int32_t BlockSize>
+void FileSystem::readFileData(FileHandle& handle, u_int64_t offset, u_int8_t* buffer, size_t bytesNum){
+    std::unique_ptr<DataBlock<BlockSize>> block(new DataBlock<BlockSize>());
+    size_t done = 0;
+    while (done < bytesNum){
+        u_int64_t position = offset + done;
+        u_int32_t fileBlock = position / BlockSize;
+        size_t blockOffset = position % BlockSize;
+        if (blockOffset == 0 && bytesNum - done >= BlockSize){
+            //whole blocks go straight to the caller buffer
+            size_t blocksNum = (bytesNum - done) / BlockSize;
+            readFileBlocks<BlockSize>(handle.extents, fileBlock, blocksNum, buffer + done);
+            done += blocksNum * BlockSize;
+            continue;
+        }
+        size_t chunk = std::min(bytesNum - done, BlockSize - blockOffset);
+        readFileBlocks<BlockSize>(handle.extents, fileBlock, 1, block->data);
+        std::memcpy(buffer + done, block->data + blockOffset, chunk);
+        done += chunk;
+    }
+}
+
+template<u_int32_t BlockSize>
+void FileSystem::writeFileData(FileHandle& handle, u_int64_t offset, const u_int8_t* buffer, size_t bytesNum){
+    u_int64_t end = offset + bytesNum;
+    std::unique_ptr<DataBlock<BlockSize>> block(new DataBlock<BlockSize>());
+    if (end > handle._INode.fileSize_B){
+        u_int64_t neededBlocksNum = (end + BlockSize - 1) / BlockSize;
+        if (neededBlocksNum > MAX_DATABLOCKS_NUM)
+            throw "file too big";
+        u_int32_t oldBlocksNum = fileBlocksNum(handle);
+        resizeFileBlocks(handle, neededBlocksNum);
+        //new blocks not fully covered by this write must read as zeros
+        for (u_int32_t b = oldBlocksNum; b < neededBlocksNum; b++){
+            u_int64_t blockStart = u_int64_t(b) * BlockSize;
+            if (blockStart < offset || blockStart + BlockSize > end)
+                writeFileBlocks<BlockSize>(handle.extents, b, 1, block->data);
+        }
+        handle._INode.fileSize_B = end;
+        handle.modified = true;
+    }
+    unshareFileBlocks<BlockSize>(handle, offset / BlockSize, (end - 1) / BlockSize - offset / BlockSize + 1);
+    size_t done = 0;
+    while (done < bytesNum){
+        u_int64_t position = offset + done;
+        u_int32_t fileBlock = position / BlockSize;
+        size_t blockOffset = position % BlockSize;
+        if (blockOffset == 0 && bytesNum - done >= BlockSize){
+            size_t blocksNum = (bytesNum - done) / BlockSize;
+            writeFileBlocks<BlockSize>(handle.extents, fileBlock, blocksNum, buffer + done);
+            done += blocksNum * BlockSize;
+            continue;
+        }
+        //partial block, read-modify-write
+        size_t chunk = std::min(bytesNum - done, BlockSize - blockOffset);
+        readFileBlocks<BlockSize>(handle.extents, fileBlock, 1, block->data);
+        std::memcpy(block->data + blockOffset, buffer + done, chunk);
+        writeFileBlocks<BlockSize>(handle.extents, fileBlock, 1, block->data);
+        done += chunk;
+    }
+}
+
+template<u_int32_t BlockSize>
+void FileSystem::truncateFileData(FileHandle& handle, u_int64_t fileSize_B){
+    std::unique_ptr<DataBlock<BlockSize>> block(new DataBlock<BlockSize>());
+    if (fileSize_B > handle._INode.fileSize_B){
+        //extending, write zeros at the end
+        u_int64_t position = handle._INode.fileSize_B;
+        while (position < fileSize_B){
+            size_t chunk = std::min(u_int64_t(BlockSize - position % BlockSize), fileSize_B - position);
+            writeFileData<BlockSize>(handle, position, block->data, chunk);
+            position += chunk;
+        }
+        return;
+    }
+    resizeFileBlocks(handle, (fileSize_B + BlockSize - 1) / BlockSize);
+    //tail of the new last block must read as zeros when the file grows again
+    if (fileSize_B % BlockSize){
+        u_int32_t lastBlock = fileSize_B / BlockSize;
+        unshareFileBlocks<BlockSize>(handle, lastBlock, 1);
+        readFileBlocks<BlockSize>(handle.extents, lastBlock, 1, block->data);
+        std::memset(block->data + fileSize_B % BlockSize, 0, BlockSize - fileSize_B % BlockSize);
+        writeFileBlocks<BlockSize>(handle.extents, lastBlock, 1, block->data);
+    }
+    handle._INode.fileSize_B = fileSize_B;
+    handle.modified = true;
+}
+
+template<u_int32_t BlockSize>
+void FileSystem::moveInlineDataToBlocks(FileHandle& handle){
+    std::unique_ptr<DataBlock<BlockSize>> block(new DataBlock<BlockSize>());
+    std::memcpy(block->data, handle._INode.inlineData, handle._INode.fileSize_B);
+    handle._INode.flags &= ~INODE_INLINE;
+    handle.extents.clear();
+    resizeFileBlocks(handle, (handle._INode.fileSize_B + BlockSize - 1) / BlockSize);
+    if (handle._INode.fileSize_B > 0)
+        writeFileBlocks<BlockSize>(handle.extents, 0, 1, block->data);
+    handle.modified = true;
+}
+
+template<u_int32_t BlockSize>
+void FileSystem::unshareFileBlocks(FileHandle& handle, u_int32_t firstFileBlock, size_t blocksNum){
+    loadDataBlocksTables();
+    std::unique_ptr<DataBlock<BlockSize>> block(new DataBlock<BlockSize>());
+    for (u_int32_t fileBlock = firstFileBlock; fileBlock < firstFileBlock + blocksNum; fileBlock++){
+        const Extent* e = findExtent(handle.extents, fileBlock);
+        if (!e)
+            throw "file block outside of extents";
+        u_int32_t DataBlockIndex = e->startDataBlock + (fileBlock - e->fileBlock);
+        u_int32_t copyIndex;
+        {
+            std::lock_guard<std::recursive_mutex> lock(allocationMutex);
+            if (DataBlocksRefCounts[DataBlockIndex] <= 1)
+                continue;
+            //file gets its own copy, other files keep the shared block
+            if (freeDataBlocksNum() == 0)
+                throw "Disk is full";
+            copyIndex = allocateFileExtents(1)[0].startDataBlock;
+        }
+        readDataBlocks(DataBlockIndex, block->data, 1);
+        writeDataBlocks(copyIndex, block->data, 1);
+        handle.releasedDataBlocks.push_back({DataBlockIndex, 1});
+        remapFileBlock(handle.extents, fileBlock, copyIndex);
+        handle.modified = true;
+    }
+}
+
+void FileSystem::remapFileBlock(std::vector<Extent>& extents, u_int32_t fileBlock, u_int32_t DataBlockIndex){
+    //extent holding fileBlock is split around it
+    const Extent* found = findExtent(extents, fileBlock);
+    if (!found)
+        throw "file block outside of extents";
+    Extent e = *found;
+    u_int32_t offset = fileBlock - e.fileBlock;
+    Extent parts[3] = {
+        {e.fileBlock, e.startDataBlock, offset},
+        {fileBlock, DataBlockIndex, 1},
+        {fileBlock + 1, e.startDataBlock + offset + 1, e.length - offset - 1}
+    };
+    auto position = extents.erase(extents.begin() + (found - extents.data()));
+    for (const auto& part : parts)
+        if (part.length > 0)
+            position = extents.insert(position, part) + 1;
+}
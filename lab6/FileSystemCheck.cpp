@@ -0,0 +1,343 @@
+#include "FileSystem.hpp"
+#include "CRC32C.hpp"
+#include <string>
+#include <iostream>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <algorithm>
+
+// Block checksums and fsck. Every DataBlock holding file data has its
+// CRC-32C in the checksums table, written with the DataBlock and committed
+// with metadata through the journal, so a DataBlock changed in place by a
+// write torn by a crash shows up as a mismatch. Reads of file data verify
+// it, a mismatch is reported as a corrupted disk.
+// checkDisk verifies INodes, extents, ExtentBlocks, snapshot tables,
+// Directory, bitmap and RefCounts against each other on the calling thread, then DataBlocks
+// referenced by files are read and checked against their checksums in
+// CHECK_WINDOW_SIZE runs shared by a pool of workers. ExtentBlocks go
+// through the journaled cache like other metadata and are only checked
+// structurally. Legacy disks have no checksums, their chains are walked.
+
+#define CHECKSUMS_CHUNK_SIZE 256 // checksums computed and transferred at once
+
+u_int64_t FileSystem::ChecksumAddr(u_int32_t DataBlockIndex) const{
+    return diskSuperBlockInfo.ChecksumsStartAddr + u_int64_t(DataBlockIndex) * sizeof(u_int32_t);
+}
+
+void FileSystem::writeDataBlocks(u_int32_t firstDataBlockIndex, const u_int8_t* buffer, size_t DataBlocksNum){
+    disk.writeDirect(DataBlockAddr(firstDataBlockIndex), buffer, DataBlocksNum * DataBlockSize);
+    //counted once written, so a commit that sees it syncs after the write
+    DataBlocksWrites.fetch_add(1, std::memory_order_release);
+    u_int32_t checksums[CHECKSUMS_CHUNK_SIZE];
+    for (size_t done = 0; done < DataBlocksNum; done += CHECKSUMS_CHUNK_SIZE){
+        size_t count = std::min(DataBlocksNum - done, size_t(CHECKSUMS_CHUNK_SIZE));
+        for (size_t i = 0; i < count; i++)
+            checksums[i] = crc32c(buffer + (done + i) * DataBlockSize, DataBlockSize);
+        disk.write(ChecksumAddr(firstDataBlockIndex + done), checksums, count * sizeof(u_int32_t));
+    }
+}
+
+void FileSystem::readDataBlocks(u_int32_t firstDataBlockIndex, u_int8_t* buffer, size_t DataBlocksNum){
+    disk.readDirect(DataBlockAddr(firstDataBlockIndex), buffer, DataBlocksNum * DataBlockSize);
+    verifyDataBlocks(firstDataBlockIndex, buffer, DataBlocksNum);
+}
+
+void FileSystem::readDataBlocksAll(const std::vector<std::pair<u_int32_t, u_int32_t>>& runs, u_int8_t* buffer){
+    std::vector<DirectRead> reads;
+    u_int8_t* runBuffer = buffer;
+    for (const auto& run : runs){
+        reads.push_back({DataBlockAddr(run.first), runBuffer, size_t(run.second) * DataBlockSize});
+        runBuffer += size_t(run.second) * DataBlockSize;
+    }
+    disk.readDirectAll(reads);
+    for (const auto& run : runs){
+        verifyDataBlocks(run.first, buffer, run.second);
+        buffer += size_t(run.second) * DataBlockSize;
+    }
+}
+
+void FileSystem::verifyDataBlocks(u_int32_t firstDataBlockIndex, const u_int8_t* data, size_t DataBlocksNum){
+    u_int32_t checksums[CHECKSUMS_CHUNK_SIZE];
+    for (size_t done = 0; done < DataBlocksNum; done += CHECKSUMS_CHUNK_SIZE){
+        size_t count = std::min(DataBlocksNum - done, size_t(CHECKSUMS_CHUNK_SIZE));
+        disk.read(ChecksumAddr(firstDataBlockIndex + done), checksums, count * sizeof(u_int32_t));
+        for (size_t i = 0; i < count; i++){
+            if (crc32c(data + (done + i) * DataBlockSize, DataBlockSize) != checksums[i]){
+                std::cerr<<"Error: Checksum mismatch in DataBlock "<<firstDataBlockIndex + done + i<<".\n";
+                throw "corrupted disk";
+            }
+        }
+    }
+}
+
+size_t FileSystem::checkDisk(size_t threadsNum){
+    loadDataBlocksTables();
+    if (legacy)
+        return checkLegacyDisk();
+    auto started = std::chrono::steady_clock::now();
+    //DataBlocks freed in a batch are still marked used, they would look leaked
+    bool batched = batch;
+    commitBatch();
+    size_t problemsNum = 0;
+    auto problem = [&problemsNum](const std::string& description){
+        std::cout<<"Problem: "<<description<<"\n";
+        problemsNum++;
+    };
+    std::lock_guard<std::mutex> metadataLock(metadataMutex);
+    std::shared_lock<std::shared_mutex> directoryLock(directoryMutex);
+    std::lock_guard<std::recursive_mutex> allocationLock(allocationMutex);
+
+    //INodes and their extents, references of every DataBlock are counted
+    std::vector<u_int32_t> references(DataBlocksNum, 0);
+    std::vector<u_int32_t> owners(DataBlocksNum, NO_INODE); // INode of the last reference, for reports
+    std::vector<bool> ExtentBlocks(DataBlocksNum, false);
+    size_t filesNum = 0;
+    //extents of a file or of a file in a snapshot, owned by INode i
+    auto countExtents = [&](const std::string& file, const INode& _INode, const std::vector<Extent>& extents, size_t i){
+        u_int64_t fileBlocksNum = 0;
+        bool continuous = true;
+        for (const auto& e : extents){
+            continuous = continuous && e.fileBlock == fileBlocksNum && e.length > 0;
+            fileBlocksNum += e.length;
+            for (u_int32_t b = 0; b < e.length; b++){
+                references[e.startDataBlock + b]++;
+                owners[e.startDataBlock + b] = i;
+            }
+        }
+        if (!continuous)
+            problem(file + " has extents that do not follow each other");
+        //compressed files hold a chunk table and stored chunks instead
+        if (!(_INode.flags & INODE_COMPRESSED) && fileBlocksNum != dataBlocksNum(_INode.fileSize_B))
+            problem(file + " has " + std::to_string(fileBlocksNum) + " DataBlocks for " + std::to_string(_INode.fileSize_B) + " B");
+    };
+    for (size_t i = INodesBitMap.findUsed(); i != BitMap::npos; i = INodesBitMap.findUsed(i + 1)){
+        INode _INode = loadINode(i);
+        bool snapshot = _INode.flags & INODE_SNAPSHOT;
+        filesNum += !snapshot;
+        std::string fileName = INodeFileName(_INode);
+        std::string file = (snapshot ? "Snapshot INode " : "INode ") + std::to_string(i) + " ('" + fileName + "')";
+        if (fileName.empty())
+            problem("INode " + std::to_string(i) + " has no file name");
+        else if (!snapshot && lookupFile(fileName) != i)
+            problem(file + " is not found through Directory");
+        if (_INode.flags & ~u_int32_t(INODE_INLINE | INODE_COMPRESSED | INODE_SNAPSHOT))
+            problem(file + " has unknown flags " + std::to_string(_INode.flags));
+        if (_INode.flags & INODE_INLINE){
+            if (_INode.fileSize_B > INODE_INLINE_DATA_SIZE)
+                problem(file + " is inline but bigger than INode");
+            continue;
+        }
+        std::vector<Extent> extents;
+        std::vector<u_int32_t> ExtentBlocksIndexes;
+        try{
+            extents = loadExtents(_INode);
+            ExtentBlocksIndexes = loadExtentBlocksIndexes(_INode);
+        }
+        catch (const char*){
+            problem(file + " has invalid extents");
+            continue;
+        }
+        if (ExtentBlocksIndexes.size() != extentBlocksNum(_INode.extentsNum))
+            problem(file + " has " + std::to_string(ExtentBlocksIndexes.size()) + " ExtentBlocks for " + std::to_string(_INode.extentsNum) + " extents");
+        for (u_int32_t index : ExtentBlocksIndexes){
+            if (index >= DataBlocksNum){
+                problem(file + " has ExtentBlock outside of DataBlocks section");
+                continue;
+            }
+            references[index]++;
+            owners[index] = i;
+            ExtentBlocks[index] = true;
+        }
+        countExtents(file, _INode, extents, i);
+        if (!snapshot)
+            continue;
+        //DataBlocks of files in the snapshot are referenced by it
+        SnapshotHeader header;
+        std::vector<SnapshotFile> snapshotFiles;
+        try{
+            snapshotFiles = loadSnapshot(_INode, header);
+        }
+        catch (const char*){
+            problem(file + " has invalid snapshot table");
+            continue;
+        }
+        for (const auto& f : snapshotFiles){
+            std::string snapshotFile = file + " file '" + INodeFileName(f._INode) + "'";
+            if (f._INode.flags & ~u_int32_t(INODE_INLINE | INODE_COMPRESSED))
+                problem(snapshotFile + " has unknown flags " + std::to_string(f._INode.flags));
+            if (f._INode.flags & INODE_INLINE){
+                if (f._INode.fileSize_B > INODE_INLINE_DATA_SIZE)
+                    problem(snapshotFile + " is inline but bigger than INode");
+                continue;
+            }
+            countExtents(snapshotFile, f._INode, f.extents, i);
+        }
+    }
+
+    //Directory, every entry points at a used INode with its name, at most once
+    std::vector<bool> listed(INodesNum, false);
+    for (u_int32_t slot = 0; slot < DirectorySlotsNum; slot++){
+        DirectoryEntry entry = loadDirectoryEntry(slot);
+        if (entry.INodeNumber == 0)
+            continue;
+        size_t INodeIndex = entry.INodeNumber - 1;
+        std::string where = "Directory slot " + std::to_string(slot);
+        if (INodeIndex >= INodesNum || !INodesBitMap[INodeIndex]){
+            problem(where + " points at unused INode " + std::to_string(INodeIndex));
+            continue;
+        }
+        if (listed[INodeIndex])
+            problem(where + " lists INode " + std::to_string(INodeIndex) + " again");
+        listed[INodeIndex] = true;
+        if (loadINode(INodeIndex).flags & INODE_SNAPSHOT)
+            problem(where + " lists snapshot INode " + std::to_string(INodeIndex));
+        if (entry.nameHash != directoryHash(INodeFileName(loadINode(INodeIndex))))
+            problem(where + " has wrong name hash for INode " + std::to_string(INodeIndex));
+    }
+
+    //bitmap and RefCounts against the references
+    size_t leakedNum = 0;
+    size_t firstLeaked = NO_DATABLOCK;
+    for (u_int32_t b = 0; b < DataBlocksNum; b++){
+        std::string block = "DataBlock " + std::to_string(b);
+        if (references[b] > 0 && !DataBlocksBitMap[b])
+            problem(block + " of INode " + std::to_string(owners[b]) + " is marked free");
+        if (references[b] == 0 && DataBlocksBitMap[b]){
+            if (leakedNum++ == 0)
+                firstLeaked = b;
+        }
+        if (references[b] > 1 && ExtentBlocks[b])
+            problem(block + " is used " + std::to_string(references[b]) + " times, last by INode " + std::to_string(owners[b]));
+        //ExtentBlocks hold no file data and have no RefCount
+        if (DataBlocksRefCounts[b] != (ExtentBlocks[b] ? 0 : references[b]))
+            problem(block + " has RefCount " + std::to_string(DataBlocksRefCounts[b]) + " but " + std::to_string(references[b]) + " references");
+    }
+    if (leakedNum > 0)
+        problem(std::to_string(leakedNum) + " DataBlocks are marked used but belong to no file, first is " + std::to_string(firstLeaked));
+
+    //runs of referenced file data DataBlocks, split into windows verified by the workers
+    const u_int32_t windowBlocks = std::max(u_int32_t(CHECK_WINDOW_SIZE / DataBlockSize), u_int32_t(1));
+    std::vector<std::pair<u_int32_t, u_int32_t>> runs; // {first, number}
+    for (u_int32_t b = 0; b < DataBlocksNum; b++){
+        if (references[b] == 0 || ExtentBlocks[b])
+            continue;
+        if (!runs.empty() && runs.back().first + runs.back().second == b && runs.back().second < windowBlocks)
+            runs.back().second++;
+        else
+            runs.push_back({b, 1});
+    }
+    threadsNum = std::max(size_t(1), std::min(threadsNum, runs.size()));
+    std::atomic<size_t> nextRun{0};
+    std::atomic<u_int64_t> checkedNum{0};
+    std::mutex resultsMutex;
+    std::vector<u_int32_t> mismatched;
+    const char* failed = nullptr;
+    auto worker = [&](){
+        BytesVector window(size_t(windowBlocks) * DataBlockSize);
+        std::vector<u_int32_t> checksums(windowBlocks);
+        try{
+            for (size_t r = nextRun++; r < runs.size(); r = nextRun++){
+                u_int32_t first = runs[r].first, count = runs[r].second;
+                disk.readDirect(DataBlockAddr(first), window.data(), size_t(count) * DataBlockSize);
+                disk.read(ChecksumAddr(first), checksums.data(), count * sizeof(u_int32_t));
+                for (u_int32_t i = 0; i < count; i++){
+                    if (crc32c(window.data() + size_t(i) * DataBlockSize, DataBlockSize) != checksums[i]){
+                        std::lock_guard<std::mutex> lock(resultsMutex);
+                        mismatched.push_back(first + i);
+                    }
+                }
+                checkedNum += count;
+            }
+        }
+        catch (const char* error){
+            std::lock_guard<std::mutex> lock(resultsMutex);
+            failed = error;
+            nextRun = runs.size();
+        }
+    };
+    auto checksumsStarted = std::chrono::steady_clock::now();
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < threadsNum; t++)
+        workers.emplace_back(worker);
+    for (auto& w : workers)
+        w.join();
+    if (failed)
+        throw failed;
+    double checksumsSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - checksumsStarted).count();
+    std::sort(mismatched.begin(), mismatched.end());
+    for (u_int32_t b : mismatched)
+        problem("Checksum mismatch in DataBlock " + std::to_string(b) + " of INode " + std::to_string(owners[b]));
+    batch = batched;
+
+    double checkedMB = checkedNum * double(DataBlockSize) / 1048576.0;
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    std::cout<<"Checked "<<filesNum<<" files, "<<checkedNum<<" DataBlocks ("<<checkedMB<<" MB) in "<<seconds<<" s\n";
+    std::cout<<"Checksums: "<<(checksumsSeconds > 0 ? checkedMB / checksumsSeconds : 0)<<" MB/s on "<<threadsNum<<" threads, CRC-32C in ";
+    std::cout<<(crc32cHardware() ? "hardware" : "software")<<"\n";
+    if (problemsNum == 0)
+        std::cout<<"No problems found.\n";
+    else
+        std::cout<<"Found "<<problemsNum<<" problems.\n";
+    return problemsNum;
+}
+
+size_t FileSystem::checkLegacyDisk(){
+    size_t problemsNum = 0;
+    auto problem = [&problemsNum](const std::string& description){
+        std::cout<<"Problem: "<<description<<"\n";
+        problemsNum++;
+    };
+    //every DataBlock belongs to one chain, chains end where the file size says
+    std::vector<u_int32_t> owners(DataBlocksNum, NO_INODE);
+    size_t filesNum = 0;
+    u_int64_t checkedNum = 0;
+    LegacyReadahead readahead;
+    LegacyDataBlock buffer;
+    for (size_t i = INodesBitMap.findUsed(); i != BitMap::npos; i = INodesBitMap.findUsed(i + 1)){
+        filesNum++;
+        LegacyINode _INode;
+        disk.read(i*sizeof(LegacyINode) + diskSuperBlockInfo.INodesSectionStartAddr, &_INode, sizeof(LegacyINode));
+        std::string file = "INode " + std::to_string(i) + " ('" + std::string(_INode.fileName, strnlen(_INode.fileName, MAX_FILENAME_SIZE)) + "')";
+        u_int64_t chainLength = 0;
+        u_int32_t DataBlockAddr = _INode.firstDataBlockAddr;
+        while (DataBlockAddr != 0){
+            u_int64_t offset = u_int64_t(DataBlockAddr) - diskSuperBlockInfo.DataBlocksSectionStartAddr;
+            if (DataBlockAddr < diskSuperBlockInfo.DataBlocksSectionStartAddr || offset % sizeof(LegacyDataBlock) != 0 || offset / sizeof(LegacyDataBlock) >= DataBlocksNum){
+                problem(file + " chain leaves DataBlocks section at address " + std::to_string(DataBlockAddr));
+                break;
+            }
+            u_int32_t index = offset / sizeof(LegacyDataBlock);
+            if (owners[index] == i){
+                problem(file + " chain loops at DataBlock " + std::to_string(index));
+                break;
+            }
+            if (owners[index] != NO_INODE){
+                problem(file + " chain runs into DataBlock " + std::to_string(index) + " of INode " + std::to_string(owners[index]));
+                break;
+            }
+            owners[index] = i;
+            if (!DataBlocksBitMap[index])
+                problem(file + " uses DataBlock " + std::to_string(index) + " marked free");
+            chainLength++;
+            DataBlockAddr = loadLegacyDataBlock(DataBlockAddr, buffer, &readahead).nextDataBlockAddr;
+        }
+        u_int64_t expectedLength = (u_int64_t(_INode.fileSize_B) + DATABLOCK_DATA_SIZE - 1) / DATABLOCK_DATA_SIZE;
+        if (chainLength != expectedLength)
+            problem(file + " has " + std::to_string(chainLength) + " DataBlocks in chain for " + std::to_string(_INode.fileSize_B) + " B");
+        checkedNum += chainLength;
+    }
+    size_t leakedNum = 0;
+    for (u_int32_t b = 0; b < DataBlocksNum; b++)
+        leakedNum += DataBlocksBitMap[b] && owners[b] == NO_INODE;
+    if (leakedNum > 0)
+        problem(std::to_string(leakedNum) + " DataBlocks are marked used but belong to no file");
+    std::cout<<"Checked "<<filesNum<<" files, "<<checkedNum<<" DataBlocks in chains (legacy disk has no checksums)\n";
+    if (problemsNum == 0)
+        std::cout<<"No problems found.\n";
+    else
+        std::cout<<"Found "<<problemsNum<<" problems.\n";
+    return problemsNum;
+}
@@ -0,0 +1,255 @@
+#include "FileSystem.hpp"
+#include "LZCodec.hpp"
+#include <string>
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <future>
+
+// Compressed files: contents are split into chunks of compressionChunkSize()
+// bytes, every chunk is compressed on its own with LZCodec and packed into
+// as few DataBlocks as it needs, so reading any part of the file needs only
+// the chunk table and one chunk. Chunks that would not save a DataBlock are
+// stored raw, a file with no chunk compressed is left a plain file.
+// Compressed files are written once, random access writes first turn them
+// back into plain files.
+
+void FileSystem::setCompression(bool compression){
+    this->compression = compression;
+}
+
+u_int32_t FileSystem::compressionChunkSize() const{
+    return std::max(u_int32_t(COMPRESSION_CHUNK_SIZE), DataBlockSize * COMPRESSION_CHUNK_MIN_BLOCKS);
+}
+
+bool FileSystem::storeCompressedFile(std::istream& file, u_int64_t fileSize_B, std::vector<Extent>& extents, const std::function<void(const u_int8_t*, size_t)>& onRead){
+    return withDataBlockSize(DataBlockSize, [&](auto BlockSize){
+        return storeCompressedFile<BlockSize>(file, fileSize_B, extents, onRead);
+    });
+}
+
+template<u_int32_t BlockSize>
+bool FileSystem::storeCompressedFile(std::istream& file, u_int64_t fileSize_B, std::vector<Extent>& extents, const std::function<void(const u_int8_t*, size_t)>& onRead){
+    //next chunk is read from the file while current one is compressed and written, DataBlocks are
+    //appended to extents as chunks are stored, returns false when the file is stored plain
+    const u_int32_t chunkSize = compressionChunkSize();
+    const u_int64_t chunksNum = (fileSize_B + chunkSize - 1) / chunkSize;
+    const size_t tableBlocksNum = (chunksNum * sizeof(u_int32_t) + BlockSize - 1) / BlockSize;
+    std::vector<u_int32_t> table;
+    bool compressedAny = false;
+    BytesVector windows[2];
+    windows[0].resize(chunkSize);
+    windows[1].resize(chunkSize);
+    BytesVector compressed(chunkSize);
+    auto chunkBytesNum = [&](u_int64_t chunk){
+        return size_t(std::min(u_int64_t(chunkSize), fileSize_B - chunk * chunkSize));
+    };
+    auto readChunk = [&](BytesVector& window, u_int64_t chunk){
+        std::memset(window.data(), 0, window.size());
+        file.read((char*)window.data(), chunkBytesNum(chunk));
+        return size_t(file.gcount());
+    };
+    u_int32_t fileBlock = 0;
+    size_t current = 0;
+    std::future<size_t> pendingRead;
+    if (chunksNum > 0)
+        pendingRead = std::async(std::launch::async, readChunk, std::ref(windows[current]), 0);
+    for (u_int64_t chunk = 0; chunk < chunksNum; chunk++){
+        size_t readNum = pendingRead.get();
+        if (chunk + 1 < chunksNum)
+            pendingRead = std::async(std::launch::async, readChunk, std::ref(windows[current ^ 1]), chunk + 1);
+        const u_int8_t* data = windows[current].data();
+        if (onRead)
+            onRead(data, readNum);
+        size_t chunkBytes = chunkBytesNum(chunk);
+        size_t rawBlocksNum = (chunkBytes + BlockSize - 1) / BlockSize;
+        //stored raw when compressed chunk would not be at least one DataBlock smaller
+        size_t storedSize = rawBlocksNum > 1 ? lzCompress(data, chunkBytes, compressed.data(), (rawBlocksNum - 1) * BlockSize) : 0;
+        size_t storedBlocksNum = (storedSize + BlockSize - 1) / BlockSize;
+        if (storedSize > 0){
+            std::memset(compressed.data() + storedSize, 0, storedBlocksNum * BlockSize - storedSize);
+            data = compressed.data();
+            compressedAny = true;
+        }
+        else{
+            storedSize = chunkBytes;
+            storedBlocksNum = rawBlocksNum;
+        }
+        {
+            std::lock_guard<std::recursive_mutex> lock(allocationMutex);
+            appendFileBlocks(extents, storedBlocksNum);
+        }
+        writeFileBlocks<BlockSize>(extents, fileBlock, storedBlocksNum, data);
+        fileBlock += storedBlocksNum;
+        table.push_back(storedSize);
+        current ^= 1;
+    }
+    //raw chunks back to back are the plain file
+    if (!compressedAny)
+        return false;
+    {
+        std::lock_guard<std::recursive_mutex> lock(allocationMutex);
+        appendFileBlocks(extents, tableBlocksNum);
+    }
+    BytesVector tableBlocks(tableBlocksNum * BlockSize, 0);
+    std::memcpy(tableBlocks.data(), table.data(), table.size() * sizeof(u_int32_t));
+    writeFileBlocks<BlockSize>(extents, fileBlock, tableBlocksNum, tableBlocks.data());
+    return true;
+}
+
+std::vector<CompressedChunk> FileSystem::loadChunks(const std::vector<Extent>& extents, u_int64_t fileSize_B){
+    const u_int32_t chunkSize = compressionChunkSize();
+    const u_int64_t chunksNum = (fileSize_B + chunkSize - 1) / chunkSize;
+    const size_t tableBlocksNum = dataBlocksNum(chunksNum * sizeof(u_int32_t));
+    u_int64_t storedBlocksNum = extents.empty() ? 0 : extents.back().fileBlock + extents.back().length;
+    if (storedBlocksNum < tableBlocksNum){
+        std::cerr<<"Error: Compressed file has no chunk table.\n";
+        throw "corrupted disk";
+    }
+    BytesVector table(tableBlocksNum * DataBlockSize);
+    withDataBlockSize(DataBlockSize, [&](auto BlockSize){
+        readFileBlocks<BlockSize>(extents, storedBlocksNum - tableBlocksNum, tableBlocksNum, table.data());
+    });
+    std::vector<CompressedChunk> chunks(chunksNum);
+    u_int64_t fileBlock = 0;
+    for (u_int64_t i = 0; i < chunksNum; i++){
+        std::memcpy(&chunks[i].storedSize, table.data() + i * sizeof(u_int32_t), sizeof(u_int32_t));
+        if (chunks[i].storedSize == 0 || chunks[i].storedSize > std::min(u_int64_t(chunkSize), fileSize_B - i * chunkSize)){
+            std::cerr<<"Error: Invalid chunk size in chunk table.\n";
+            throw "corrupted disk";
+        }
+        chunks[i].firstFileBlock = fileBlock;
+        fileBlock += dataBlocksNum(chunks[i].storedSize);
+    }
+    if (fileBlock + tableBlocksNum != storedBlocksNum){
+        std::cerr<<"Error: Chunk table does not match DataBlocks of the file.\n";
+        throw "corrupted disk";
+    }
+    return chunks;
+}
+
+template<u_int32_t BlockSize>
+void FileSystem::loadChunk(const std::vector<Extent>& extents, const CompressedChunk& chunk, u_int32_t chunkBytes, u_int8_t* buffer, u_int8_t* storedBuffer){
+    //buffers hold at least compressionChunkSize() bytes
+    size_t storedBlocksNum = (chunk.storedSize + BlockSize - 1) / BlockSize;
+    if (chunk.storedSize == chunkBytes){
+        readFileBlocks<BlockSize>(extents, chunk.firstFileBlock, storedBlocksNum, buffer);
+        return;
+    }
+    readFileBlocks<BlockSize>(extents, chunk.firstFileBlock, storedBlocksNum, storedBuffer);
+    if (!lzDecompress(storedBuffer, chunk.storedSize, buffer, chunkBytes)){
+        std::cerr<<"Error: Compressed chunk is damaged.\n";
+        throw "corrupted disk";
+    }
+}
+
+void FileSystem::getCompressedFile(std::ostream& file, const std::vector<Extent>& extents, u_int64_t fileSize_B){
+    withDataBlockSize(DataBlockSize, [&](auto BlockSize){
+        getCompressedFile<BlockSize>(file, extents, fileSize_B);
+    });
+}
+
+template<u_int32_t BlockSize>
+void FileSystem::getCompressedFile(std::ostream& file, const std::vector<Extent>& extents, u_int64_t fileSize_B){
+    //previous chunk is written to the file while next one is read and decompressed
+    const u_int32_t chunkSize = compressionChunkSize();
+    std::vector<CompressedChunk> chunks = loadChunks(extents, fileSize_B);
+    BytesVector buffers[2];
+    buffers[0].resize(chunkSize);
+    buffers[1].resize(chunkSize);
+    BytesVector stored(chunkSize);
+    auto writeChunk = [&file](const u_int8_t* data, size_t bytes){
+        file.write((const char*)data, bytes);
+    };
+    size_t current = 0;
+    std::future<void> pendingWrite;
+    for (size_t i = 0; i < chunks.size(); i++){
+        u_int32_t chunkBytes = std::min(u_int64_t(chunkSize), fileSize_B - i * chunkSize);
+        loadChunk<BlockSize>(extents, chunks[i], chunkBytes, buffers[current].data(), stored.data());
+        if (pendingWrite.valid())
+            pendingWrite.get();
+        pendingWrite = std::async(std::launch::async, writeChunk, buffers[current].data(), chunkBytes);
+        current ^= 1;
+    }
+    if (pendingWrite.valid())
+        pendingWrite.get();
+}
+
+void FileSystem::readCompressedChunks(const std::vector<Extent>& extents, u_int64_t fileSize_B, const std::function<void(const u_int8_t*, size_t)>& onChunk){
+    //every chunk decompressed in file order
+    const u_int32_t chunkSize = compressionChunkSize();
+    std::vector<CompressedChunk> chunks = loadChunks(extents, fileSize_B);
+    BytesVector chunkData(chunkSize);
+    BytesVector stored(chunkSize);
+    for (size_t i = 0; i < chunks.size(); i++){
+        u_int32_t chunkBytes = std::min(u_int64_t(chunkSize), fileSize_B - u_int64_t(i) * chunkSize);
+        withDataBlockSize(DataBlockSize, [&](auto BlockSize){
+            loadChunk<BlockSize>(extents, chunks[i], chunkBytes, chunkData.data(), stored.data());
+        });
+        onChunk(chunkData.data(), chunkBytes);
+    }
+}
+
+void FileSystem::readCompressedFile(FileHandle& handle, u_int64_t offset, u_int8_t* buffer, size_t bytesNum){
+    //whole chunks are decompressed, the last one is kept in handle for following reads
+    const u_int32_t chunkSize = compressionChunkSize();
+    BytesVector stored;
+    size_t done = 0;
+    while (done < bytesNum){
+        u_int64_t position = offset + done;
+        size_t chunkIndex = position / chunkSize;
+        if (chunkIndex >= handle.chunks.size())
+            throw "read outside of chunks";
+        if (handle.chunkData.empty() || handle.chunkDataIndex != chunkIndex){
+            handle.chunkData.clear();
+            BytesVector chunkData(chunkSize);
+            stored.resize(chunkSize);
+            u_int32_t chunkBytes = std::min(u_int64_t(chunkSize), handle._INode.fileSize_B - u_int64_t(chunkIndex) * chunkSize);
+            withDataBlockSize(DataBlockSize, [&](auto BlockSize){
+                loadChunk<BlockSize>(handle.extents, handle.chunks[chunkIndex], chunkBytes, chunkData.data(), stored.data());
+            });
+            handle.chunkData.swap(chunkData);
+            handle.chunkDataIndex = chunkIndex;
+        }
+        size_t chunkOffset = position % chunkSize;
+        size_t chunk = std::min(bytesNum - done, size_t(chunkSize - chunkOffset));
+        std::memcpy(buffer + done, handle.chunkData.data() + chunkOffset, chunk);
+        done += chunk;
+    }
+}
+
+void FileSystem::decompressFileToBlocks(FileHandle& handle){
+    withDataBlockSize(DataBlockSize, [&](auto BlockSize){
+        decompressFileToBlocks<BlockSize>(handle);
+    });
+}
+
+template<u_int32_t BlockSize>
+void FileSystem::decompressFileToBlocks(FileHandle& handle){
+    //file is written again uncompressed, its compressed DataBlocks are released by closeFile
+    const u_int32_t chunkSize = compressionChunkSize();
+    std::vector<Extent> extents;
+    BytesVector chunkData(chunkSize);
+    BytesVector stored(chunkSize);
+    try{
+        appendFileBlocks(extents, (handle._INode.fileSize_B + BlockSize - 1) / BlockSize);
+        for (size_t i = 0; i < handle.chunks.size(); i++){
+            u_int32_t chunkBytes = std::min(u_int64_t(chunkSize), handle._INode.fileSize_B - u_int64_t(i) * chunkSize);
+            std::memset(chunkData.data(), 0, chunkSize);
+            loadChunk<BlockSize>(handle.extents, handle.chunks[i], chunkBytes, chunkData.data(), stored.data());
+            writeFileBlocks<BlockSize>(extents, i * (chunkSize / BlockSize), (chunkBytes + BlockSize - 1) / BlockSize, chunkData.data());
+        }
+    }
+    catch (const char*){
+        for (const auto& e : extents)
+            releaseDataBlocks(e.startDataBlock, e.length);
+        throw;
+    }
+    for (const auto& e : handle.extents)
+        handle.releasedDataBlocks.push_back({e.startDataBlock, e.length});
+    handle.extents = extents;
+    handle._INode.flags &= ~INODE_COMPRESSED;
+    handle.chunks.clear();
+    handle.chunkData.clear();
+    handle.modified = true;
+}
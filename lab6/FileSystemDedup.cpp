@@ -0,0 +1,174 @@
+#include "FileSystem.hpp"
+#include <string>
+#include <iostream>
+#include <vector>
+#include <memory>
+#include <algorithm>
+
+// Block deduplication on FS_DEDUP disks: every DataBlock of an added file
+// is fingerprinted and looked up in the on-disk fingerprint index, a block
+// with equal contents (compared byte by byte, fingerprints only select the
+// candidate) is referenced instead of writing a new one. RefCounts keep the
+// number of files using each block, a block is freed with its last
+// reference. The index is lossy, entries of freed or overwritten blocks
+// stay until their slot is reused and are rejected by the verify step.
+
+namespace{
+inline u_int64_t rotateLeft(u_int64_t x, int bits){
+    return (x << bits) | (x >> (64 - bits));
+}
+
+template<u_int32_t BlockSize>
+u_int64_t blockFingerprint(const u_int8_t* data){
+    //xxHash64 style, four independent multiply-rotate lanes over 8-byte words, then avalanche
+    const u_int64_t prime1 = 0x9E3779B185EBCA87ull;
+    const u_int64_t prime2 = 0xC2B2AE3D27D4EB4Full;
+    u_int64_t lanes[4] = {prime1 + prime2, prime2, 0, 0 - prime1};
+    for (size_t i = 0; i < BlockSize; i += 32){
+        for (int l = 0; l < 4; l++){
+            u_int64_t word;
+            std::memcpy(&word, data + i + 8 * l, sizeof(word));
+            lanes[l] = rotateLeft(lanes[l] + word * prime2, 31) * prime1;
+        }
+    }
+    u_int64_t hash = rotateLeft(lanes[0], 1) + rotateLeft(lanes[1], 7) + rotateLeft(lanes[2], 12) + rotateLeft(lanes[3], 18);
+    hash ^= hash >> 33;
+    hash *= prime2;
+    hash ^= hash >> 29;
+    hash *= 0x165667B19E3779F9ull;
+    hash ^= hash >> 32;
+    return hash;
+}
+}
+
+u_int64_t FileSystem::FingerprintEntryAddr(u_int32_t slot) const{
+    return diskSuperBlockInfo.FingerprintIndexStartAddr + u_int64_t(slot) * sizeof(FingerprintEntry);
+}
+
+FingerprintEntry FileSystem::loadFingerprintEntry(u_int32_t slot){
+    FingerprintEntry entry;
+    disk.read(FingerprintEntryAddr(slot), &entry, sizeof(FingerprintEntry));
+    return entry;
+}
+
+void FileSystem::saveFingerprintEntry(const FingerprintEntry& entry, u_int32_t slot){
+    disk.write(FingerprintEntryAddr(slot), &entry, sizeof(FingerprintEntry));
+}
+
+template<u_int32_t BlockSize>
+u_int32_t FileSystem::findDuplicateBlock(u_int64_t fingerprint, const u_int8_t* data, u_int8_t* buffer){
+    //linear probing from the home slot, slots are never emptied so the first empty one ends the search
+    u_int32_t slot = fingerprint % FingerprintSlotsNum;
+    for (u_int32_t probes = 0; probes < FINGERPRINT_PROBES_NUM; probes++){
+        FingerprintEntry entry = loadFingerprintEntry(slot);
+        if (entry.DataBlockNumber == 0)
+            return NO_DATABLOCK;
+        u_int32_t DataBlockIndex = entry.DataBlockNumber - 1;
+        if (entry.fingerprint == fingerprint && DataBlockIndex < DataBlocksNum && DataBlocksRefCounts[DataBlockIndex] > 0 && DataBlocksRefCounts[DataBlockIndex] < MAX_REFCOUNT){
+            //verify step, different contents may share a fingerprint and blocks rewritten in place keep their old one
+            disk.readDirect(DataBlockAddr<BlockSize>(DataBlockIndex), buffer, BlockSize);
+            if (std::memcmp(buffer, data, BlockSize) == 0)
+                return DataBlockIndex;
+        }
+        slot = (slot + 1) % FingerprintSlotsNum;
+    }
+    return NO_DATABLOCK;
+}
+
+void FileSystem::addFingerprint(u_int64_t fingerprint, u_int32_t DataBlockIndex){
+    //first empty or stale slot, the home slot is overwritten when all probed slots are in use
+    u_int32_t slot = fingerprint % FingerprintSlotsNum;
+    u_int32_t target = slot;
+    for (u_int32_t probes = 0; probes < FINGERPRINT_PROBES_NUM; probes++){
+        FingerprintEntry entry = loadFingerprintEntry(slot);
+        if (entry.DataBlockNumber == 0 || entry.fingerprint == fingerprint || entry.DataBlockNumber > DataBlocksNum || DataBlocksRefCounts[entry.DataBlockNumber - 1] == 0){
+            target = slot;
+            break;
+        }
+        slot = (slot + 1) % FingerprintSlotsNum;
+    }
+    saveFingerprintEntry({fingerprint, DataBlockIndex + 1, 0}, target);
+}
+
+size_t FileSystem::dedupFileBlocks(std::vector<Extent>& extents, const u_int8_t* buffer, size_t blocksNum){
+    loadDataBlocksTables();
+    return withDataBlockSize(DataBlockSize, [&](auto BlockSize){
+        return dedupFileBlocks<BlockSize>(extents, buffer, blocksNum);
+    });
+}
+
+template<u_int32_t BlockSize>
+size_t FileSystem::dedupFileBlocks(std::vector<Extent>& extents, const u_int8_t* buffer, size_t blocksNum){
+    //appends blocksNum blocks of buffer to the end of the file, returns how many of them are shared
+    std::shared_lock<std::shared_mutex> sharingLock(sharingMutex);
+    std::vector<u_int64_t> fingerprints(blocksNum);
+    for (size_t i = 0; i < blocksNum; i++)
+        fingerprints[i] = blockFingerprint<BlockSize>(buffer + i * BlockSize);
+    std::unique_ptr<DataBlock<BlockSize>> block(new DataBlock<BlockSize>());
+    std::vector<u_int32_t> DataBlockIndexes(blocksNum, NO_DATABLOCK);
+    std::vector<size_t> sources(blocksNum, blocksNum); // first equal block of this window not stored on disk yet
+    std::vector<size_t> newBlocks;
+    size_t sharedNum = 0;
+    {
+        std::lock_guard<std::recursive_mutex> lock(allocationMutex);
+        for (size_t i = 0; i < blocksNum; i++){
+            const u_int8_t* data = buffer + i * BlockSize;
+            DataBlockIndexes[i] = findDuplicateBlock<BlockSize>(fingerprints[i], data, block->data);
+            if (DataBlockIndexes[i] != NO_DATABLOCK)
+                continue;
+            sources[i] = i;
+            for (size_t j : newBlocks){
+                if (fingerprints[j] == fingerprints[i] && std::memcmp(buffer + j * BlockSize, data, BlockSize) == 0){
+                    sources[i] = j;
+                    break;
+                }
+            }
+            if (sources[i] == i)
+                newBlocks.push_back(i);
+        }
+        if (freeDataBlocksNum() < newBlocks.size())
+            throw "Disk is full";
+        size_t next = 0;
+        for (const auto& e : allocateFileExtents(newBlocks.size()))
+            for (u_int32_t b = 0; b < e.length; b++)
+                DataBlockIndexes[newBlocks[next++]] = e.startDataBlock + b;
+        u_int32_t fileBlock = extents.empty() ? 0 : extents.back().fileBlock + extents.back().length;
+        for (size_t i = 0; i < blocksNum; i++, fileBlock++){
+            if (sources[i] != i){
+                if (sources[i] < blocksNum)
+                    DataBlockIndexes[i] = DataBlockIndexes[sources[i]];
+                DataBlocksRefCounts.acquire(DataBlockIndexes[i]);
+                sharedNum++;
+            }
+            Extent* last = extents.empty() ? nullptr : &extents.back();
+            if (last && last->startDataBlock + last->length == DataBlockIndexes[i])
+                last->length++;
+            else
+                extents.push_back({fileBlock, DataBlockIndexes[i], 1});
+        }
+    }
+    //new contents are written in runs of consecutive DataBlocks, then indexed
+    for (size_t first = 0; first < newBlocks.size();){
+        size_t runBlocks = 1;
+        while (first + runBlocks < newBlocks.size() && newBlocks[first + runBlocks] == newBlocks[first] + runBlocks
+               && DataBlockIndexes[newBlocks[first + runBlocks]] == DataBlockIndexes[newBlocks[first]] + runBlocks)
+            runBlocks++;
+        writeDataBlocks(DataBlockIndexes[newBlocks[first]], buffer + newBlocks[first] * BlockSize, runBlocks);
+        first += runBlocks;
+    }
+    std::lock_guard<std::recursive_mutex> lock(allocationMutex);
+    for (size_t i : newBlocks)
+        addFingerprint(fingerprints[i], DataBlockIndexes[i]);
+    STAT_ADD(DataBlocksShared, sharedNum);
+    return sharedNum;
+}
+
+void FileSystem::indexDataBlocks(const u_int8_t* buffer, u_int32_t firstDataBlock, size_t blocksNum){
+    //blocks moved to a new place keep being found by files added later
+    loadDataBlocksTables();
+    withDataBlockSize(DataBlockSize, [&](auto BlockSize){
+        std::lock_guard<std::recursive_mutex> lock(allocationMutex);
+        for (size_t i = 0; i < blocksNum; i++)
+            addFingerprint(blockFingerprint<BlockSize>(buffer + i * BlockSize), firstDataBlock + i);
+    });
+}
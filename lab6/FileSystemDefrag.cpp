@@ -0,0 +1,210 @@
+#include "FileSystem.hpp"
+#include <string>
+#include <iostream>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <chrono>
+
+// Defragmentation: fragmented files are moved into the lowest free run
+// holding them whole, then free space is compacted from the start of the
+// DataBlocks section: the lowest hole takes the file right after it when
+// that one fits, otherwise the highest file fitting into it, and when none
+// fits the file after it is moved out of the way above itself (the hole
+// grows by its size). Holes followed by DataBlocks that cannot move are
+// left behind. Fragmented files that did not fit anywhere are tried again
+// on the compacted disk.
+// Every move is done on its own: contents are copied into newly allocated
+// DataBlocks in DEFRAG_WINDOW_SIZE windows and made durable, then the INode
+// is switched to them and the old DataBlocks are freed in one metadata
+// commit. A crash leaves each file at its old or its new place, defrag
+// stopped by its budget continues from where it is when run again.
+// ExtentBlocks and DataBlocks shared by dedup or snapshots stay in place.
+
+namespace{
+struct PlacedFile{ // contiguous file defrag may move
+    size_t INodeIndex=NO_INODE;
+    u_int32_t length=0;
+};
+}
+
+Extent FileSystem::allocateLowestExtent(u_int32_t DataBlocksNum, u_int32_t from, u_int32_t limit){
+    std::lock_guard<std::recursive_mutex> lock(allocationMutex);
+    loadDataBlocksTables();
+    ExtentAllocator::Run run = DataBlocksAllocator.allocateLowest(DataBlocksNum, from, limit);
+    for (u_int32_t i = 0; i < run.length; i++){
+        DataBlocksBitMap.set(run.start + i);
+        DataBlocksRefCounts.acquire(run.start + i);
+    }
+    STAT_ADD(DataBlocksAllocated, run.length);
+    return {0, run.start, run.length};
+}
+
+bool FileSystem::moveFile(size_t INodeIndex, const Extent& target, BytesVector& window){
+    std::lock_guard<std::mutex> metadataLock(metadataMutex);
+    std::unique_lock<std::shared_mutex> sharingLock(sharingMutex);
+    INode _INode;
+    std::vector<Extent> extents;
+    if (INodeInUse(INodeIndex)){
+        _INode = loadINode(INodeIndex);
+        extents = loadExtents(_INode);
+    }
+    bool movable = !extents.empty() && extents.back().fileBlock + extents.back().length == target.length;
+    if (movable){
+        std::lock_guard<std::recursive_mutex> lock(allocationMutex);
+        for (const auto& e : extents)
+            for (u_int32_t i = 0; i < e.length; i++)
+                movable = movable && DataBlocksRefCounts[e.startDataBlock + i] == 1;
+    }
+    if (!movable){
+        releaseDataBlocks(target.startDataBlock, target.length);
+        return false;
+    }
+    try{
+        const u_int32_t windowBlocks = window.size() / DataBlockSize;
+        for (const auto& e : extents){
+            for (u_int32_t done = 0; done < e.length; done += windowBlocks){
+                u_int32_t count = std::min(windowBlocks, e.length - done);
+                u_int32_t destination = target.startDataBlock + e.fileBlock + done;
+                readDataBlocks(e.startDataBlock + done, window.data(), count);
+                writeDataBlocks(destination, window.data(), count);
+                if (dedup)
+                    indexDataBlocks(window.data(), destination, count);
+            }
+        }
+    }
+    catch (const char*){
+        releaseDataBlocks(target.startDataBlock, target.length);
+        throw;
+    }
+    for (u_int32_t i : loadExtentBlocksIndexes(_INode))
+        freeDataBlocks(i, 1);
+    for (const auto& e : extents)
+        releaseDataBlocks(e.startDataBlock, e.length);
+    saveExtents(_INode, {target}, {});
+    saveINode(_INode, INodeIndex);
+    commitMetadata();
+    return true;
+}
+
+size_t FileSystem::defrag(double maxSeconds, u_int64_t maxBytes){
+    if (legacy){
+        std::cerr<<"Error: Legacy disk format is read only.\n";
+        return 0;
+    }
+    auto started = std::chrono::steady_clock::now();
+    loadDataBlocksTables();
+    auto elapsedSeconds = [&](){
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    };
+    //every move is committed on its own, old DataBlocks must be reusable by the next one
+    bool batched = batch;
+    commitBatch();
+    DiskUsage before = diskUsage();
+
+    std::map<u_int32_t, PlacedFile> placed; // by first DataBlock
+    std::vector<PlacedFile> fragmented;
+    {
+        std::lock_guard<std::recursive_mutex> lock(allocationMutex);
+        for (size_t i = INodesBitMap.findUsed(); i != BitMap::npos; i = INodesBitMap.findUsed(i + 1)){
+            INode _INode = loadINode(i);
+            std::vector<Extent> extents = loadExtents(_INode);
+            if (extents.empty())
+                continue;
+            bool shared = false;
+            for (const auto& e : extents)
+                for (u_int32_t b = 0; b < e.length && !shared; b++)
+                    shared = DataBlocksRefCounts[e.startDataBlock + b] > 1;
+            if (shared)
+                continue;
+            PlacedFile file = {i, extents.back().fileBlock + extents.back().length};
+            if (extents.size() > 1)
+                fragmented.push_back(file);
+            else
+                placed[extents[0].startDataBlock] = file;
+        }
+    }
+
+    BytesVector window(std::max(u_int32_t(DEFRAG_WINDOW_SIZE), DataBlockSize));
+    u_int64_t movedBytes = 0;
+    size_t movesNum = 0;
+    bool finished = true;
+    auto budgetLeft = [&](){
+        finished = (maxSeconds <= 0 || elapsedSeconds() < maxSeconds) && (maxBytes == 0 || movedBytes < maxBytes);
+        return finished;
+    };
+    //file goes to the lowest free run starting in [from, limit) holding it, NO_DATABLOCK if there is none
+    auto move = [&](const PlacedFile& file, u_int32_t from, u_int32_t limit){
+        Extent target = allocateLowestExtent(file.length, from, limit);
+        if (target.length == 0 || !moveFile(file.INodeIndex, target, window))
+            return u_int32_t(NO_DATABLOCK);
+        movedBytes += u_int64_t(file.length) * DataBlockSize;
+        movesNum++;
+        return target.startDataBlock;
+    };
+    auto moveFragmented = [&](){
+        std::vector<PlacedFile> left;
+        for (const auto& file : fragmented){
+            u_int32_t start = budgetLeft() ? move(file, 0, DataBlocksNum) : NO_DATABLOCK;
+            if (start != NO_DATABLOCK)
+                placed[start] = file;
+            else
+                left.push_back(file);
+        }
+        fragmented.swap(left);
+    };
+
+    moveFragmented();
+    size_t cursor = 0; // holes below are followed by DataBlocks that cannot move
+    while (budgetLeft()){
+        size_t hole = DataBlocksBitMap.findFree(cursor);
+        size_t holeEnd = hole == BitMap::npos ? BitMap::npos : DataBlocksBitMap.findUsed(hole);
+        if (holeEnd == BitMap::npos)
+            break; // free space is all at the end
+        u_int32_t holeLength = holeEnd - hole;
+        auto next = placed.find(holeEnd);
+        if (next != placed.end() && next->second.length <= holeLength){
+            PlacedFile file = next->second;
+            u_int32_t start = move(file, hole, hole + 1);
+            if (start != NO_DATABLOCK){
+                placed.erase(next);
+                placed[start] = file;
+                continue;
+            }
+        }
+        //highest file fitting into the hole
+        auto filler = placed.rbegin();
+        while (filler != placed.rend() && filler->first > holeEnd && filler->second.length > holeLength)
+            filler++;
+        if (filler != placed.rend() && filler->first > holeEnd){
+            PlacedFile file = filler->second;
+            u_int32_t start = move(file, hole, hole + 1);
+            if (start != NO_DATABLOCK){
+                placed.erase(std::next(filler).base());
+                placed[start] = file;
+                continue;
+            }
+        }
+        //file after the hole is moved above itself, its place joins the hole
+        if (next != placed.end() && next->second.length > holeLength){
+            PlacedFile file = next->second;
+            u_int32_t start = move(file, holeEnd + file.length, DataBlocksNum);
+            if (start != NO_DATABLOCK){
+                placed.erase(next);
+                placed[start] = file;
+                continue;
+            }
+        }
+        cursor = holeEnd;
+    }
+    moveFragmented();
+
+    batch = batched;
+    DiskUsage after = diskUsage();
+    std::cout<<"Moved "<<movesNum<<" files ("<<movedBytes / 1048576.0<<" MB) in "<<elapsedSeconds()<<" s\n";
+    std::cout<<"Fragmented files: "<<before.fragmentedFilesNum<<" -> "<<after.fragmentedFilesNum;
+    std::cout<<", free runs: "<<before.freeRunsNum<<" -> "<<after.freeRunsNum<<"\n";
+    if (!finished)
+        std::cout<<"Budget used up, run defrag again to continue.\n";
+    return movesNum;
+}
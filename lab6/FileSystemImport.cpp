@@ -0,0 +1,231 @@
+#include "FileSystem.hpp"
+#include "FNV1a.hpp"
+#include <string>
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <set>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+
+// Bulk import: sources are read and checksummed on a pool of workers,
+// each worker reserves INode and DataBlocks for a whole file in one short
+// critical section and writes its DataBlocks straight to their (disjoint)
+// place on disk. With verification on the worker reads them back and
+// compares their checksum, a round trip through the OS page cache that
+// catches bugs in the write path, not media errors. INodes, ExtentBlocks,
+// Directory and bitmaps are saved once at the end by the calling thread.
+// On dedup disks DataBlocks are allocated window by window for contents
+// not found on disk, for compressed files chunk by chunk, ExtentBlocks
+// once the file is stored.
+
+namespace{
+struct ImportedFile{
+    std::string fileName;
+    u_int64_t fileSize_B=0;
+    size_t INodeIndex=NO_INODE;
+    std::vector<Extent> extents;
+    std::vector<size_t> ExtentBlocksIndexes;
+    BytesVector inlineData; // contents of files small enough to be kept in INode
+    u_int64_t checksum=0;
+    size_t sharedNum=0; // DataBlocks shared with other files
+    bool compressed=false;
+    bool imported=false;
+    std::string error;
+};
+
+}
+
+void FileSystem::setImportVerification(bool verification){
+    importVerification = verification;
+}
+
+size_t FileSystem::addFiles(const std::vector<std::string>& fileNames, size_t threadsNum){
+    if (legacy){
+        std::cerr<<"Error: Legacy disk format is read only.\n";
+        return 0;
+    }
+    std::vector<ImportedFile> files(fileNames.size());
+    std::set<std::string> batchNames;
+    for (size_t i = 0; i < fileNames.size(); i++){
+        files[i].fileName = fileNames[i];
+        if (fileNames[i].size() > MAX_FILENAME_SIZE)
+            files[i].error = "File Name is too long";
+        else if (findFile(fileNames[i]) != NO_INODE || !batchNames.insert(fileNames[i]).second)
+            files[i].error = "File with this name already exists on disk";
+    }
+
+    auto release = [this](ImportedFile& f){
+        std::lock_guard<std::recursive_mutex> lock(allocationMutex);
+        for (const auto& e : f.extents)
+            releaseDataBlocks(e.startDataBlock, e.length);
+        for (size_t i : f.ExtentBlocksIndexes)
+            freeDataBlocks(i, 1);
+        if (f.INodeIndex != NO_INODE)
+            markINode(f.INodeIndex, false);
+        f.extents.clear();
+        f.ExtentBlocksIndexes.clear();
+        f.INodeIndex = NO_INODE;
+    };
+    auto reserve = [this](ImportedFile& f, u_int64_t DataBlocksNum){
+        std::lock_guard<std::recursive_mutex> lock(allocationMutex);
+        if (freeINodesNum() == 0 || freeDataBlocksNum() < DataBlocksNum)
+            return false;
+        f.extents = allocateFileExtents(DataBlocksNum);
+        size_t neededExtentBlocksNum = extentBlocksNum(f.extents.size());
+        if (freeDataBlocksNum() >= neededExtentBlocksNum){
+            f.ExtentBlocksIndexes = allocateDataBlocks(neededExtentBlocksNum);
+            f.INodeIndex = getFreeINodeIndex();
+            markINode(f.INodeIndex, true);
+            return true;
+        }
+        for (const auto& e : f.extents)
+            releaseDataBlocks(e.startDataBlock, e.length);
+        f.extents.clear();
+        return false;
+    };
+    auto importFile = [&](ImportedFile& f, BytesVector& window){
+        std::ifstream file(f.fileName, std::ios::binary | std::ios::in);
+        if (!file){
+            f.error = "Unable to get file";
+            return;
+        }
+        file.seekg(0, std::ios::end);
+        f.fileSize_B = u_int64_t(file.tellg());
+        file.seekg(0, std::ios::beg);
+        bool inlined = f.fileSize_B <= INODE_INLINE_DATA_SIZE;
+        bool compressing = compression && !inlined;
+        u_int64_t neededDataBlocksNum = inlined ? 0 : dataBlocksNum(f.fileSize_B);
+        bool allocatedWhileStoring = dedup || compressing;
+        if (!reserve(f, allocatedWhileStoring ? 0 : neededDataBlocksNum)){
+            f.error = "Disk is full";
+            return;
+        }
+        u_int64_t checksum = FNV1A_64_SEED;
+        u_int64_t bytesRead = 0;
+        if (inlined){
+            f.inlineData.resize(f.fileSize_B);
+            file.read((char*)f.inlineData.data(), f.fileSize_B);
+            bytesRead = file.gcount();
+            checksum = fnv1a64(f.inlineData.data(), bytesRead, checksum);
+        }
+        if (compressing){
+            f.compressed = storeCompressedFile(file, f.fileSize_B, f.extents, [&](const u_int8_t* data, size_t bytesNum){
+                checksum = fnv1a64(data, bytesNum, checksum);
+                bytesRead += bytesNum;
+            });
+        }
+        else{
+            withDataBlockSize(DataBlockSize, [&](auto BlockSize){
+                const u_int64_t windowBlocks = window.size() / BlockSize;
+                for (u_int64_t first = 0; first < neededDataBlocksNum; first += windowBlocks){
+                    size_t count = std::min(windowBlocks, neededDataBlocksNum - first);
+                    std::memset(window.data(), 0, count * BlockSize);
+                    file.read((char*)window.data(), count * BlockSize);
+                    checksum = fnv1a64(window.data(), file.gcount(), checksum);
+                    bytesRead += file.gcount();
+                    if (dedup)
+                        f.sharedNum += dedupFileBlocks(f.extents, window.data(), count);
+                    else
+                        writeFileBlocks<BlockSize>(f.extents, first, count, window.data());
+                }
+            });
+        }
+        if (bytesRead != f.fileSize_B){
+            release(f);
+            f.error = "File changed while reading";
+            return;
+        }
+        if (allocatedWhileStoring){
+            std::lock_guard<std::recursive_mutex> lock(allocationMutex);
+            size_t neededExtentBlocksNum = extentBlocksNum(f.extents.size());
+            if (freeDataBlocksNum() < neededExtentBlocksNum)
+                throw "Disk is full";
+            f.ExtentBlocksIndexes = allocateDataBlocks(neededExtentBlocksNum);
+        }
+        if (importVerification && !inlined && storedChecksum(f.extents, f.fileSize_B, f.compressed, window) != checksum){
+            release(f);
+            f.error = "Stored contents do not match the source";
+            return;
+        }
+        f.checksum = checksum;
+        f.imported = true;
+    };
+
+    std::atomic<size_t> nextFile{0};
+    auto worker = [&](){
+        BytesVector window(std::max(u_int32_t(STREAM_WINDOW_SIZE), DataBlockSize));
+        for (size_t i = nextFile++; i < files.size(); i = nextFile++){
+            if (!files[i].error.empty())
+                continue;
+            try{
+                importFile(files[i], window);
+            }
+            catch (const char* error){
+                release(files[i]);
+                files[i].error = error;
+            }
+        }
+    };
+    threadsNum = std::max(size_t(1), std::min(threadsNum, files.size()));
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < threadsNum; i++)
+        workers.emplace_back(worker);
+    for (auto& w : workers)
+        w.join();
+
+    //commit metadata of all imported files at once
+    size_t importedNum = 0;
+    std::lock_guard<std::mutex> metadataLock(metadataMutex);
+    std::unique_lock<std::shared_mutex> directoryLock(directoryMutex);
+    for (auto& f : files){
+        if (!f.imported){
+            std::cerr<<"Error: "<<f.fileName<<": "<<f.error<<"\n";
+            continue;
+        }
+        INode _INode;
+        _INode.fileSize_B = f.fileSize_B;
+        std::strncpy(_INode.fileName, f.fileName.c_str(), f.fileName.size());
+        if (f.fileSize_B <= INODE_INLINE_DATA_SIZE)
+            saveInlineData(_INode, f.inlineData.data(), f.inlineData.size());
+        else
+            saveExtents(_INode, f.extents, f.ExtentBlocksIndexes);
+        if (f.compressed)
+            _INode.flags |= INODE_COMPRESSED;
+        saveINode(_INode, f.INodeIndex);
+        addDirectoryEntry(f.fileName, f.INodeIndex);
+        std::cout<<"Imported "<<f.fileName<<" [INode "<<f.INodeIndex<<", "<<f.fileSize_B<<" B, checksum "<<std::hex<<f.checksum<<std::dec;
+        if (f.compressed)
+            std::cout<<", compressed";
+        else if (dedup)
+            std::cout<<", "<<f.sharedNum<<" shared DataBlocks";
+        std::cout<<"]\n";
+        importedNum++;
+    }
+    directoryLock.unlock();
+    commitMetadata();
+    std::cout<<"Imported "<<importedNum<<" of "<<files.size()<<" files.\n";
+    return importedNum;
+}
+
+u_int64_t FileSystem::storedChecksum(const std::vector<Extent>& extents, u_int64_t fileSize_B, bool compressed, BytesVector& window){
+    //DataBlocks read back are also verified against their CRCs
+    u_int64_t checksum = FNV1A_64_SEED;
+    if (compressed){
+        readCompressedChunks(extents, fileSize_B, [&](const u_int8_t* data, size_t bytesNum){
+            checksum = fnv1a64(data, bytesNum, checksum);
+        });
+        return checksum;
+    }
+    withDataBlockSize(DataBlockSize, [&](auto BlockSize){
+        const u_int64_t windowBlocks = window.size() / BlockSize;
+        const u_int64_t blocksNum = (fileSize_B + BlockSize - 1) / BlockSize;
+        for (u_int64_t first = 0; first < blocksNum; first += windowBlocks){
+            size_t count = std::min(windowBlocks, blocksNum - first);
+            readFileBlocks<BlockSize>(extents, first, count, window.data());
+            checksum = fnv1a64(window.data(), std::min(u_int64_t(count) * BlockSize, fileSize_B - first * BlockSize), checksum);
+        }
+    });
+    return checksum;
+}
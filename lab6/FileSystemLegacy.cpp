@@ -0,0 +1,159 @@
+#include "FileSystem.hpp"
+#include <string>
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <algorithm>
+#include <future>
+
+// Version 1 disks: 12B SuperBlock, no alignment, DataBlocks of a file
+// linked through nextDataBlockAddr. Only reading is supported.
+
+void FileSystem::loadLegacyDiskInfo(){
+    legacy = true;
+    LegacySuperBlock _LegacySuperBlock;
+    disk.read(0, &_LegacySuperBlock, sizeof(LegacySuperBlock));
+    u_int32_t size_B = _LegacySuperBlock.diskSize * 1048576;
+    INodesNum = INODES_NUM;
+    DirectorySlotsNum = 0;
+    INodesBitMapBytesSize = (INODES_NUM + 7) / 8;
+    INodesSectionBytesSize = INODES_NUM * sizeof(LegacyINode);
+    DataBlocksNum = (8 * (size_B - (sizeof(LegacySuperBlock) + INodesBitMapBytesSize + INodesSectionBytesSize)) - 7) / (sizeof(LegacyDataBlock) * 8 + 1);
+    DataBlocksBitMapBytesSize = (DataBlocksNum + 7) / 8;
+    if ((sizeof(LegacySuperBlock) + INodesBitMapBytesSize + DataBlocksBitMapBytesSize) != _LegacySuperBlock.INodesSectionStartAddr)
+        throw "invalid INodes Section Start Address";
+    if ((sizeof(LegacySuperBlock) + INodesBitMapBytesSize + DataBlocksBitMapBytesSize + INodesSectionBytesSize) != _LegacySuperBlock.DataBlocksSectionStartAddr)
+        throw "invalid DataBlocks Section Start Address";
+    diskSuperBlockInfo = SuperBlock();
+    diskSuperBlockInfo.version = 1;
+    diskSuperBlockInfo.diskSize = _LegacySuperBlock.diskSize;
+    diskSuperBlockInfo.INodesNum = INODES_NUM;
+    diskSuperBlockInfo.DataBlocksNum = DataBlocksNum;
+    diskSuperBlockInfo.INodesBitMapStartAddr = sizeof(LegacySuperBlock);
+    diskSuperBlockInfo.DataBlocksBitMapStartAddr = sizeof(LegacySuperBlock) + INodesBitMapBytesSize;
+    diskSuperBlockInfo.INodesSectionStartAddr = _LegacySuperBlock.INodesSectionStartAddr;
+    diskSuperBlockInfo.DataBlocksSectionStartAddr = _LegacySuperBlock.DataBlocksSectionStartAddr;
+    DataBlockSize = sizeof(LegacyDataBlock);
+    dedup = false;
+    std::cout<<"\tLoaded Disk Info\n----------------------------------\nDisk Name: "<<diskName;
+    std::cout<<"\nFormat Version: 1 (legacy, read only)";
+    std::cout<<"\nDisk Size [MB]: "<<diskSuperBlockInfo.diskSize << "\nINodes Section Addres: "<< diskSuperBlockInfo.INodesSectionStartAddr;
+    std::cout<<"\nDataBlocks Section Address: "<<diskSuperBlockInfo.DataBlocksSectionStartAddr<< "\n----------------------------------\n";
+}
+
+void FileSystem::listLegacyFiles(std::ostream& out){
+    for(size_t i=0; i <INodesBitMap.size(); i++){
+        if (!INodesBitMap[i])
+            continue;
+        LegacyINode _INode;
+        disk.read(i*sizeof(LegacyINode) + diskSuperBlockInfo.INodesSectionStartAddr, &_INode, sizeof(LegacyINode));
+        out<<"\nFile INode Index: "<<i<<"\n----------------------------------\n";
+        out<<"Name: "<<_INode.fileName<<"\nSize [B]: "<<_INode.fileSize_B<<"\nFirst DataBlock Address: "<<_INode.firstDataBlockAddr;
+        out<<"\n----------------------------------\n";
+    }
+}
+
+void FileSystem::getLegacyFile(size_t fileINodeIndex, const std::string& targetFileName){
+    if (fileINodeIndex >= INodesBitMap.size() || !INodesBitMap[fileINodeIndex]){
+        std::cerr<<"Error: File with this Index does not exist on disk.\n";
+        return;
+    }
+    LegacyINode _INode;
+    disk.read(fileINodeIndex * sizeof(LegacyINode) + diskSuperBlockInfo.INodesSectionStartAddr, &_INode, sizeof(LegacyINode));
+    //save to outputfile
+    std::ofstream file;
+    if (targetFileName.empty())
+         file.open(_INode.fileName, std::ios::binary | std::ios::out);
+    else
+        file.open(targetFileName, std::ios::binary | std::ios::out);
+    //walk the chain window by window, previous window is written to the file while next one is read from disk
+    //on mapped disk window points straight into the mapping, otherwise DataBlocks come from readahead
+    const size_t windowBlocks = STREAM_WINDOW_SIZE / sizeof(LegacyDataBlock);
+    std::vector<LegacyDataBlock> buffers[2];
+    buffers[0].resize(windowBlocks);
+    buffers[1].resize(windowBlocks);
+    std::vector<const LegacyDataBlock*> windows[2];
+    auto writeWindow = [&file](const std::vector<const LegacyDataBlock*>& window, u_int32_t windowBytes){
+        for (const LegacyDataBlock* db : window){
+            u_int32_t bytes = std::min(windowBytes, u_int32_t(DATABLOCK_DATA_SIZE));
+            file.write((char*)db->data, bytes);
+            windowBytes -= bytes;
+        }
+    };
+    size_t current = 0;
+    std::future<void> pendingWrite;
+    LegacyReadahead readahead;
+    u_int32_t bytesToWrite = _INode.fileSize_B;
+    u_int32_t nextDataBlockAddr = _INode.firstDataBlockAddr;
+    while (nextDataBlockAddr != 0){
+        std::vector<const LegacyDataBlock*>& window = windows[current];
+        window.clear();
+        u_int32_t windowBytes = 0;
+        while (nextDataBlockAddr != 0 && window.size() < windowBlocks){
+            if (!(bytesToWrite > 0)){
+                std::cerr<<"Error: File size smaller than DataBlocks saved info.\n";
+                throw "corrupted disk";
+            }
+            const LegacyDataBlock& db = loadLegacyDataBlock(nextDataBlockAddr, buffers[current][window.size()], &readahead);
+            u_int32_t bytes = std::min(bytesToWrite, u_int32_t(DATABLOCK_DATA_SIZE));
+            bytesToWrite -= bytes;
+            windowBytes += bytes;
+            nextDataBlockAddr = db.nextDataBlockAddr;
+            STAT_ADD(ChainHops, 1);
+            window.push_back(&db);
+        }
+        if (pendingWrite.valid())
+            pendingWrite.get();
+        pendingWrite = std::async(std::launch::async, writeWindow, std::cref(window), windowBytes);
+        current ^= 1;
+    }
+    if (pendingWrite.valid())
+        pendingWrite.get();
+    file.close();
+}
+
+size_t FileSystem::findLegacyFile(const std::string& fileName){
+    //no directory on legacy disks, scan INodes table
+    for(size_t i = INodesBitMap.findUsed(); i != BitMap::npos; i = INodesBitMap.findUsed(i + 1)){
+        LegacyINode _INode;
+        disk.read(i*sizeof(LegacyINode) + diskSuperBlockInfo.INodesSectionStartAddr, &_INode, sizeof(LegacyINode));
+        if (std::string(_INode.fileName, strnlen(_INode.fileName, MAX_FILENAME_SIZE)) == fileName)
+            return i;
+    }
+    return NO_INODE;
+}
+
+const LegacyDataBlock& FileSystem::loadLegacyDataBlock(u_int32_t DataBlockAddr, LegacyDataBlock& buffer, LegacyReadahead* readahead){
+    //corrupted nextDataBlockAddr must not send the chain outside of DataBlocks section
+    u_int64_t offset = u_int64_t(DataBlockAddr) - diskSuperBlockInfo.DataBlocksSectionStartAddr;
+    if (DataBlockAddr < diskSuperBlockInfo.DataBlocksSectionStartAddr || offset % sizeof(LegacyDataBlock) != 0 || offset / sizeof(LegacyDataBlock) >= DataBlocksNum){
+        std::cerr<<"Error: Invalid DataBlock address in chain.\n";
+        throw "corrupted disk";
+    }
+    if (const LegacyDataBlock* view = disk.view<LegacyDataBlock>(DataBlockAddr))
+        return *view;
+    if (!readahead){
+        disk.read(DataBlockAddr, &buffer, sizeof(LegacyDataBlock));
+        return buffer;
+    }
+    //chains of files written at once are mostly consecutive DataBlocks, the next address is known only
+    //after a block is read, so a run after it is read together with it, growing while the chain follows it
+    //and starting small again where the chain jumps; blocks are copied out, the run is reused on the next miss
+    u_int64_t readaheadEnd = readahead->firstDataBlockAddr + u_int64_t(readahead->blocksNum) * sizeof(LegacyDataBlock);
+    if (DataBlockAddr >= readahead->firstDataBlockAddr && DataBlockAddr < readaheadEnd){
+        STAT_ADD(ReadaheadHits, 1);
+        buffer = readahead->blocks[(DataBlockAddr - readahead->firstDataBlockAddr) / sizeof(LegacyDataBlock)];
+        return buffer;
+    }
+    if (readahead->blocksNum > 0 && DataBlockAddr == readaheadEnd)
+        readahead->nextBlocksNum = std::min(readahead->nextBlocksNum * 2, u_int32_t(LEGACY_READAHEAD_MAX_BLOCKS));
+    else
+        readahead->nextBlocksNum = LEGACY_READAHEAD_MIN_BLOCKS;
+    readahead->blocksNum = std::min(readahead->nextBlocksNum, u_int32_t(DataBlocksNum - offset / sizeof(LegacyDataBlock)));
+    readahead->firstDataBlockAddr = DataBlockAddr;
+    readahead->blocks.resize(std::max(readahead->blocks.size(), size_t(readahead->blocksNum)));
+    //legacy disks are read only, nothing in the cache is newer than the disk file
+    disk.readDirect(DataBlockAddr, readahead->blocks.data(), readahead->blocksNum * sizeof(LegacyDataBlock));
+    buffer = readahead->blocks[0];
+    return buffer;
+}
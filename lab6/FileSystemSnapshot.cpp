@@ -0,0 +1,279 @@
+#include "FileSystem.hpp"
+#include <string>
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <ctime>
+
+// Snapshots: files as they were at some moment, kept on the disk while the
+// files change. A snapshot is an INode flagged INODE_SNAPSHOT, named after
+// the snapshot and kept out of Directory, its DataBlocks hold the snapshot
+// table with INodes and extents of all files. Taking a snapshot copies only
+// this metadata and adds a reference to every DataBlock of the files, no
+// file data is copied. Files copy DataBlocks referenced more than once
+// before changing them (the same copy on write dedup uses), deleting or
+// truncating a file only drops its references, so the snapshot keeps the
+// old contents. Deleting a snapshot drops its references, DataBlocks no
+// file or other snapshot uses are freed.
+
+namespace{
+void invalidSnapshot(){
+    std::cerr<<"Error: Invalid snapshot table.\n";
+    throw "corrupted disk";
+}
+}
+
+size_t FileSystem::findSnapshot(const std::string& snapshotName){
+    std::lock_guard<std::recursive_mutex> lock(allocationMutex);
+    for (size_t i = INodesBitMap.findUsed(); i != BitMap::npos; i = INodesBitMap.findUsed(i + 1)){
+        INode buffer;
+        const INode& _INode = loadINode(i, buffer);
+        if (_INode.flags & INODE_SNAPSHOT && INodeFileName(_INode) == snapshotName)
+            return i;
+    }
+    return NO_INODE;
+}
+
+std::vector<SnapshotFile> FileSystem::loadSnapshot(const INode& _INode, SnapshotHeader& header){
+    std::vector<Extent> extents = loadExtents(_INode);
+    size_t blocksNum = dataBlocksNum(_INode.fileSize_B);
+    if (_INode.fileSize_B < sizeof(SnapshotHeader) || extents.empty() || extents.back().fileBlock + extents.back().length != blocksNum)
+        invalidSnapshot();
+    BytesVector table(blocksNum * DataBlockSize);
+    withDataBlockSize(DataBlockSize, [&](auto BlockSize){
+        readFileBlocks<BlockSize>(extents, 0, blocksNum, table.data());
+    });
+    std::memcpy(&header, table.data(), sizeof(SnapshotHeader));
+    if (header.magic != SNAPSHOT_MAGIC)
+        invalidSnapshot();
+    std::vector<SnapshotFile> files;
+    u_int64_t offset = sizeof(SnapshotHeader);
+    for (u_int32_t f = 0; f < header.filesNum; f++){
+        SnapshotFile file;
+        if (offset + sizeof(INode) > _INode.fileSize_B)
+            invalidSnapshot();
+        std::memcpy(&file._INode, table.data() + offset, sizeof(INode));
+        offset += sizeof(INode);
+        if (!(file._INode.flags & INODE_INLINE)){
+            u_int64_t extentsNum = file._INode.extentsNum;
+            u_int64_t restNum = extentsNum > INODE_EXTENTS_NUM ? extentsNum - INODE_EXTENTS_NUM : 0;
+            if (offset + restNum * sizeof(Extent) > _INode.fileSize_B)
+                invalidSnapshot();
+            file.extents.assign(file._INode.extents, file._INode.extents + (extentsNum - restNum));
+            file.extents.resize(extentsNum);
+            if (restNum > 0)
+                std::memcpy(file.extents.data() + INODE_EXTENTS_NUM, table.data() + offset, restNum * sizeof(Extent));
+            offset += restNum * sizeof(Extent);
+            for (const auto& e : file.extents)
+                if (u_int64_t(e.startDataBlock) + e.length > DataBlocksNum)
+                    invalidSnapshot();
+        }
+        files.push_back(std::move(file));
+    }
+    return files;
+}
+
+bool FileSystem::createSnapshot(const std::string& snapshotName){
+    if (legacy){
+        std::cerr<<"Error: Legacy disk format is read only.\n";
+        return false;
+    }
+    if (snapshotName.empty() || snapshotName.size() > MAX_FILENAME_SIZE || snapshotName.find('/') != std::string::npos){
+        std::cerr<<"Error: Snapshot name must have 1 to "<<MAX_FILENAME_SIZE<<" characters and no '/'.\n";
+        return false;
+    }
+    loadDataBlocksTables();
+    //files do not change while their metadata is copied, in place writes wait for the new references
+    std::lock_guard<std::mutex> metadataLock(metadataMutex);
+    std::unique_lock<std::shared_mutex> sharingLock(sharingMutex);
+    if (findSnapshot(snapshotName) != NO_INODE){
+        std::cerr<<"Error: Snapshot with this name already exists on disk.\n";
+        return false;
+    }
+    std::vector<size_t> used;
+    {
+        std::lock_guard<std::recursive_mutex> lock(allocationMutex);
+        for (size_t i = INodesBitMap.findUsed(); i != BitMap::npos; i = INodesBitMap.findUsed(i + 1))
+            used.push_back(i);
+    }
+    SnapshotHeader header;
+    header.createdTime = std::time(nullptr);
+    BytesVector table(sizeof(SnapshotHeader));
+    std::vector<Extent> shared; // DataBlocks of all files
+    for (size_t i : used){
+        INode _INode = loadINode(i);
+        if (_INode.flags & INODE_SNAPSHOT)
+            continue;
+        std::vector<Extent> extents = loadExtents(_INode);
+        //extents past the INode follow it in the table instead of ExtentBlocks
+        _INode.extentBlockIndex = NO_DATABLOCK;
+        size_t restNum = extents.size() > INODE_EXTENTS_NUM ? extents.size() - INODE_EXTENTS_NUM : 0;
+        size_t offset = table.size();
+        table.resize(offset + sizeof(INode) + restNum * sizeof(Extent));
+        std::memcpy(table.data() + offset, &_INode, sizeof(INode));
+        if (restNum > 0)
+            std::memcpy(table.data() + offset + sizeof(INode), extents.data() + INODE_EXTENTS_NUM, restNum * sizeof(Extent));
+        shared.insert(shared.end(), extents.begin(), extents.end());
+        header.filesNum++;
+        header.filesBytesSize += _INode.fileSize_B;
+    }
+    std::memcpy(table.data(), &header, sizeof(SnapshotHeader));
+    INode _INode;
+    _INode.fileSize_B = table.size();
+    _INode.flags = INODE_SNAPSHOT;
+    std::strncpy(_INode.fileName, snapshotName.c_str(), snapshotName.size());
+    size_t neededDataBlocksNum = dataBlocksNum(table.size());
+    table.resize(neededDataBlocksNum * DataBlockSize);
+
+    std::vector<Extent> extents;
+    std::vector<size_t> ExtentBlocksIndexes;
+    size_t INodeIndex = NO_INODE;
+    u_int64_t sharedNum = 0;
+    {
+        std::lock_guard<std::recursive_mutex> lock(allocationMutex);
+        for (const auto& e : shared)
+            sharedNum += e.length;
+        if (freeINodesNum() == 0 || freeDataBlocksNum() < neededDataBlocksNum){
+            std::cerr<<"Error: Disk is full, delete files first\n";
+            return false;
+        }
+        extents = allocateFileExtents(neededDataBlocksNum);
+        size_t neededExtentBlocksNum = extentBlocksNum(extents.size());
+        if (freeDataBlocksNum() < neededExtentBlocksNum){
+            for (const auto& e : extents)
+                releaseDataBlocks(e.startDataBlock, e.length);
+            std::cerr<<"Error: Disk is full, delete files first\n";
+            return false;
+        }
+        ExtentBlocksIndexes = allocateDataBlocks(neededExtentBlocksNum);
+        for (const auto& e : shared)
+            for (u_int32_t b = 0; b < e.length; b++)
+                DataBlocksRefCounts.acquire(e.startDataBlock + b);
+        INodeIndex = getFreeINodeIndex();
+        markINode(INodeIndex, true);
+    }
+    try{
+        withDataBlockSize(DataBlockSize, [&](auto BlockSize){
+            writeFileBlocks<BlockSize>(extents, 0, neededDataBlocksNum, table.data());
+        });
+    }
+    catch (const char*){
+        for (const auto& e : shared)
+            releaseDataBlocks(e.startDataBlock, e.length);
+        for (const auto& e : extents)
+            releaseDataBlocks(e.startDataBlock, e.length);
+        for (size_t i : ExtentBlocksIndexes)
+            freeDataBlocks(i, 1);
+        std::lock_guard<std::recursive_mutex> lock(allocationMutex);
+        markINode(INodeIndex, false);
+        throw;
+    }
+    saveExtents(_INode, extents, ExtentBlocksIndexes);
+    saveINode(_INode, INodeIndex);
+    commitMetadata();
+    std::cout<<"Snapshot '"<<snapshotName<<"' of "<<header.filesNum<<" files taken, shared DataBlocks: "<<sharedNum;
+    std::cout<<", table DataBlocks: "<<neededDataBlocksNum<<"\n";
+    return true;
+}
+
+bool FileSystem::deleteSnapshot(const std::string& snapshotName){
+    if (legacy){
+        std::cerr<<"Error: Legacy disk format is read only.\n";
+        return false;
+    }
+    std::lock_guard<std::mutex> metadataLock(metadataMutex);
+    size_t INodeIndex = findSnapshot(snapshotName);
+    if (INodeIndex == NO_INODE){
+        std::cerr<<"Error: No snapshot with such name on disk.\n";
+        return false;
+    }
+    INode _INode = loadINode(INodeIndex);
+    SnapshotHeader header;
+    std::vector<SnapshotFile> files = loadSnapshot(_INode, header);
+    u_int32_t freeBefore = freeDataBlocksNum();
+    //DataBlocks shared with files or other snapshots only lose one reference
+    for (const auto& file : files)
+        for (const auto& e : file.extents)
+            releaseDataBlocks(e.startDataBlock, e.length);
+    for (const auto& e : loadExtents(_INode))
+        releaseDataBlocks(e.startDataBlock, e.length);
+    for (u_int32_t i : loadExtentBlocksIndexes(_INode))
+        freeDataBlocks(i, 1);
+    {
+        std::lock_guard<std::recursive_mutex> lock(allocationMutex);
+        markINode(INodeIndex, false);
+    }
+    commitMetadata();
+    std::cout<<"Snapshot '"<<snapshotName<<"' deleted, freed DataBlocks: "<<freeDataBlocksNum() - freeBefore<<"\n";
+    return true;
+}
+
+void FileSystem::listSnapshots(std::ostream& out){
+    if (legacy)
+        return;
+    loadDataBlocksTables();
+    std::vector<size_t> used;
+    {
+        std::lock_guard<std::recursive_mutex> lock(allocationMutex);
+        for (size_t i = INodesBitMap.findUsed(); i != BitMap::npos; i = INodesBitMap.findUsed(i + 1))
+            used.push_back(i);
+    }
+    for (size_t i : used){
+        INode _INode = loadINode(i);
+        if (!(_INode.flags & INODE_SNAPSHOT))
+            continue;
+        SnapshotHeader header;
+        std::vector<SnapshotFile> files = loadSnapshot(_INode, header);
+        //DataBlocks freed with the snapshot, referenced by nothing else
+        u_int64_t ownDataBlocksNum = 0;
+        {
+            std::lock_guard<std::recursive_mutex> lock(allocationMutex);
+            for (const auto& file : files)
+                for (const auto& e : file.extents)
+                    for (u_int32_t b = 0; b < e.length; b++)
+                        ownDataBlocksNum += DataBlocksRefCounts[e.startDataBlock + b] == 1;
+        }
+        std::time_t created = header.createdTime;
+        out<<"\nSnapshot INode Index: "<<i<<"\n----------------------------------\n";
+        out<<"Name: "<<INodeFileName(_INode)<<"\nTaken: "<<std::put_time(std::localtime(&created), "%Y-%m-%d %H:%M:%S");
+        out<<"\nFiles: "<<header.filesNum<<"\nFiles Size [B]: "<<header.filesBytesSize;
+        out<<"\nTable Size [B]: "<<_INode.fileSize_B<<"\nDataBlocks Only In Snapshot: "<<ownDataBlocksNum;
+        out<<"\n----------------------------------\n";
+    }
+}
+
+void FileSystem::listSnapshotFiles(const std::string& snapshotName, std::ostream& out){
+    size_t INodeIndex = legacy ? NO_INODE : findSnapshot(snapshotName);
+    if (INodeIndex == NO_INODE){
+        std::cerr<<"Error: No snapshot with such name on disk.\n";
+        return;
+    }
+    SnapshotHeader header;
+    for (const auto& file : loadSnapshot(loadINode(INodeIndex), header)){
+        out<<"\nFile Name: "<<INodeFileName(file._INode)<<"\n----------------------------------\n";
+        out<<"Size [B]: "<<file._INode.fileSize_B<<"\nExtents: ";
+        if (file._INode.flags & INODE_INLINE)
+            out<<"inline";
+        else
+            out<<file._INode.extentsNum;
+        if (file._INode.flags & INODE_COMPRESSED)
+            out<<" (compressed)";
+        out<<"\n----------------------------------\n";
+    }
+}
+
+void FileSystem::getSnapshotFile(const std::string& snapshotName, const std::string& fileName, const std::string& targetFileName){
+    size_t INodeIndex = legacy ? NO_INODE : findSnapshot(snapshotName);
+    if (INodeIndex == NO_INODE){
+        std::cerr<<"Error: No snapshot with such name on disk.\n";
+        return;
+    }
+    SnapshotHeader header;
+    for (const auto& file : loadSnapshot(loadINode(INodeIndex), header)){
+        if (INodeFileName(file._INode) == fileName){
+            getFile(file._INode, file.extents, targetFileName);
+            return;
+        }
+    }
+    std::cerr<<"Error: No file with such name in snapshot.\n";
+}
@@ -0,0 +1,73 @@
+#include "IOStats.hpp"
+#include <cstdlib>
+#include <fstream>
+
+namespace{
+const char* counterNames[size_t(Counter::CountersNum)] = {
+    "disk_opens", "file_opens", "reads", "writes", "seeks", "bytes_read", "bytes_written", "syncs",
+    "cache_hits", "cache_misses", "cache_evictions", "cache_write_backs", "mapped_bytes_read", "mapped_bytes_written",
+    "journal_commits", "journal_checkpoints", "datablocks_allocated", "datablocks_freed", "datablocks_shared",
+    "extent_blocks_read", "chain_hops", "read_batches", "readahead_hits"
+};
+const char* phaseNames[size_t(Phase::PhasesNum)] = {
+    "add_lookup", "add_allocate", "add_write", "add_commit", "get_lookup", "get_read"
+};
+
+std::string statsFileName;
+
+void writeStatsFile(){
+    std::ofstream file(statsFileName);
+    if (!file){
+        std::cerr<<"Error: Unable to write statistics to "<<statsFileName<<"\n";
+        return;
+    }
+    ioStats().printJson(file);
+}
+}
+
+IOStats& ioStats(){
+    static IOStats stats;
+    return stats;
+}
+
+void dumpStatsAtExit(const std::string& fileName){
+    bool registered = !statsFileName.empty();
+    statsFileName = fileName;
+    ioStats(); // constructed before the handler is registered, so it outlives it
+    if (!registered)
+        std::atexit(writeStatsFile);
+}
+
+void IOStats::reset(){
+    for (auto& counter : counters)
+        counter = 0;
+    for (size_t i = 0; i < size_t(Phase::PhasesNum); i++){
+        phaseCalls[i] = 0;
+        phaseNanoseconds[i] = 0;
+    }
+}
+
+void IOStats::print(std::ostream& out) const{
+    out<<"\tI/O Statistics\n----------------------------------\n";
+    if (!IOSTATS_ENABLED)
+        out<<"(compiled out with FS_NO_STATS)\n";
+    for (size_t i = 0; i < size_t(Counter::CountersNum); i++)
+        out<<counterNames[i]<<": "<<counters[i].load()<<"\n";
+    u_int64_t hits = get(Counter::CacheHits), misses = get(Counter::CacheMisses);
+    if (hits + misses > 0)
+        out<<"cache_hit_ratio: "<<double(hits) / (hits + misses)<<"\n";
+    for (size_t i = 0; i < size_t(Phase::PhasesNum); i++)
+        if (phaseCalls[i] > 0)
+            out<<phaseNames[i]<<": "<<phaseCalls[i].load()<<" calls, "<<phaseNanoseconds[i] / 1e6<<" ms\n";
+    out<<"----------------------------------\n";
+}
+
+void IOStats::printJson(std::ostream& out) const{
+    out<<"{\n  \"enabled\": "<<(IOSTATS_ENABLED ? "true" : "false")<<",\n  \"counters\": {";
+    for (size_t i = 0; i < size_t(Counter::CountersNum); i++)
+        out<<(i ? ", " : "")<<"\""<<counterNames[i]<<"\": "<<counters[i].load();
+    out<<"},\n  \"phases\": {";
+    for (size_t i = 0; i < size_t(Phase::PhasesNum); i++)
+        out<<(i ? ", " : "")<<"\""<<phaseNames[i]<<"\": {\"calls\": "<<phaseCalls[i].load()<<", \"ns\": "<<phaseNanoseconds[i].load()<<"}";
+    out<<"}\n}\n";
+}
@@ -0,0 +1,112 @@
+#ifndef IOSTATS_HPP
+#define IOSTATS_HPP
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <sys/types.h>
+
+// Process wide counters of BlockDevice and FileSystem work, and time spent
+// in phases of addFile and getFile. Counters are relaxed atomics bumped once
+// per call (not per byte), a phase costs two clock reads. Building with
+// -DFS_NO_STATS turns every STAT_* macro into nothing.
+
+enum class Counter{
+    DiskOpens,
+    FileOpens, // FileHandles opened
+    Reads, // pread calls
+    Writes, // pwrite calls
+    Seeks, // transfers not starting where the previous one ended
+    BytesRead,
+    BytesWritten,
+    Syncs, // fdatasync and msync calls
+    CacheHits,
+    CacheMisses,
+    CacheEvictions,
+    CacheWriteBacks, // dirty pages written home
+    MappedBytesRead,
+    MappedBytesWritten,
+    JournalCommits,
+    JournalCheckpoints,
+    DataBlocksAllocated,
+    DataBlocksFreed,
+    DataBlocksShared, // references to existing blocks made by dedup
+    ExtentBlocksRead,
+    ChainHops, // DataBlocks followed in chains of legacy disks
+    ReadBatches, // groups of direct reads kept in flight together
+    ReadaheadHits, // chained DataBlocks found already read ahead
+    CountersNum
+};
+
+enum class Phase{
+    AddLookup, // name checks and free INode
+    AddAllocate, // DataBlocks and ExtentBlocks reserved up front
+    AddWrite, // contents streamed to DataBlocks (including allocation while streaming)
+    AddCommit, // INode, directory entry and metadata commit
+    GetLookup, // INode and extents
+    GetRead, // contents streamed to the target file
+    PhasesNum
+};
+
+struct IOStats{
+    std::atomic<u_int64_t> counters[size_t(Counter::CountersNum)]={};
+    std::atomic<u_int64_t> phaseCalls[size_t(Phase::PhasesNum)]={};
+    std::atomic<u_int64_t> phaseNanoseconds[size_t(Phase::PhasesNum)]={};
+
+    void add(Counter counter, u_int64_t n){
+        counters[size_t(counter)].fetch_add(n, std::memory_order_relaxed);
+    }
+    void addPhase(Phase phase, u_int64_t nanoseconds){
+        phaseCalls[size_t(phase)].fetch_add(1, std::memory_order_relaxed);
+        phaseNanoseconds[size_t(phase)].fetch_add(nanoseconds, std::memory_order_relaxed);
+    }
+    u_int64_t get(Counter counter) const{
+        return counters[size_t(counter)].load(std::memory_order_relaxed);
+    }
+    void reset();
+    void print(std::ostream& out) const;
+    void printJson(std::ostream& out) const;
+};
+
+IOStats& ioStats();
+// JSON of ioStats() is written to fileName when the process exits
+void dumpStatsAtExit(const std::string& fileName);
+
+// measures consecutive phases of one operation, the current one ends at next() or destruction
+class PhaseTimer{
+    public:
+    PhaseTimer(Phase phase) : phase(phase), start(std::chrono::steady_clock::now()){}
+    ~PhaseTimer(){
+        stop();
+    }
+    void next(Phase phase){
+        stop();
+        this->phase = phase;
+        running = true;
+    }
+    private:
+    void stop(){
+        auto now = std::chrono::steady_clock::now();
+        if (running)
+            ioStats().addPhase(phase, std::chrono::duration_cast<std::chrono::nanoseconds>(now - start).count());
+        start = now;
+        running = false;
+    }
+    Phase phase;
+    bool running=true;
+    std::chrono::steady_clock::time_point start;
+};
+
+#ifndef FS_NO_STATS
+#define IOSTATS_ENABLED true
+#define STAT_ADD(counter, n) ioStats().add(Counter::counter, (n))
+#define STAT_TIMER(timer, phase) PhaseTimer timer(Phase::phase)
+#define STAT_NEXT(timer, phase) timer.next(Phase::phase)
+#else
+#define IOSTATS_ENABLED false
+#define STAT_ADD(counter, n) ((void)0)
+#define STAT_TIMER(timer, phase) ((void)0)
+#define STAT_NEXT(timer, phase) ((void)0)
+#endif
+#endif
@@ -0,0 +1,152 @@
+#include "LZCodec.hpp"
+#include <cstring>
+#include <vector>
+
+#define LZ_LAST_LITERALS 8 // input tail never covered by a match, keeps 8-byte reads inside the input
+
+namespace{
+inline u_int32_t read32(const u_int8_t* p){
+    u_int32_t value;
+    std::memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+inline u_int64_t read64(const u_int8_t* p){
+    u_int64_t value;
+    std::memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+inline u_int32_t hashSequence(u_int32_t sequence){
+    return (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// length above 15 continues in bytes of 255, returns false when dst is full
+bool writeLength(u_int8_t*& out, const u_int8_t* end, size_t length){
+    for (; length >= 255; length -= 255){
+        if (out >= end)
+            return false;
+        *out++ = 255;
+    }
+    if (out >= end)
+        return false;
+    *out++ = u_int8_t(length);
+    return true;
+}
+
+bool readLength(const u_int8_t*& in, const u_int8_t* end, size_t& length){
+    u_int8_t byte;
+    do{
+        if (in >= end)
+            return false;
+        byte = *in++;
+        length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+bool writeSequence(u_int8_t*& out, const u_int8_t* end, const u_int8_t* literals, size_t literalsNum, size_t offset, size_t matchLength){
+    if (out >= end)
+        return false;
+    u_int8_t* token = out++;
+    *token = u_int8_t((literalsNum < 15 ? literalsNum : 15) << 4);
+    if (literalsNum >= 15 && !writeLength(out, end, literalsNum - 15))
+        return false;
+    if (size_t(end - out) < literalsNum)
+        return false;
+    if (literalsNum > 0)
+        std::memcpy(out, literals, literalsNum);
+    out += literalsNum;
+    if (matchLength == 0)
+        return true;
+    if (end - out < 2)
+        return false;
+    *out++ = u_int8_t(offset);
+    *out++ = u_int8_t(offset >> 8);
+    matchLength -= LZ_MIN_MATCH;
+    *token |= u_int8_t(matchLength < 15 ? matchLength : 15);
+    return matchLength < 15 || writeLength(out, end, matchLength - 15);
+}
+}
+
+size_t lzCompress(const u_int8_t* src, size_t srcSize, u_int8_t* dst, size_t dstCapacity){
+    u_int8_t* out = dst;
+    const u_int8_t* end = dst + dstCapacity;
+    size_t anchor = 0;
+    if (srcSize > LZ_LAST_LITERALS + LZ_MIN_MATCH){
+        // last seen position + 1 of each hashed 4-byte sequence, 0 when none
+        std::vector<u_int32_t> table(size_t(1) << LZ_HASH_BITS, 0);
+        const size_t matchLimit = srcSize - LZ_LAST_LITERALS;
+        size_t position = 0;
+        while (position + LZ_MIN_MATCH <= matchLimit){
+            u_int32_t sequence = read32(src + position);
+            u_int32_t& slot = table[hashSequence(sequence)];
+            size_t candidate = slot;
+            slot = u_int32_t(position + 1);
+            if (candidate == 0 || position - (candidate - 1) > LZ_MAX_OFFSET || read32(src + candidate - 1) != sequence){
+                // step grows over data without matches, incompressible input is skipped quickly
+                position += 1 + ((position - anchor) >> 6);
+                continue;
+            }
+            size_t match = candidate - 1;
+            size_t length = LZ_MIN_MATCH;
+            while (position + length + 8 <= matchLimit){
+                u_int64_t difference = read64(src + match + length) ^ read64(src + position + length);
+                if (difference){
+                    length += __builtin_ctzll(difference) / 8;
+                    break;
+                }
+                length += 8;
+            }
+            if (position + length + 8 > matchLimit)
+                while (position + length < matchLimit && src[match + length] == src[position + length])
+                    length++;
+            if (!writeSequence(out, end, src + anchor, position - anchor, position - match, length))
+                return 0;
+            position += length;
+            anchor = position;
+        }
+    }
+    if (!writeSequence(out, end, src + anchor, srcSize - anchor, 0, 0))
+        return 0;
+    return out - dst;
+}
+
+bool lzDecompress(const u_int8_t* src, size_t srcSize, u_int8_t* dst, size_t dstSize){
+    const u_int8_t* in = src;
+    const u_int8_t* inEnd = src + srcSize;
+    size_t produced = 0;
+    while (in < inEnd){
+        u_int8_t token = *in++;
+        size_t literalsNum = token >> 4;
+        if (literalsNum == 15 && !readLength(in, inEnd, literalsNum))
+            return false;
+        if (size_t(inEnd - in) < literalsNum || dstSize - produced < literalsNum)
+            return false;
+        if (literalsNum > 0)
+            std::memcpy(dst + produced, in, literalsNum);
+        in += literalsNum;
+        produced += literalsNum;
+        if (in == inEnd)
+            break;
+        if (inEnd - in < 2)
+            return false;
+        size_t offset = in[0] | (size_t(in[1]) << 8);
+        in += 2;
+        size_t matchLength = token & 15;
+        if (matchLength == 15 && !readLength(in, inEnd, matchLength))
+            return false;
+        matchLength += LZ_MIN_MATCH;
+        if (offset == 0 || offset > produced || dstSize - produced < matchLength)
+            return false;
+        u_int8_t* out = dst + produced;
+        const u_int8_t* match = out - offset;
+        if (offset >= matchLength)
+            std::memcpy(out, match, matchLength);
+        else
+            for (size_t i = 0; i < matchLength; i++) // overlapping match repeats the last offset bytes
+                out[i] = match[i];
+        produced += matchLength;
+    }
+    return produced == dstSize;
+}
@@ -0,0 +1,21 @@
+#ifndef LZCODEC_HPP
+#define LZCODEC_HPP
+
+#include <cstddef>
+#include <sys/types.h>
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 14
+
+// Byte oriented LZ77 codec in the style of LZ4, no external dependency.
+// Compressed data is a list of sequences, each one a token byte (literals
+// length in high 4 bits, match length - LZ_MIN_MATCH in low 4 bits, value 15
+// continued by bytes adding up to 255 each), the literals and a 2-byte little
+// endian offset of the match. The last sequence holds literals only.
+
+// returns compressed size, 0 when it does not fit into dstCapacity
+size_t lzCompress(const u_int8_t* src, size_t srcSize, u_int8_t* dst, size_t dstCapacity);
+// false when src is not a valid compressed form of exactly dstSize bytes
+bool lzDecompress(const u_int8_t* src, size_t srcSize, u_int8_t* dst, size_t dstSize);
+#endif
@@ -0,0 +1,64 @@
+#include "RefCountTable.hpp"
+#include <algorithm>
+
+void RefCountTable::resize(size_t blocksNum){
+    counts.assign(blocksNum, 0);
+    dirtyChunks.clear();
+}
+
+size_t RefCountTable::size() const{
+    return counts.size();
+}
+
+size_t RefCountTable::bytesSize() const{
+    return counts.size() * sizeof(u_int32_t);
+}
+
+u_int32_t RefCountTable::operator[](size_t i) const{
+    return counts[i];
+}
+
+void RefCountTable::acquire(size_t i){
+    if (counts[i] == MAX_REFCOUNT)
+        throw "too many references to DataBlock";
+    counts[i]++;
+    markDirty(i);
+}
+
+u_int32_t RefCountTable::release(size_t i){
+    // blocks without references are free already, nothing to release
+    if (counts[i] == 0)
+        return 0;
+    counts[i]--;
+    markDirty(i);
+    return counts[i];
+}
+
+u_int8_t* RefCountTable::bytes(){
+    return (u_int8_t*)counts.data();
+}
+
+void RefCountTable::bytesLoaded(){
+    dirtyChunks.clear();
+}
+
+std::vector<std::pair<size_t, size_t>> RefCountTable::dirtyRanges() const{
+    std::vector<std::pair<size_t, size_t>> ranges;
+    for (size_t chunk : dirtyChunks){
+        size_t offset = chunk * REFCOUNTS_DIRTY_CHUNK_SIZE;
+        size_t size = std::min(size_t(REFCOUNTS_DIRTY_CHUNK_SIZE), bytesSize() - offset);
+        if (!ranges.empty() && ranges.back().first + ranges.back().second == offset)
+            ranges.back().second += size;
+        else
+            ranges.push_back({offset, size});
+    }
+    return ranges;
+}
+
+void RefCountTable::clearDirty(){
+    dirtyChunks.clear();
+}
+
+void RefCountTable::markDirty(size_t i){
+    dirtyChunks.insert(i * sizeof(u_int32_t) / REFCOUNTS_DIRTY_CHUNK_SIZE);
+}
@@ -0,0 +1,36 @@
+#ifndef REFCOUNTTABLE_HPP
+#define REFCOUNTTABLE_HPP
+
+#include <vector>
+#include <set>
+#include <utility>
+#include <sys/types.h>
+
+#define REFCOUNTS_DIRTY_CHUNK_SIZE 512 // table bytes saved together when any of their counters changes
+#define MAX_REFCOUNT 0xFFFFFFFF
+
+// Number of references from files and snapshots to every DataBlock, stored
+// on disk as little endian u_int32_t per DataBlock. 0 marks blocks that hold no
+// file data (free blocks and ExtentBlocks).
+// Like BitMap, chunks modified since the last clearDirty() are remembered
+// so that only they have to be written back.
+class RefCountTable{
+    public:
+    void resize(size_t blocksNum);
+    size_t size() const;
+    size_t bytesSize() const;
+    u_int32_t operator[](size_t i) const;
+    void acquire(size_t i); // one more reference
+    u_int32_t release(size_t i); // one reference less, returns references left
+    u_int8_t* bytes();
+    void bytesLoaded(); // call after bytes() were overwritten
+    std::vector<std::pair<size_t, size_t>> dirtyRanges() const; // {offset, size} in bytes, neighbouring chunks merged
+    void clearDirty();
+    private:
+    void markDirty(size_t i);
+
+    private:
+    std::vector<u_int32_t> counts;
+    std::set<size_t> dirtyChunks;
+};
+#endif
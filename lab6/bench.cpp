@@ -0,0 +1,444 @@
+// Benchmark of FileSystem operations on synthetic workloads.
+// Build next to the CLI, with every FileSystem source except main.cpp:
+//   g++ -std=c++17 -O2 -pthread -o bench bench.cpp FileSystem*.cpp BlockDevice.cpp BitMap.cpp ExtentAllocator.cpp RefCountTable.cpp LZCodec.cpp CRC32C.cpp AsyncReader.cpp IOStats.cpp
+// Results are written as one JSON document to stdout (or -j file), a
+// readable summary goes to stderr. Syscall counts come from /proc/self/io.
+#include "FileSystem.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <unistd.h>
+
+struct IOCounters {
+    u_int64_t readCalls = 0;
+    u_int64_t writeCalls = 0;
+    u_int64_t bytesRead = 0;
+    u_int64_t bytesWritten = 0;
+};
+
+IOCounters readIOCounters() {
+    IOCounters counters;
+    std::ifstream io("/proc/self/io");
+    std::string key;
+    u_int64_t value;
+    while (io >> key >> value) {
+        if (key == "syscr:")
+            counters.readCalls = value;
+        else if (key == "syscw:")
+            counters.writeCalls = value;
+        else if (key == "rchar:")
+            counters.bytesRead = value;
+        else if (key == "wchar:")
+            counters.bytesWritten = value;
+    }
+    return counters;
+}
+
+// samples of one operation type within a scenario
+struct OperationStats {
+    std::vector<double> latencies_us;
+    u_int64_t bytes = 0;
+    IOCounters io;
+
+    void add(double latency_us, u_int64_t bytesNum, const IOCounters& before, const IOCounters& after) {
+        latencies_us.push_back(latency_us);
+        bytes += bytesNum;
+        io.readCalls += after.readCalls - before.readCalls;
+        io.writeCalls += after.writeCalls - before.writeCalls;
+        io.bytesRead += after.bytesRead - before.bytesRead;
+        io.bytesWritten += after.bytesWritten - before.bytesWritten;
+    }
+    double percentile(double p) const {
+        if (latencies_us.empty())
+            return 0;
+        std::vector<double> sorted = latencies_us;
+        std::sort(sorted.begin(), sorted.end());
+        size_t i = std::min(sorted.size() - 1, size_t(std::ceil(p / 100 * sorted.size())) - (p > 0 ? 1 : 0));
+        return sorted[i];
+    }
+    double seconds() const {
+        double total = 0;
+        for (double l : latencies_us)
+            total += l;
+        return total / 1e6;
+    }
+};
+
+struct ScenarioResult {
+    std::string name;
+    std::map<std::string, OperationStats> operations;
+    std::vector<std::pair<std::string, DiskUsage>> usage; // disk state at named points
+};
+
+struct BenchConfig {
+    u_int32_t blockSize = DATABLOCK_SIZE;
+    double scale = 1;
+    u_int64_t seed = 1;
+    bool mapped = false;
+    AllocationPolicy policy = AllocationPolicy::BestFit;
+    std::string only;
+    std::string out;
+    std::filesystem::path dir;
+};
+
+// runs one operation with FileSystem output silenced, records its latency and syscalls
+template<typename Operation>
+void measure(OperationStats& stats, u_int64_t bytesNum, Operation operation) {
+    std::ostringstream silenced;
+    std::streambuf* stdoutBuffer = std::cout.rdbuf(silenced.rdbuf());
+    IOCounters before = readIOCounters();
+    auto start = std::chrono::steady_clock::now();
+    try {
+        operation();
+    } catch (...) {
+        std::cout.rdbuf(stdoutBuffer);
+        throw;
+    }
+    auto end = std::chrono::steady_clock::now();
+    IOCounters after = readIOCounters();
+    std::cout.rdbuf(stdoutBuffer);
+    stats.add(std::chrono::duration<double, std::micro>(end - start).count(), bytesNum, before, after);
+}
+
+class Workload {
+    public:
+    Workload(const BenchConfig& config, const std::string& name) : config(config), random(config.seed) {
+        result.name = name;
+        diskName = (config.dir / (name + ".disk")).string();
+    }
+    ~Workload() {
+        std::error_code ignored;
+        for (const auto& file : sources)
+            std::filesystem::remove(file.second, ignored);
+        std::filesystem::remove(diskName, ignored);
+        std::filesystem::remove(config.dir / "got", ignored);
+    }
+    // log-normal sizes around median, clamped
+    u_int64_t randomSize(double median, double sigma, u_int64_t minSize, u_int64_t maxSize) {
+        std::lognormal_distribution<double> distribution(std::log(median), sigma);
+        return std::clamp(u_int64_t(distribution(random)), minSize, maxSize);
+    }
+    std::string makeSource(u_int64_t size) {
+        std::string name = "f" + std::to_string(nextSource++);
+        std::string path = (config.dir / name).string();
+        std::ofstream file(path, std::ios::binary);
+        std::vector<u_int64_t> chunk(8192);
+        for (u_int64_t written = 0; written < size; written += chunk.size() * 8) {
+            for (auto& word : chunk)
+                word = random();
+            file.write((const char*)chunk.data(), std::min(size - written, u_int64_t(chunk.size() * 8)));
+        }
+        sources[name] = path;
+        sizes[name] = size;
+        return name;
+    }
+    void create(u_int32_t size_MB, u_int32_t INodesNum) {
+        measure(result.operations["crt"], 0, [&] {
+            f.createDisk(diskName, size_MB, INodesNum, config.blockSize);
+        });
+        std::ostringstream silenced;
+        std::streambuf* stdoutBuffer = std::cout.rdbuf(silenced.rdbuf());
+        f.setAllocationPolicy(config.policy);
+        f.loadDisk(diskName, config.mapped);
+        std::cout.rdbuf(stdoutBuffer);
+    }
+    // af of a generated file, sources are named relative to the working directory (bench dir)
+    bool add(const std::string& name) {
+        bool added = false;
+        measure(result.operations["af"], sizes[name], [&] {
+            added = f.addFile(name);
+        });
+        if (added)
+            stored.push_back(name);
+        else
+            result.operations["af"].latencies_us.pop_back();
+        return added;
+    }
+    void get(const std::string& name) {
+        measure(result.operations["gf"], sizes[name], [&] {
+            f.getFile(f.findFile(name), "got");
+        });
+    }
+    void remove(size_t storedIndex) {
+        std::string name = stored[storedIndex];
+        measure(result.operations["df"], sizes[name], [&] {
+            f.deleteFile(f.findFile(name));
+        });
+        stored.erase(stored.begin() + storedIndex);
+        std::filesystem::remove(sources[name]);
+        sources.erase(name);
+    }
+    void list() {
+        measure(result.operations["lf"], 0, [&] {
+            f.listFiles();
+        });
+    }
+    void snapshotUsage(const std::string& point) {
+        result.usage.push_back({point, f.diskUsage()});
+    }
+    u_int64_t freeBytes() {
+        DiskUsage usage = f.diskUsage();
+        return usage.freeDataBlocksNum * usage.DataBlockSize;
+    }
+
+    const BenchConfig& config;
+    std::mt19937_64 random;
+    ScenarioResult result;
+    std::string diskName;
+    FileSystem f;
+    std::map<std::string, std::string> sources;
+    std::map<std::string, u_int64_t> sizes;
+    std::vector<std::string> stored;
+    size_t nextSource = 0;
+};
+
+size_t scaled(const BenchConfig& config, size_t count) {
+    return std::max(size_t(1), size_t(count * config.scale));
+}
+
+// files of given sizes are added, read back, listed and deleted
+void addGetDelete(Workload& w, const std::vector<u_int64_t>& fileSizes) {
+    std::vector<std::string> names;
+    for (u_int64_t size : fileSizes)
+        names.push_back(w.makeSource(size));
+    for (const auto& name : names)
+        w.add(name);
+    w.snapshotUsage("filled");
+    w.list();
+    for (const auto& name : w.stored)
+        w.get(name);
+    while (!w.stored.empty())
+        w.remove(w.stored.size() - 1);
+}
+
+u_int32_t diskSizeFor(const std::vector<u_int64_t>& fileSizes, u_int32_t blockSize) {
+    u_int64_t total = 0;
+    for (u_int64_t size : fileSizes)
+        total += (size + blockSize - 1) / blockSize * blockSize;
+    return u_int32_t(total * 5 / 4 / 1048576 + 16);
+}
+
+ScenarioResult smallFiles(const BenchConfig& config) {
+    Workload w(config, "small");
+    std::vector<u_int64_t> fileSizes;
+    for (size_t i = 0; i < scaled(config, 2000); i++)
+        fileSizes.push_back(w.randomSize(4096, 1.0, 1, 65536));
+    w.create(diskSizeFor(fileSizes, config.blockSize), fileSizes.size());
+    addGetDelete(w, fileSizes);
+    return w.result;
+}
+
+ScenarioResult largeFiles(const BenchConfig& config) {
+    Workload w(config, "large");
+    std::vector<u_int64_t> fileSizes(scaled(config, 4), 64ull << 20);
+    w.create(diskSizeFor(fileSizes, config.blockSize), fileSizes.size());
+    addGetDelete(w, fileSizes);
+    return w.result;
+}
+
+ScenarioResult mixedFiles(const BenchConfig& config) {
+    Workload w(config, "mixed");
+    std::vector<u_int64_t> fileSizes;
+    for (size_t i = 0; i < scaled(config, 300); i++)
+        fileSizes.push_back(w.randomSize(65536, 2.0, 1, 16 << 20));
+    w.create(diskSizeFor(fileSizes, config.blockSize), fileSizes.size());
+    addGetDelete(w, fileSizes);
+    return w.result;
+}
+
+// disk filled to a level, then files are repeatedly deleted and added
+// at random, which fragments both files and free space
+ScenarioResult churn(const BenchConfig& config, const std::string& name, double fillLevel) {
+    Workload w(config, name);
+    const u_int32_t size_MB = 256;
+    w.create(size_MB, 4096);
+    const u_int64_t reserve = u_int64_t(w.freeBytes() * (1 - fillLevel));
+    while (true) {
+        u_int64_t size = w.randomSize(65536, 2.0, 1, 8 << 20);
+        if (w.freeBytes() < reserve + size + config.blockSize)
+            break;
+        if (!w.add(w.makeSource(size)))
+            break;
+    }
+    w.snapshotUsage("filled");
+    for (size_t round = 0; round < scaled(config, 1000) && !w.stored.empty(); round++) {
+        w.remove(std::uniform_int_distribution<size_t>(0, w.stored.size() - 1)(w.random));
+        while (true) {
+            u_int64_t size = w.randomSize(65536, 2.0, 1, 8 << 20);
+            if (w.freeBytes() < reserve + size + config.blockSize)
+                break;
+            if (!w.add(w.makeSource(size)))
+                break;
+        }
+    }
+    w.snapshotUsage("churned");
+    w.list();
+    for (const auto& stored : w.stored)
+        w.get(stored);
+    while (!w.stored.empty())
+        w.remove(w.stored.size() - 1);
+    return w.result;
+}
+
+void writeJson(std::ostream& out, const BenchConfig& config, const std::vector<ScenarioResult>& results) {
+    out << "{\n  \"benchmark\": \"lab6-filesystem\",\n  \"format_version\": " << FS_VERSION;
+    out << ",\n  \"timestamp\": " << std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    out << ",\n  \"config\": {\"block_size\": " << config.blockSize << ", \"scale\": " << config.scale << ", \"seed\": " << config.seed;
+    out << ", \"mapped\": " << (config.mapped ? "true" : "false") << ", \"policy\": \"" << (config.policy == AllocationPolicy::NextFit ? "next" : "best") << "\"},\n";
+    out << "  \"scenarios\": [";
+    for (size_t s = 0; s < results.size(); s++) {
+        const ScenarioResult& result = results[s];
+        out << (s ? ",\n" : "\n") << "    {\"name\": \"" << result.name << "\", \"operations\": {";
+        bool first = true;
+        for (const auto& [operation, stats] : result.operations) {
+            double seconds = stats.seconds();
+            out << (first ? "\n" : ",\n") << "      \"" << operation << "\": {\"count\": " << stats.latencies_us.size();
+            out << ", \"bytes\": " << stats.bytes << ", \"seconds\": " << seconds;
+            out << ", \"ops_per_second\": " << (seconds > 0 ? stats.latencies_us.size() / seconds : 0);
+            out << ", \"throughput_MBps\": " << (seconds > 0 ? stats.bytes / 1048576.0 / seconds : 0);
+            out << ", \"latency_us\": {\"p50\": " << stats.percentile(50) << ", \"p90\": " << stats.percentile(90);
+            out << ", \"p99\": " << stats.percentile(99) << ", \"max\": " << stats.percentile(100) << "}";
+            out << ", \"syscalls\": {\"read\": " << stats.io.readCalls << ", \"write\": " << stats.io.writeCalls << "}";
+            out << ", \"syscall_bytes\": {\"read\": " << stats.io.bytesRead << ", \"written\": " << stats.io.bytesWritten << "}}";
+            first = false;
+        }
+        out << "\n    }, \"fragmentation\": {";
+        for (size_t u = 0; u < result.usage.size(); u++) {
+            const DiskUsage& usage = result.usage[u].second;
+            out << (u ? ",\n" : "\n") << "      \"" << result.usage[u].first << "\": {\"files\": " << usage.filesNum;
+            out << ", \"extents\": " << usage.extentsNum << ", \"fragmented_files\": " << usage.fragmentedFilesNum;
+            out << ", \"extents_per_file\": " << (usage.filesNum ? double(usage.extentsNum) / usage.filesNum : 0);
+            out << ", \"datablocks\": " << usage.DataBlocksNum << ", \"free_datablocks\": " << usage.freeDataBlocksNum;
+            out << ", \"free_runs\": " << usage.freeRunsNum << "}";
+        }
+        out << "\n    }}";
+    }
+    out << "\n  ]\n}\n";
+}
+
+void printSummary(const std::vector<ScenarioResult>& results) {
+    for (const auto& result : results) {
+        std::cerr << result.name << "\n";
+        for (const auto& [operation, stats] : result.operations) {
+            double seconds = stats.seconds();
+            std::cerr << "  " << operation << "\t" << stats.latencies_us.size() << " ops";
+            if (stats.bytes > 0 && seconds > 0)
+                std::cerr << "\t" << stats.bytes / 1048576.0 / seconds << " MB/s";
+            std::cerr << "\tp50 " << stats.percentile(50) << " us\tp99 " << stats.percentile(99) << " us";
+            std::cerr << "\tsyscalls " << stats.io.readCalls + stats.io.writeCalls << "\n";
+        }
+        for (const auto& [point, usage] : result.usage)
+            std::cerr << "  " << point << ": " << usage.filesNum << " files, " << usage.extentsNum << " extents, "
+                      << usage.fragmentedFilesNum << " fragmented, " << usage.freeRunsNum << " free runs\n";
+    }
+}
+
+void printHelp() {
+    std::cout << "Usage: bench [options]\n";
+    std::cout << "  -b <blocksize>\t\t- DataBlock size of created disks (default 4096).\n";
+    std::cout << "  -s <scale>\t\t- Multiply number of files and churn rounds (default 1).\n";
+    std::cout << "  -r <seed>\t\t- Seed of generated workloads (default 1).\n";
+    std::cout << "  -o <scenario>\t\t- Run only one of: small, large, mixed, churn50, churn90.\n";
+    std::cout << "  -d <dir>\t\t- Directory for disks and generated files (default system temp).\n";
+    std::cout << "  -j <file>\t\t- Write JSON results to file instead of stdout.\n";
+    std::cout << "  -m\t\t\t- Map disks into memory.\n";
+    std::cout << "  -a <best|next>\t- DataBlocks allocation policy.\n";
+}
+
+int run(int argc, char* argv[]) {
+    BenchConfig config;
+    config.dir = std::filesystem::temp_directory_path() / ("lab6-bench-" + std::to_string(getpid()));
+    bool temporaryDir = true;
+    for (int i = 1; i < argc; i++) {
+        std::string option = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (option == "-h") {
+            printHelp();
+            return 0;
+        } else if (option == "-m") {
+            config.mapped = true;
+        } else if (option == "-b" && hasValue) {
+            config.blockSize = std::stoul(argv[++i]);
+        } else if (option == "-s" && hasValue) {
+            config.scale = std::stod(argv[++i]);
+        } else if (option == "-r" && hasValue) {
+            config.seed = std::stoull(argv[++i]);
+        } else if (option == "-o" && hasValue) {
+            config.only = argv[++i];
+        } else if (option == "-d" && hasValue) {
+            config.dir = argv[++i];
+            temporaryDir = false;
+        } else if (option == "-j" && hasValue) {
+            config.out = argv[++i];
+        } else if (option == "-a" && hasValue) {
+            config.policy = std::string(argv[++i]) == "next" ? AllocationPolicy::NextFit : AllocationPolicy::BestFit;
+        } else {
+            std::cerr << "Error: Unknown option '" << option << "'.\n";
+            return 1;
+        }
+    }
+    if (config.scale <= 0) {
+        std::cerr << "Error: <scale> must be positive.\n";
+        return 1;
+    }
+    std::filesystem::create_directories(config.dir);
+    // sources are added under their own names, so they are created in the bench directory
+    std::filesystem::path previousDir = std::filesystem::current_path();
+    std::filesystem::path benchDir = std::filesystem::absolute(config.dir);
+    std::filesystem::current_path(config.dir);
+    config.dir = ".";
+
+    std::vector<std::pair<std::string, std::function<ScenarioResult()>>> scenarios = {
+        {"small", [&] { return smallFiles(config); }},
+        {"large", [&] { return largeFiles(config); }},
+        {"mixed", [&] { return mixedFiles(config); }},
+        {"churn50", [&] { return churn(config, "churn50", 0.5); }},
+        {"churn90", [&] { return churn(config, "churn90", 0.9); }},
+    };
+    std::vector<ScenarioResult> results;
+    for (const auto& [name, scenario] : scenarios) {
+        if (!config.only.empty() && config.only != name)
+            continue;
+        std::cerr << "Running " << name << "...\n";
+        results.push_back(scenario());
+    }
+    std::filesystem::current_path(previousDir);
+    if (temporaryDir)
+        std::filesystem::remove_all(benchDir);
+    if (!config.only.empty() && results.empty()) {
+        std::cerr << "Error: Unknown scenario '" << config.only << "'.\n";
+        return 1;
+    }
+    printSummary(results);
+    if (config.out.empty()) {
+        writeJson(std::cout, config, results);
+    } else {
+        std::ofstream out(config.out);
+        writeJson(out, config, results);
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    try {
+        return run(argc, argv);
+    } catch (const char* error) {
+        std::cerr << "Error: " << error << "\n";
+        return 1;
+    } catch (const std::logic_error&) {
+        std::cerr << "Error: Invalid argument.\n";
+        std::cerr << "Use '-h' for a list of available options.\n";
+        return 1;
+    } catch (const std::exception& error) {
+        std::cerr << "Error: " << error.what() << "\n";
+        return 1;
+    }
+}
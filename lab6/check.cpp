@@ -0,0 +1,252 @@
+// Self checks of the codecs and the journal under the FileSystem and of its
+// handling of corrupt disks, run before changing them. Build next to the CLI:
+//   g++ -std=c++17 -O2 -pthread -o check check.cpp FileSystem*.cpp BlockDevice.cpp BitMap.cpp ExtentAllocator.cpp RefCountTable.cpp LZCodec.cpp CRC32C.cpp AsyncReader.cpp IOStats.cpp
+// Prints every failed check, exits with 1 when any failed.
+#include "FileSystem.hpp"
+#include "LZCodec.hpp"
+#include "CRC32C.hpp"
+#include "BlockDevice.hpp"
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+size_t failedNum = 0;
+
+void check(bool passed, const std::string& name) {
+    if (!passed) {
+        std::cerr << "FAILED: " << name << "\n";
+        failedNum++;
+    }
+}
+
+std::vector<u_int8_t> randomBytes(size_t size, u_int32_t seed) {
+    std::mt19937 random(seed);
+    std::vector<u_int8_t> bytes(size);
+    for (auto& byte : bytes)
+        byte = u_int8_t(random());
+    return bytes;
+}
+
+// compressed with room to spare, decompressed into exactly the input size
+void checkRoundTrip(const std::vector<u_int8_t>& input, const std::string& name) {
+    std::vector<u_int8_t> compressed(input.size() + input.size() / 255 + 16);
+    size_t compressedSize = lzCompress(input.data(), input.size(), compressed.data(), compressed.size());
+    check(compressedSize > 0 || input.empty(), name + ": compressed");
+    std::vector<u_int8_t> output(input.size());
+    check(lzDecompress(compressed.data(), compressedSize, output.data(), output.size()), name + ": decompressed");
+    check(output == input, name + ": same contents");
+    if (input.empty())
+        return;
+    // wrong size of the output is an invalid stream, not a shorter file
+    std::vector<u_int8_t> shorter(input.size() - 1);
+    check(!lzDecompress(compressed.data(), compressedSize, shorter.data(), shorter.size()), name + ": shorter output rejected");
+    std::vector<u_int8_t> longer(input.size() + 1);
+    check(!lzDecompress(compressed.data(), compressedSize, longer.data(), longer.size()), name + ": longer output rejected");
+    for (size_t cut = 0; cut < compressedSize; cut++)
+        if (lzDecompress(compressed.data(), cut, output.data(), output.size())) {
+            check(false, name + ": stream truncated to " + std::to_string(cut) + " bytes rejected");
+            break;
+        }
+}
+
+void checkLZ() {
+    checkRoundTrip({}, "lz empty");
+    checkRoundTrip({7}, "lz one byte");
+    checkRoundTrip(std::vector<u_int8_t>(100000, 'a'), "lz run of one byte");
+    std::vector<u_int8_t> period3;
+    for (size_t i = 0; i < 5000; i++)
+        period3.push_back(u_int8_t("xyz"[i % 3]));
+    checkRoundTrip(period3, "lz overlapping matches");
+    std::string text;
+    for (int i = 0; text.size() < 70000; i++)
+        text += "2026-10-17 12:00 INFO request " + std::to_string(i % 97) + " served\n";
+    checkRoundTrip(std::vector<u_int8_t>(text.begin(), text.end()), "lz text");
+    std::vector<u_int8_t> mixed = randomBytes(300, 1);
+    mixed.insert(mixed.end(), 4000, 0);
+    std::vector<u_int8_t> tail = randomBytes(1000, 2);
+    mixed.insert(mixed.end(), tail.begin(), tail.end());
+    checkRoundTrip(mixed, "lz long literals and long match");
+    for (size_t size : {5, 12, 13, 64, 4096, 65536 + 300})
+        checkRoundTrip(randomBytes(size, u_int32_t(size)), "lz random " + std::to_string(size) + " B");
+    // incompressible input does not fit into less than its size
+    std::vector<u_int8_t> random = randomBytes(65536, 3);
+    std::vector<u_int8_t> compressed(random.size() - 1);
+    check(lzCompress(random.data(), random.size(), compressed.data(), compressed.size()) == 0, "lz incompressible input does not fit");
+    // match reaching before the start of output
+    u_int8_t badOffset[] = {0x10, 'a', 0x05, 0x00};
+    u_int8_t output[32];
+    check(!lzDecompress(badOffset, sizeof(badOffset), output, 1 + LZ_MIN_MATCH), "lz offset before output rejected");
+}
+
+// known answers of CRC-32C (RFC 3720 B.4), for the CPU instruction and the table
+void checkCRC32C() {
+    std::vector<u_int8_t> ascending(32), descending(32);
+    for (u_int8_t i = 0; i < 32; i++) {
+        ascending[i] = i;
+        descending[i] = 31 - i;
+    }
+    std::string digits = "123456789";
+    struct KnownAnswer {
+        std::vector<u_int8_t> data;
+        u_int32_t crc;
+    };
+    std::vector<KnownAnswer> answers = {
+        {{}, 0},
+        {std::vector<u_int8_t>(digits.begin(), digits.end()), 0xE3069283},
+        {std::vector<u_int8_t>(32, 0), 0x8A9136AA},
+        {std::vector<u_int8_t>(32, 0xFF), 0x62A8AB43},
+        {ascending, 0x46DD794E},
+        {descending, 0x113FDB5C},
+    };
+    std::cout << "CRC-32C " << (crc32cHardware() ? "instruction and table" : "table only, no SSE4.2") << "\n";
+    for (size_t i = 0; i < answers.size(); i++) {
+        const KnownAnswer& answer = answers[i];
+        check(crc32c(answer.data.data(), answer.data.size()) == answer.crc, "crc32c known answer " + std::to_string(i));
+        check(crc32cSoftware(answer.data.data(), answer.data.size()) == answer.crc, "crc32cSoftware known answer " + std::to_string(i));
+    }
+    // every length and alignment, also continued over two parts
+    std::vector<u_int8_t> data = randomBytes(4096 + 64, 4);
+    for (size_t offset = 0; offset < 8; offset++)
+        for (size_t size = 0; size < 100; size++) {
+            u_int32_t crc = crc32cSoftware(data.data() + offset, size);
+            check(crc32c(data.data() + offset, size) == crc, "crc32c " + std::to_string(size) + " B at offset " + std::to_string(offset));
+            size_t half = size / 2;
+            check(crc32c(data.data() + offset + half, size - half, crc32c(data.data() + offset, half)) == crc, "crc32c continued " + std::to_string(size) + " B");
+            check(crc32cSoftware(data.data() + offset + half, size - half, crc32cSoftware(data.data() + offset, half)) == crc, "crc32cSoftware continued " + std::to_string(size) + " B");
+        }
+    check(crc32c(data.data(), 4096) == crc32cSoftware(data.data(), 4096), "crc32c of a DataBlock");
+}
+
+std::vector<u_int8_t> readDiskFile(const std::string& diskName) {
+    std::ifstream file(diskName, std::ios::binary);
+    return std::vector<u_int8_t>(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+// page 1 and 2 of a disk opened with its journal, after replay
+bool pagesAre(const std::string& diskName, bool readOnly, size_t replayedNum, u_int8_t page1, u_int8_t page2) {
+    const u_int64_t pageSize = BLOCK_DEVICE_PAGE_SIZE;
+    BlockDevice disk;
+    disk.open(diskName, false, readOnly);
+    bool passed = disk.openJournal(48 * pageSize, 16) == replayedNum;
+    std::vector<u_int8_t> expected(pageSize, page1);
+    expected.resize(2 * pageSize, page2);
+    std::vector<u_int8_t> data(2 * pageSize);
+    disk.read(pageSize, data.data(), data.size());
+    passed = passed && data == expected;
+    // direct reads see the replayed pages too
+    disk.readDirect(pageSize, data.data(), data.size());
+    passed = passed && data == expected;
+    disk.close();
+    return passed;
+}
+
+// disk file copied at a crash after two committed transactions, the second one torn or not
+void checkJournal() {
+    const u_int64_t pageSize = BLOCK_DEVICE_PAGE_SIZE;
+    std::filesystem::path dir = std::filesystem::temp_directory_path() / ("lab6-check-" + std::to_string(getpid()));
+    std::filesystem::create_directories(dir);
+    std::string diskName = dir / "journal.disk", crashed = dir / "crashed.disk", torn = dir / "torn.disk";
+    std::ofstream(diskName, std::ios::binary).write(std::vector<char>(64 * pageSize, 0).data(), 64 * pageSize);
+    {
+        BlockDevice disk;
+        disk.open(diskName);
+        disk.openJournal(48 * pageSize, 16);
+        disk.write(pageSize, std::vector<u_int8_t>(pageSize, 'A').data(), pageSize);
+        disk.flush();
+        disk.write(2 * pageSize, std::vector<u_int8_t>(pageSize, 'B').data(), pageSize);
+        disk.flush();
+        std::filesystem::copy_file(diskName, crashed);
+        disk.close();
+    }
+    check(pagesAre(diskName, false, 0, 'A', 'B'), "journal checkpointed on close");
+    // both transactions replayed, home locations written once
+    std::filesystem::copy_file(crashed, torn);
+    check(pagesAre(crashed, false, 2, 'A', 'B'), "journal replayed");
+    check(pagesAre(crashed, false, 0, 'A', 'B'), "journal replayed only once");
+    // image of the second transaction (journal page 4) torn, replay stops before it
+    {
+        std::fstream file(torn, std::ios::binary | std::ios::in | std::ios::out);
+        file.seekp(52 * pageSize + 100);
+        file.put('X');
+    }
+    std::vector<u_int8_t> tornBytes = readDiskFile(torn);
+    check(pagesAre(torn, true, 1, 'A', 0), "torn journal replayed read only");
+    check(readDiskFile(torn) == tornBytes, "read only replay writes nothing");
+    check(pagesAre(torn, false, 1, 'A', 0), "torn journal replayed");
+    check(pagesAre(torn, false, 0, 'A', 0), "torn journal replayed only once");
+    std::filesystem::remove_all(dir);
+}
+
+// INode of the only file pointed at an ExtentBlock chain that never reaches its extentsNum
+bool corruptChainStops(const std::string& diskName, size_t INodeIndex, u_int32_t nextExtentBlockIndex, u_int32_t extentsNum) {
+    SuperBlock superBlock;
+    std::fstream file(diskName, std::ios::binary | std::ios::in | std::ios::out);
+    file.read((char*)&superBlock, sizeof(superBlock));
+    INode _INode;
+    file.seekg(superBlock.INodesSectionStartAddr + INodeIndex * sizeof(INode));
+    file.read((char*)&_INode, sizeof(_INode));
+    _INode.extentsNum = 100;
+    _INode.extentBlockIndex = 5;
+    file.seekp(superBlock.INodesSectionStartAddr + INodeIndex * sizeof(INode));
+    file.write((const char*)&_INode, sizeof(_INode));
+    u_int32_t header[2] = {nextExtentBlockIndex, extentsNum}; // of ExtentBlock 5
+    file.seekp(superBlock.DataBlocksSectionStartAddr + 5 * superBlock.DataBlockSize);
+    file.write((const char*)header, sizeof(header));
+    file.close();
+    FileSystem f;
+    f.loadDisk(diskName);
+    bool passed = f.checkDisk(1) > 0;
+    try {
+        f.getFile(INodeIndex, diskName + ".out");
+        passed = false;
+    } catch (const char*) {
+    }
+    return passed;
+}
+
+// fsck and reads of a file with a corrupt ExtentBlock chain end with an error
+void checkExtentChain() {
+    std::filesystem::path dir = std::filesystem::temp_directory_path() / ("lab6-check-" + std::to_string(getpid()));
+    std::filesystem::create_directories(dir);
+    std::string diskName = dir / "chain.disk";
+    std::ostringstream silenced;
+    std::streambuf* stdoutBuffer = std::cout.rdbuf(silenced.rdbuf());
+    std::streambuf* stderrBuffer = std::cerr.rdbuf(silenced.rdbuf());
+    size_t INodeIndex = NO_INODE;
+    {
+        FileSystem f;
+        f.createDisk(diskName, 16, 16);
+        f.loadDisk(diskName);
+        std::vector<u_int8_t> contents = randomBytes(10000, 5);
+        std::istringstream file(std::string(contents.begin(), contents.end()));
+        f.addFile("file", file, contents.size());
+        INodeIndex = f.findFile("file");
+    }
+    bool emptyStops = corruptChainStops(diskName, INodeIndex, 5, 0);
+    bool cycleStops = corruptChainStops(diskName, INodeIndex, 5, 1);
+    std::cout.rdbuf(stdoutBuffer);
+    std::cerr.rdbuf(stderrBuffer);
+    check(INodeIndex != NO_INODE, "file added");
+    check(emptyStops, "empty ExtentBlock in chain rejected");
+    check(cycleStops, "ExtentBlock chain pointing back to itself rejected");
+    std::filesystem::remove_all(dir);
+}
+
+int main() {
+    checkLZ();
+    checkCRC32C();
+    checkJournal();
+    checkExtentChain();
+    if (failedNum > 0) {
+        std::cerr << failedNum << " checks failed.\n";
+        return 1;
+    }
+    std::cout << "All checks passed.\n";
+    return 0;
+}
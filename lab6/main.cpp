@@ -1,25 +1,123 @@
 #include "FileSystem.hpp"
+#include "FileServer.hpp"
+#include <algorithm>
+#include <cctype>
+#include <filesystem>
+#include <stdexcept>
+#include <thread>
 
 void printHelp() {
     std::cout << "Available Commands:\n";
-    std::cout << "  crt <diskname> <disksize>\t\t- Create a new disk with the specified name and size [MB].\n";
+    std::cout << "  crt <diskname> <disksize> [inodes] [blocksize]\t- Create a new disk with the specified name, size [MB], number of files (default 64)\n";
+    std::cout << "\t\t\t\t\t  and DataBlock size [B] (power of two from 1024 to 1048576, default 4096).\n";
     std::cout << "  del <diskname>\t\t\t- Delete the specified disk.\n";
     std::cout << "  bm <diskname>\t\t\t\t- Show the bitmap of the specified disk.\n";
     std::cout << "  lf <diskname>\t\t\t\t- List files on the specified disk.\n";
     std::cout << "  af <diskname> <filename>\t\t- Add a file to the specified disk.\n";
-    std::cout << "  df <diskname> <fileindex>\t\t- Delete a file from the specified disk by index.\n";
-    std::cout << "  gf <diskname> <fileindex> [filename]\t- Get a file from the disk by index and optionally save it to a filename.\n";
+    std::cout << "  ai <diskname> <dir|list> [threads]\t- Add all files from a directory (recursively) or listed in a file, in parallel.\n";
+    std::cout << "  df <diskname> <file>\t\t\t- Delete a file from the specified disk by index or name.\n";
+    std::cout << "  gf <diskname> <file> [filename]\t- Get a file from the disk by index or name and optionally save it to a filename.\n";
+    std::cout << "  rd <diskname> <file> <offset> <length> [filename]\t- Read part of a file, to stdout or to a filename.\n";
+    std::cout << "  wr <diskname> <file> <offset> <source>\t- Overwrite a file from offset with contents of source, growing it if needed.\n";
+    std::cout << "  ap <diskname> <file> <source>\t\t- Append contents of source to a file.\n";
+    std::cout << "  tr <diskname> <file> <size>\t\t- Truncate or extend (with zeros) a file to size [B].\n";
+    std::cout << "  defrag <diskname> [seconds] [MB]\t- Move fragmented files into contiguous runs and free space to the end of the disk,\n";
+    std::cout << "\t\t\t\t\t  stopping after seconds or MB moved (0 or none for no limit), run again to continue.\n";
+    std::cout << "  fsck <diskname> [threads]\t\t- Check the disk structure and DataBlock checksums, exits with 1 when problems are found.\n";
+    std::cout << "  snap <diskname> <name>\t\t\t- Take a snapshot of all files, it shares their DataBlocks until the files change.\n";
+    std::cout << "  lsnap <diskname> [name]\t\t- List snapshots, or files in snapshot name.\n";
+    std::cout << "  dsnap <diskname> <name>\t\t- Delete a snapshot, DataBlocks no file or other snapshot uses are freed.\n";
+    std::cout << "  (<file> made only of digits is an INode index, anything else is a file name,\n";
+    std::cout << "   gf takes @<snapshot>/<name> for a file in a snapshot)\n";
+    std::cout << "  ses <diskname> [script]\t\t- Run commands (without <diskname>) from script or stdin on a disk loaded once,\n";
+    std::cout << "\t\t\t\t\t  metadata is committed at 'checkpoint' lines and at the end ('exit' ends early).\n";
+    std::cout << "  srv <diskname> <socket>\t\t- Serve the disk to clients on a Unix socket until 'cl <socket> stop', SIGINT or SIGTERM.\n";
+    std::cout << "  cl <socket> <command> [arguments]\t- Run lf, af, df, gf, rd, wr, ap or tr (without <diskname>), stats or stop on a server,\n";
+    std::cout << "\t\t\t\t\t  gf writes the file to stdout without [filename].\n";
+    std::cout << "  stats <command> [arguments]\t\t- Run a command, then print its I/O counters and phase times to stderr.\n";
     std::cout << "  h\t\t\t\t\t- Print this help message.\n";
+    std::cout << "Options (before command):\n";
+    std::cout << "  -m\t\t\t\t\t- Map the whole disk into memory, file data is read and written through the mapping.\n";
+    std::cout << "  -a <best|next>\t\t\t- DataBlocks allocation policy, best-fit (default) or next-fit.\n";
+    std::cout << "  -c\t\t\t\t\t- Compress added files, chunks that do not compress are stored raw (af, ai).\n";
+    std::cout << "  -v\t\t\t\t\t- Read imported files back and compare them with their sources (ai), the read back is served by the OS page cache.\n";
+    std::cout << "  -d\t\t\t\t\t- Create the disk with block deduplication, files share DataBlocks with equal contents (crt).\n";
+    std::cout << "  -j <file>\t\t\t\t- Write I/O counters and phase times as JSON to file at exit.\n";
 }
 
-int main(int argc, char* argv[]) {
-    if (argc < 2) {
-        std::cerr << "Error: Not enough arguments.\n";
-        std::cerr << "Usage: <command> [arguments]\n";
-        std::cerr << "Use 'h' for a list of available commands.\n";
-        return 1;
+size_t resolveFile(FileSystem& f, const std::string& file) {
+    if (!file.empty() && std::all_of(file.begin(), file.end(), [](unsigned char c) { return std::isdigit(c); }))
+        return std::stoul(file);
+    size_t fileIndex = f.findFile(file);
+    if (fileIndex == NO_INODE)
+        throw "No file with such name on disk";
+    return fileIndex;
+}
+
+std::vector<std::string> importList(const std::string& source) {
+    std::vector<std::string> fileNames;
+    if (std::filesystem::is_directory(source)) {
+        for (const auto& entry : std::filesystem::recursive_directory_iterator(source))
+            if (entry.is_regular_file())
+                fileNames.push_back(entry.path().string());
+        std::sort(fileNames.begin(), fileNames.end());
+        return fileNames;
     }
-    FileSystem f;
+    std::ifstream list(source);
+    if (!list)
+        throw "Unable to get list of files";
+    std::string line;
+    while (std::getline(list, line))
+        if (!line.empty())
+            fileNames.push_back(line);
+    return fileNames;
+}
+
+void readRange(FileSystem& f, FileHandle& handle, u_int64_t offset, u_int64_t length, const std::string& target) {
+    std::ofstream file;
+    if (!target.empty()) {
+        file.open(target, std::ios::binary | std::ios::out);
+        if (!file)
+            throw "Unable to open target file";
+    }
+    std::ostream& out = target.empty() ? std::cout : file;
+    BytesVector window(STREAM_WINDOW_SIZE);
+    while (length > 0) {
+        size_t n = f.readFile(handle, offset, window.data(), std::min(u_int64_t(window.size()), length));
+        if (n == 0)
+            break;
+        out.write((const char*)window.data(), n);
+        offset += n;
+        length -= n;
+    }
+}
+
+void writeRange(FileSystem& f, FileHandle& handle, u_int64_t offset, const std::string& source, bool append) {
+    std::ifstream file(source, std::ios::binary);
+    if (!file)
+        throw "Unable to open source file";
+    BytesVector window(STREAM_WINDOW_SIZE);
+    while (file) {
+        file.read((char*)window.data(), window.size());
+        size_t n = file.gcount();
+        if (n == 0)
+            break;
+        if (append)
+            f.appendFile(handle, window.data(), n);
+        else
+            f.writeFile(handle, offset, window.data(), n);
+        offset += n;
+    }
+    f.closeFile(handle);
+}
+
+// disk stays loaded between commands of a session, commands that only read open it read only
+void openDisk(FileSystem& f, const std::string& diskname, bool mapped, bool readOnly = false) {
+    if (!f.isLoaded(diskname))
+        f.loadDisk(diskname, mapped, readOnly);
+}
+
+int runCommand(FileSystem& f, int argc, char* argv[], bool mapped, bool dedup) {
     std::string command = argv[1];
     if (command == "h") {
         printHelp();
@@ -29,7 +127,7 @@ int main(int argc, char* argv[]) {
             return 1;
         }
         std::string diskname = argv[2];
-        f.loadDisk(diskname);
+        openDisk(f, diskname, mapped, true);
         f.listFiles();
     } else if (command == "crt") {
         if (argc < 4) {
@@ -37,19 +135,29 @@ int main(int argc, char* argv[]) {
             return 1;
         }
         std::string diskname = argv[2];
-        int disksize = std::stoi(argv[3]);
-        if (disksize <= 0) {
+        long long disksize = std::stoll(argv[3]);
+        if (disksize <= 0 || disksize > 0xFFFFFFFFLL) {
             std::cerr << "Error: <disksize> must be a positive integer.\n";
             return 1;
         }
-        f.createDisk(diskname, disksize);
+        long long inodes = (argc > 4) ? std::stoll(argv[4]) : INODES_NUM;
+        if (inodes <= 0 || inodes > MAX_INODES_NUM) {
+            std::cerr << "Error: [inodes] must be a positive integer not bigger than " << MAX_INODES_NUM << ".\n";
+            return 1;
+        }
+        long long blocksize = (argc > 5) ? std::stoll(argv[5]) : DATABLOCK_SIZE;
+        if (blocksize < MIN_DATABLOCK_SIZE || blocksize > MAX_DATABLOCK_SIZE || (blocksize & (blocksize - 1))) {
+            std::cerr << "Error: [blocksize] must be a power of two from " << MIN_DATABLOCK_SIZE << " to " << MAX_DATABLOCK_SIZE << ".\n";
+            return 1;
+        }
+        f.createDisk(diskname, disksize, inodes, blocksize, dedup);
     } else if (command == "bm") {
         if (argc < 3) {
             std::cerr << "Error: 'bm' requires <diskname>.\n";
             return 1;
         }
         std::string diskname = argv[2];
-        f.loadDisk(diskname);
+        openDisk(f, diskname, mapped, true);
         f.showDiskBitMaps();
     } else if (command == "del") {
         if (argc < 3) {
@@ -65,27 +173,135 @@ int main(int argc, char* argv[]) {
         }
         std::string diskname = argv[2];
         std::string filename = argv[3];
-        f.loadDisk(diskname);
+        openDisk(f, diskname, mapped);
         f.addFile(filename);
+    } else if (command == "ai") {
+        if (argc < 4) {
+            std::cerr << "Error: 'ai' requires <diskname> and <dir|list>.\n";
+            return 1;
+        }
+        std::string diskname = argv[2];
+        std::vector<std::string> fileNames = importList(argv[3]);
+        long long threads = (argc > 4) ? std::stoll(argv[4]) : std::max(1u, std::thread::hardware_concurrency());
+        if (threads <= 0) {
+            std::cerr << "Error: [threads] must be a positive integer.\n";
+            return 1;
+        }
+        openDisk(f, diskname, mapped);
+        f.addFiles(fileNames, threads);
     } else if (command == "df") {
         if (argc < 4) {
-            std::cerr << "Error: 'df' requires <diskname> and <fileindex>.\n";
+            std::cerr << "Error: 'df' requires <diskname> and <file>.\n";
             return 1;
         }
         std::string diskname = argv[2];
-        int fileIndex = std::stoi(argv[3]);
-        f.loadDisk(diskname);
-        f.deleteFile(fileIndex);
+        openDisk(f, diskname, mapped);
+        f.deleteFile(resolveFile(f, argv[3]));
     } else if (command == "gf") {
         if (argc < 4) {
-            std::cerr << "Error: 'gf' requires <diskname>, <fileindex>, and optional <filename>.\n";
+            std::cerr << "Error: 'gf' requires <diskname>, <file>, and optional <filename>.\n";
             return 1;
         }
         std::string diskname = argv[2];
-        int fileIndex = std::stoi(argv[3]);
         std::string filename = (argc > 4) ? argv[4] : "";
-        f.loadDisk(diskname);
-        f.getFile(fileIndex, filename);
+        std::string file = argv[3];
+        openDisk(f, diskname, mapped, true);
+        size_t separator = file.find('/');
+        if (file[0] == '@' && separator != std::string::npos)
+            f.getSnapshotFile(file.substr(1, separator - 1), file.substr(separator + 1), filename);
+        else
+            f.getFile(resolveFile(f, file), filename);
+    } else if (command == "rd") {
+        if (argc < 6) {
+            std::cerr << "Error: 'rd' requires <diskname>, <file>, <offset>, <length> and optional <filename>.\n";
+            return 1;
+        }
+        std::string diskname = argv[2];
+        std::string filename = (argc > 6) ? argv[6] : "";
+        // disk info goes to stderr when file contents are written to stdout
+        std::streambuf* stdoutBuffer = filename.empty() ? std::cout.rdbuf(std::cerr.rdbuf()) : std::cout.rdbuf();
+        openDisk(f, diskname, mapped, true);
+        std::cout.rdbuf(stdoutBuffer);
+        FileHandle handle = f.openFile(resolveFile(f, argv[3]));
+        readRange(f, handle, std::stoull(argv[4]), std::stoull(argv[5]), filename);
+    } else if (command == "wr") {
+        if (argc < 6) {
+            std::cerr << "Error: 'wr' requires <diskname>, <file>, <offset> and <source>.\n";
+            return 1;
+        }
+        std::string diskname = argv[2];
+        openDisk(f, diskname, mapped);
+        FileHandle handle = f.openFile(resolveFile(f, argv[3]));
+        writeRange(f, handle, std::stoull(argv[4]), argv[5], false);
+    } else if (command == "ap") {
+        if (argc < 5) {
+            std::cerr << "Error: 'ap' requires <diskname>, <file> and <source>.\n";
+            return 1;
+        }
+        std::string diskname = argv[2];
+        openDisk(f, diskname, mapped);
+        FileHandle handle = f.openFile(resolveFile(f, argv[3]));
+        writeRange(f, handle, 0, argv[4], true);
+    } else if (command == "tr") {
+        if (argc < 5) {
+            std::cerr << "Error: 'tr' requires <diskname>, <file> and <size>.\n";
+            return 1;
+        }
+        std::string diskname = argv[2];
+        openDisk(f, diskname, mapped);
+        FileHandle handle = f.openFile(resolveFile(f, argv[3]));
+        f.truncateFile(handle, std::stoull(argv[4]));
+        f.closeFile(handle);
+    } else if (command == "defrag") {
+        if (argc < 3) {
+            std::cerr << "Error: 'defrag' requires <diskname>.\n";
+            return 1;
+        }
+        std::string diskname = argv[2];
+        double seconds = (argc > 3) ? std::stod(argv[3]) : 0;
+        long long megabytes = (argc > 4) ? std::stoll(argv[4]) : 0;
+        if (seconds < 0 || megabytes < 0) {
+            std::cerr << "Error: [seconds] and [MB] must not be negative.\n";
+            return 1;
+        }
+        openDisk(f, diskname, mapped);
+        f.defrag(seconds, u_int64_t(megabytes) * 1048576);
+    } else if (command == "fsck") {
+        if (argc < 3) {
+            std::cerr << "Error: 'fsck' requires <diskname>.\n";
+            return 1;
+        }
+        std::string diskname = argv[2];
+        long long threads = (argc > 3) ? std::stoll(argv[3]) : std::max(1u, std::thread::hardware_concurrency());
+        if (threads <= 0) {
+            std::cerr << "Error: [threads] must be a positive integer.\n";
+            return 1;
+        }
+        openDisk(f, diskname, mapped, true);
+        if (f.checkDisk(threads) > 0)
+            return 1;
+    } else if (command == "snap" || command == "dsnap") {
+        if (argc < 4) {
+            std::cerr << "Error: '" << command << "' requires <diskname> and <name>.\n";
+            return 1;
+        }
+        std::string diskname = argv[2];
+        openDisk(f, diskname, mapped);
+        if (command == "snap")
+            f.createSnapshot(argv[3]);
+        else
+            f.deleteSnapshot(argv[3]);
+    } else if (command == "lsnap") {
+        if (argc < 3) {
+            std::cerr << "Error: 'lsnap' requires <diskname>.\n";
+            return 1;
+        }
+        std::string diskname = argv[2];
+        openDisk(f, diskname, mapped, true);
+        if (argc > 3)
+            f.listSnapshotFiles(argv[3]);
+        else
+            f.listSnapshots();
     } else {
         std::cerr << "Error: Unknown command '" << command << "'.\n";
         std::cerr << "Use 'h' for a list of available commands.\n";
@@ -93,4 +309,246 @@ int main(int argc, char* argv[]) {
     }
 
     return 0;
-}
\ No newline at end of file
+}
+
+// sends contents of a local file with a request
+bool sendFile(FileClient& client, Request request, const std::string& file, u_int64_t offset, const std::string& source) {
+    std::ifstream data(source, std::ios::binary);
+    if (!data)
+        throw "Unable to open source file";
+    data.seekg(0, std::ios::end);
+    u_int64_t length = u_int64_t(data.tellg());
+    data.seekg(0, std::ios::beg);
+    return client.request(request, file, offset, length, &data, nullptr);
+}
+
+// same commands as on the command line, run by a server instead of on a disk
+int runClient(const std::string& socketPath, int argc, char* argv[]) {
+    std::string command = argv[0];
+    std::vector<std::string> args(argv + 1, argv + argc);
+    FileClient client(socketPath);
+    std::ofstream target;
+    auto output = [&](size_t i) -> std::ostream& {
+        if (args.size() <= i)
+            return std::cout;
+        target.open(args[i], std::ios::binary | std::ios::out);
+        if (!target)
+            throw "Unable to open target file";
+        return target;
+    };
+    bool done;
+    if (command == "lf" || command == "stats") {
+        done = client.request(command == "lf" ? Request::ListFiles : Request::Stats, "", 0, 0, nullptr, &std::cout);
+    } else if (command == "stop") {
+        done = client.request(Request::Stop, "", 0, 0, nullptr, nullptr);
+    } else if (command == "af" && args.size() >= 1) {
+        done = sendFile(client, Request::AddFile, args[0], 0, args[0]);
+    } else if (command == "df" && args.size() >= 1) {
+        done = client.request(Request::DeleteFile, args[0], 0, 0, nullptr, nullptr);
+    } else if (command == "gf" && args.size() >= 1) {
+        done = client.request(Request::GetFile, args[0], 0, 0, nullptr, &output(1));
+    } else if (command == "rd" && args.size() >= 3) {
+        done = client.request(Request::ReadFile, args[0], std::stoull(args[1]), std::stoull(args[2]), nullptr, &output(3));
+    } else if (command == "wr" && args.size() >= 3) {
+        done = sendFile(client, Request::WriteFile, args[0], std::stoull(args[1]), args[2]);
+    } else if (command == "ap" && args.size() >= 2) {
+        done = sendFile(client, Request::AppendFile, args[0], 0, args[1]);
+    } else if (command == "tr" && args.size() >= 2) {
+        done = client.request(Request::TruncateFile, args[0], 0, std::stoull(args[1]), nullptr, nullptr);
+    } else {
+        std::cerr << "Error: Unknown command or missing arguments for 'cl " << command << "'.\n";
+        std::cerr << "Use 'h' for a list of available commands.\n";
+        return 1;
+    }
+    if (!done) {
+        std::cerr << "Error: " << client.error() << ".\n";
+        return 1;
+    }
+    return 0;
+}
+
+// words of a session line, "double quoted" words may contain spaces
+std::vector<std::string> splitLine(const std::string& line) {
+    std::vector<std::string> words;
+    size_t i = 0;
+    while (i < line.size()) {
+        if (std::isspace((unsigned char)line[i])) {
+            i++;
+            continue;
+        }
+        std::string word;
+        if (line[i] == '"') {
+            size_t close = line.find('"', i + 1);
+            if (close == std::string::npos)
+                throw "Unterminated quote";
+            word = line.substr(i + 1, close - i - 1);
+            i = close + 1;
+        } else {
+            while (i < line.size() && !std::isspace((unsigned char)line[i]))
+                word += line[i++];
+        }
+        words.push_back(word);
+    }
+    return words;
+}
+
+// commands of a script (or stdin) run against one loaded disk, without <diskname>
+// metadata is committed at 'checkpoint' and when the session ends
+int runSession(FileSystem& f, const std::string& diskname, const std::string& script, bool mapped, bool dedup) {
+    std::ifstream scriptFile;
+    if (!script.empty()) {
+        scriptFile.open(script);
+        if (!scriptFile) {
+            std::cerr << "Error: Unable to open script '" << script << "'.\n";
+            return 1;
+        }
+    }
+    std::istream& in = script.empty() ? std::cin : scriptFile;
+    f.loadDisk(diskname, mapped);
+    f.beginBatch();
+    int status = 0;
+    std::string line;
+    size_t lineNumber = 0;
+    while (std::getline(in, line)) {
+        lineNumber++;
+        try {
+            std::vector<std::string> words = splitLine(line);
+            if (words.empty() || words[0][0] == '#')
+                continue;
+            const std::string& command = words[0];
+            if (command == "exit" || command == "q")
+                break;
+            if (command == "checkpoint") {
+                f.commitBatch();
+                f.beginBatch();
+                continue;
+            }
+            if (command == "stats") {
+                ioStats().print(std::cout);
+                continue;
+            }
+            if (command == "crt" || command == "del" || command == "ses" || command == "srv" || command == "cl") {
+                std::cerr << "Error: '" << command << "' is not available in a session.\n";
+                status = 1;
+                continue;
+            }
+            // same arguments as on the command line, with the session disk inserted
+            std::vector<std::string> args = {"ses", command};
+            if (command != "h")
+                args.push_back(diskname);
+            args.insert(args.end(), words.begin() + 1, words.end());
+            std::vector<char*> commandArgv;
+            for (auto& arg : args)
+                commandArgv.push_back(arg.data());
+            if (runCommand(f, commandArgv.size(), commandArgv.data(), mapped, dedup) != 0)
+                status = 1;
+        } catch (const char* error) {
+            std::cerr << "Error: " << error << " (line " << lineNumber << ")\n";
+            status = 1;
+        } catch (const std::exception& error) {
+            std::cerr << "Error: Invalid argument (line " << lineNumber << ")\n";
+            status = 1;
+        }
+    }
+    f.commitBatch();
+    return status;
+}
+
+int run(int argc, char* argv[], bool& printStats) {
+    bool mapped = false;
+    bool dedup = false;
+    bool compression = false;
+    bool verification = false;
+    AllocationPolicy policy = AllocationPolicy::BestFit;
+    while (argc > 1 && argv[1][0] == '-') {
+        std::string option = argv[1];
+        if (option == "-m") {
+            mapped = true;
+        } else if (option == "-c") {
+            compression = true;
+        } else if (option == "-v") {
+            verification = true;
+        } else if (option == "-d") {
+            dedup = true;
+        } else if (option == "-j" && argc > 2) {
+            dumpStatsAtExit(argv[2]);
+            argv++;
+            argc--;
+        } else if (option == "-a" && argc > 2 && std::string(argv[2]) == "best") {
+            policy = AllocationPolicy::BestFit;
+            argv++;
+            argc--;
+        } else if (option == "-a" && argc > 2 && std::string(argv[2]) == "next") {
+            policy = AllocationPolicy::NextFit;
+            argv++;
+            argc--;
+        } else {
+            std::cerr << "Error: Unknown option '" << option << "'.\n";
+            return 1;
+        }
+        argv++;
+        argc--;
+    }
+    if (argc < 2) {
+        std::cerr << "Error: Not enough arguments.\n";
+        std::cerr << "Usage: <command> [arguments]\n";
+        std::cerr << "Use 'h' for a list of available commands.\n";
+        return 1;
+    }
+    if (std::string(argv[1]) == "stats") {
+        if (argc < 3) {
+            std::cerr << "Error: 'stats' requires a command.\n";
+            return 1;
+        }
+        printStats = true;
+        argv++;
+        argc--;
+    }
+    if (std::string(argv[1]) == "cl") {
+        if (argc < 4) {
+            std::cerr << "Error: 'cl' requires <socket> and <command>.\n";
+            return 1;
+        }
+        return runClient(argv[2], argc - 3, argv + 3);
+    }
+    FileSystem f;
+    f.setAllocationPolicy(policy);
+    f.setCompression(compression);
+    f.setImportVerification(verification);
+    if (std::string(argv[1]) == "ses") {
+        if (argc < 3) {
+            std::cerr << "Error: 'ses' requires <diskname>.\n";
+            return 1;
+        }
+        return runSession(f, argv[2], (argc > 3) ? argv[3] : "", mapped, dedup);
+    }
+    if (std::string(argv[1]) == "srv") {
+        if (argc < 4) {
+            std::cerr << "Error: 'srv' requires <diskname> and <socket>.\n";
+            return 1;
+        }
+        f.loadDisk(argv[2], mapped);
+        FileServer(f).serve(argv[3]);
+        return 0;
+    }
+    return runCommand(f, argc, argv, mapped, dedup);
+}
+
+int main(int argc, char* argv[]) {
+    bool printStats = false;
+    int status = 1;
+    try {
+        status = run(argc, argv, printStats);
+    } catch (const char* error) {
+        std::cerr << "Error: " << error << "\n";
+    } catch (const std::logic_error&) {
+        // numbers std::stoull and friends could not parse
+        std::cerr << "Error: Invalid argument.\n";
+        std::cerr << "Use 'h' for a list of available commands.\n";
+    } catch (const std::exception& error) {
+        std::cerr << "Error: " << error.what() << "\n";
+    }
+    if (printStats)
+        ioStats().print(std::cerr);
+    return status;
+}